@@ -1,25 +1,30 @@
 #include "compiler.h"
 
-ve_program compileCommandList(const cc_list &cmds, size_t required_memory_size) {
-
-    // Calculate the size in bytes of the program
-    size_t program_size = 0;
-    for(compiler_command* cmd : cmds)
-        program_size += cmd->size();
+#include <algorithm>
 
-    // Create the program byte array
-    vbyte* program_data = new vbyte[program_size];
+ve_program compileCommandList(const cc_list &cmds, size_t required_memory_size) {
 
     DEBUG_PRINT("Compiling");
-    DEBUG_PRINT("Program Size: " << program_size);
 
-    // Compile the commands into the byte array
-    size_t index = 0;
+    // Emit the commands into a growable byte array in a single pass; label addresses are patched afterwards
+    std::vector<vbyte> program_data;
+    program_data.reserve(cmds.size() * 4);
+    std::vector<label_map*> maps;
     for(compiler_command* cmd : cmds) {
+        size_t index = program_data.size();
         DEBUG_PRINT_CMD(index, cmd->command());
-        cmd->compile(program_data, index);
-        index += cmd->size();
+        program_data.resize(index + cmd->size());
+        cmd->compile(program_data.data(), index);
+        label_map* map = cmd->labels();
+        if(map != nullptr && std::find(maps.begin(), maps.end(), map) == maps.end()) maps.push_back(map);
     }
 
-    return ve_program(program_size, program_data, required_memory_size);
-}
\ No newline at end of file
+    // Resolve label fixups now that every label position is known
+    for(label_map* map : maps)
+        map->resolve(program_data.data());
+
+    DEBUG_PRINT("Program Size: " << program_data.size());
+
+    // Hand the byte array over to the program without copying
+    return ve_program(std::move(program_data), required_memory_size);
+}
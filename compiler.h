@@ -4,9 +4,39 @@
 #include "ve_commands.h"
 #include "virtual_environment.h"
 
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+// Bump whenever the same commands or AST compile to different bytecode; invalidates persistently cached programs
+#define SWM_COMPILER_VERSION 13
+
+class label_map;
+
+class CompileException : public std::runtime_error {
+public:
+    enum Type {
+        DUPLICATE_LABEL
+    };
+
+    Type type() { return _type; }
+
+    static CompileException DuplicateLabel(const std::string &label) {
+        return CompileException(DUPLICATE_LABEL,
+                                "The Label '" + label + "' is placed more than once");
+    }
+
+protected:
+    CompileException(Type type, const std::string &msg) : runtime_error(msg), _type(type) {}
+    Type _type;
+};
+
 struct compiler_command {
     virtual void compile(vbyte* result, size_t pos) const = 0;
     virtual size_t size() const = 0;
@@ -15,6 +45,19 @@ struct compiler_command {
     virtual std::string to_string() const {
         return "[" + std::bitset<8>(command()).to_string() + "][" + name() + "]";
     };
+    // Label map the command reads from or writes to during compilation, if any
+    virtual label_map* labels() const { return nullptr; }
+    // Whether the command reads or overwrites the given register; used by passes over the command list
+    virtual bool reads(vbyte reg) const { return false; }
+    virtual bool writes(vbyte reg) const { return false; }
+    // Same for one of the command's own register fields, so it can be asked before registers are assigned
+    virtual bool readsField(const vbyte* field) const { return false; }
+    virtual bool writesField(const vbyte* field) const { return false; }
+    // Position and width of a constant heap address within the compiled command, if it has one; used for relocation
+    virtual bool heapAddress(size_t &offset, BitWidth &width) const { return false; }
+    // Whether the command may access memory at an address only known at runtime, changes the heap or ends the program
+    virtual bool memoryBarrier() const { return false; }
+    virtual ~compiler_command() {}
 protected:
     static vbyte widthFlag(BitWidth width, bool shifted = false) {
         if(shifted) {
@@ -37,6 +80,176 @@ protected:
     }
 };
 
+// List of compiler commands constructed in place inside arena blocks that grow geometrically.
+// Commands never move once constructed, so iterators stay valid until the command is erased or the list destroyed.
+class cc_list {
+protected:
+    struct node {
+        node* prev;
+        node* next;
+        compiler_command* cmd;
+    };
+
+    static const size_t BLOCK_MINIMUM = 4096;
+    static const size_t NODE_SIZE = (sizeof(node) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    node _head; // Sentinel; _head.next is the first command and _head.prev the last
+    size_t _size = 0;
+
+    std::vector<std::unique_ptr<char[]>> _blocks;
+    char* _block_pos = nullptr;
+    size_t _block_left = 0;
+    size_t _next_block_size = BLOCK_MINIMUM;
+
+    void* allocate(size_t size) {
+        size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+        if(size > _block_left) {
+            size_t block_size = _next_block_size;
+            while(block_size < size) block_size *= 2;
+            _blocks.push_back(std::unique_ptr<char[]>(new char[block_size]));
+            _block_pos = _blocks.back().get();
+            _block_left = block_size;
+            _next_block_size = block_size * 2;
+        }
+        void* result = _block_pos;
+        _block_pos += size;
+        _block_left -= size;
+        return result;
+    }
+
+    void link(node* n, node* before) {
+        n->prev = before->prev;
+        n->next = before;
+        before->prev->next = n;
+        before->prev = n;
+        _size++;
+    }
+
+    void resetHead() {
+        _head.prev = &_head;
+        _head.next = &_head;
+        _head.cmd = nullptr;
+        _size = 0;
+    }
+
+    void destroyAll() {
+        for(node* n = _head.next; n != &_head; n = n->next)
+            n->cmd->~compiler_command();
+        resetHead();
+    }
+
+    template<typename T, typename Ptr>
+    struct iterator_base {
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef compiler_command* value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Ptr* pointer;
+        typedef Ptr& reference;
+
+        T* _node = nullptr;
+        iterator_base() {}
+        iterator_base(T* n) : _node(n) {}
+
+        reference operator*() const { return _node->cmd; }
+        pointer operator->() const { return &_node->cmd; }
+        iterator_base &operator++() { _node = _node->next; return *this; }
+        iterator_base &operator--() { _node = _node->prev; return *this; }
+        iterator_base operator++(int) { iterator_base r = *this; _node = _node->next; return r; }
+        iterator_base operator--(int) { iterator_base r = *this; _node = _node->prev; return r; }
+        bool operator==(const iterator_base &rhs) const { return _node == rhs._node; }
+        bool operator!=(const iterator_base &rhs) const { return _node != rhs._node; }
+    };
+
+public:
+    typedef iterator_base<node, compiler_command*> iterator;
+    typedef iterator_base<const node, compiler_command* const> const_iterator;
+
+    cc_list() { resetHead(); }
+    cc_list(const cc_list &rhs) = delete;
+    cc_list &operator=(const cc_list &rhs) = delete;
+
+    cc_list(cc_list &&rhs) {
+        resetHead();
+        *this = std::move(rhs);
+    }
+
+    cc_list &operator=(cc_list &&rhs) {
+        if(this == &rhs) return *this;
+        destroyAll();
+        _blocks.clear();
+        _block_pos = nullptr;
+        _block_left = 0;
+        _next_block_size = BLOCK_MINIMUM;
+        splice(end(), rhs);
+        return *this;
+    }
+
+    ~cc_list() { destroyAll(); }
+
+    // Constructs a command of type T in place before pos
+    template<typename T, typename... Args>
+    T* emplace(iterator pos, Args&&... args) {
+        char* mem = (char*) allocate(NODE_SIZE + sizeof(T));
+        T* cmd = new (mem + NODE_SIZE) T(std::forward<Args>(args)...);
+        node* n = (node*) mem;
+        n->cmd = cmd;
+        link(n, pos._node);
+        return cmd;
+    }
+
+    template<typename T, typename... Args>
+    T* emplace_back(Args&&... args) { return emplace<T>(end(), std::forward<Args>(args)...); }
+
+    // Destroys the command; its memory is reclaimed with the arena
+    iterator erase(iterator pos) {
+        node* n = pos._node;
+        node* next = n->next;
+        n->prev->next = next;
+        next->prev = n->prev;
+        n->cmd->~compiler_command();
+        _size--;
+        return iterator(next);
+    }
+
+    // Moves all commands of other before pos, taking over its arena blocks
+    void splice(iterator pos, cc_list &other) {
+        if(&other == this) return;
+        if(!other.empty()) {
+            node* first = other._head.next;
+            node* last = other._head.prev;
+            node* before = pos._node;
+            first->prev = before->prev;
+            last->next = before;
+            before->prev->next = first;
+            before->prev = last;
+            _size += other._size;
+        }
+        other.resetHead();
+        for(std::unique_ptr<char[]> &block : other._blocks)
+            _blocks.push_back(std::move(block));
+        other._blocks.clear();
+        other._block_pos = nullptr;
+        other._block_left = 0;
+        other._next_block_size = BLOCK_MINIMUM;
+    }
+
+    void clear() { destroyAll(); }
+
+    iterator begin() { return iterator(_head.next); }
+    iterator end() { return iterator(&_head); }
+    const_iterator begin() const { return const_iterator(_head.next); }
+    const_iterator end() const { return const_iterator(&_head); }
+
+    compiler_command* front() const { return _head.next->cmd; }
+    compiler_command* back() const { return _head.prev->cmd; }
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+};
+
+typedef cc_list::iterator cc_iter;
+typedef cc_list::const_iterator cc_const_iter;
+
 ve_program compileCommandList(const cc_list &cmds, size_t required_memory_size);
 
 struct cc_nop : public compiler_command {
@@ -51,6 +264,52 @@ struct cc_halt : public compiler_command {
     virtual size_t size() const { return 1; }
     virtual vbyte command() const { return CMD_HALT; }
     virtual std::string name() const { return "HALT"; }
+    virtual bool memoryBarrier() const { return true; }
+};
+
+struct cc_alloc : public compiler_command {
+    vbyte _size_register;
+    vbyte _out_register;
+    cc_alloc(vbyte size_register, vbyte out_register)
+            : _size_register(size_register), _out_register(out_register) {}
+    virtual void compile(vbyte* result, size_t pos) const {
+        result[pos + 0] = command();
+        result[pos + 1] = _size_register;
+        result[pos + 2] = _out_register;
+    }
+    virtual size_t size() const { return 3; }
+    virtual vbyte command() const { return CMD_ALLOC; }
+    virtual std::string name() const { return "ALLOC"; }
+    virtual std::string to_string() const {
+        return compiler_command::to_string()
+               + " SizeRegister=" + std::to_string(_size_register)
+               + ", OutRegister=" + std::to_string(_out_register);
+    }
+    virtual bool reads(vbyte reg) const { return reg == _size_register; }
+    virtual bool writes(vbyte reg) const { return reg == _out_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_size_register; }
+    virtual bool writesField(const vbyte* field) const { return field == &_out_register; }
+    virtual bool memoryBarrier() const { return true; }
+};
+
+struct cc_free : public compiler_command {
+    vbyte _address_register;
+    cc_free(vbyte address_register)
+            : _address_register(address_register) {}
+    virtual void compile(vbyte* result, size_t pos) const {
+        result[pos + 0] = command();
+        result[pos + 1] = _address_register;
+    }
+    virtual size_t size() const { return 2; }
+    virtual vbyte command() const { return CMD_FREE; }
+    virtual std::string name() const { return "FREE"; }
+    virtual std::string to_string() const {
+        return compiler_command::to_string()
+               + " AddressRegister=" + std::to_string(_address_register);
+    }
+    virtual bool reads(vbyte reg) const { return reg == _address_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_address_register; }
+    virtual bool memoryBarrier() const { return true; }
 };
 
 struct cc_move_to_register : public compiler_command {
@@ -72,6 +331,11 @@ struct cc_move_to_register : public compiler_command {
                + " TargetRegister=" + std::to_string(_target_register)
                + ", AddressRegister=" + std::to_string(_mem_address_register);
     }
+    virtual bool reads(vbyte reg) const { return reg == _mem_address_register; }
+    virtual bool writes(vbyte reg) const { return reg == _target_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_mem_address_register; }
+    virtual bool writesField(const vbyte* field) const { return field == &_target_register; }
+    virtual bool memoryBarrier() const { return true; }
 };
 
 struct cc_move_to_register_constant : public compiler_command {
@@ -98,11 +362,14 @@ struct cc_move_to_register_constant : public compiler_command {
     virtual size_t size() const { return (size_t)(2+_mem_address._width); }
     virtual vbyte command() const { return (vbyte)(CMD_MVTOREG_CONST | widthFlag(_width) | widthFlag(_mem_address._width, true)); }
     virtual std::string name() const { return "MVTOREG_CONST"; }
+    virtual bool heapAddress(size_t &offset, BitWidth &width) const { offset = 2; width = _mem_address._width; return true; }
     virtual std::string to_string() const {
         return compiler_command::to_string()
                + " TargetRegister=" + std::to_string(_target_register)
                + ", Address=" + std::to_string(_mem_address);
     }
+    virtual bool writes(vbyte reg) const { return reg == _target_register; }
+    virtual bool writesField(const vbyte* field) const { return field == &_target_register; }
 };
 
 struct cc_move_to_memory : public compiler_command {
@@ -124,6 +391,9 @@ struct cc_move_to_memory : public compiler_command {
                + " TargetRegister=" + std::to_string(_target_register)
                + ", AddressRegister=" + std::to_string(_mem_address_register);
     }
+    virtual bool reads(vbyte reg) const { return reg == _target_register || reg == _mem_address_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_target_register || field == &_mem_address_register; }
+    virtual bool memoryBarrier() const { return true; }
 };
 
 struct cc_move_to_memory_constant : public compiler_command {
@@ -150,11 +420,14 @@ struct cc_move_to_memory_constant : public compiler_command {
     virtual size_t size() const { return (size_t)(2+_mem_address._width); }
     virtual vbyte command() const { return (vbyte) (CMD_MVTOMEM_CONST | widthFlag(_width) | widthFlag(_mem_address._width, true)); }
     virtual std::string name() const { return "MVTOMEM_CONST"; }
+    virtual bool heapAddress(size_t &offset, BitWidth &width) const { offset = 2; width = _mem_address._width; return true; }
     virtual std::string to_string() const {
         return compiler_command::to_string()
                + " TargetRegister=" + std::to_string(_target_register)
                + ", Address=" + std::to_string(_mem_address);
     }
+    virtual bool reads(vbyte reg) const { return reg == _target_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_target_register; }
 };
 
 struct cc_load_constant : public compiler_command {
@@ -185,6 +458,8 @@ struct cc_load_constant : public compiler_command {
                 + " TargetRegister=" + std::to_string(_target_register)
                 + ", Value=" + std::to_string(_value);
     }
+    virtual bool writes(vbyte reg) const { return reg == _target_register; }
+    virtual bool writesField(const vbyte* field) const { return field == &_target_register; }
 };
 
 struct cc_copy_register : public compiler_command {
@@ -205,6 +480,10 @@ struct cc_copy_register : public compiler_command {
                 + " FromRegister=" + std::to_string(_from_register)
                 + ", ToRegister=" + std::to_string(_to_register);
     }
+    virtual bool reads(vbyte reg) const { return reg == _from_register; }
+    virtual bool writes(vbyte reg) const { return reg == _to_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_from_register; }
+    virtual bool writesField(const vbyte* field) const { return field == &_to_register; }
 };
 
 struct cc_alu_double_operation : public compiler_command {
@@ -226,6 +505,10 @@ struct cc_alu_double_operation : public compiler_command {
                 + ", RegisterInB=" + std::to_string(_in_register_b)
                 + ", RegisterOut=" + std::to_string(_out_register);
     }
+    virtual bool reads(vbyte reg) const { return reg == _in_register_a || reg == _in_register_b; }
+    virtual bool writes(vbyte reg) const { return reg == _out_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_in_register_a || field == &_in_register_b; }
+    virtual bool writesField(const vbyte* field) const { return field == &_out_register; }
 };
 
 struct cc_alu_addition : public cc_alu_double_operation {
@@ -263,6 +546,48 @@ struct cc_alu_modulus : public cc_alu_double_operation {
             : cc_alu_double_operation(in_register_a, in_register_b, out_register) {}
 };
 
+struct cc_alu_and : public cc_alu_double_operation {
+    virtual vbyte command() const { return CMD_ALU_AND; }
+    virtual std::string name() const { return "ALU_AND"; }
+    cc_alu_and(vbyte in_register_a, vbyte in_register_b, vbyte out_register)
+            : cc_alu_double_operation(in_register_a, in_register_b, out_register) {}
+};
+
+struct cc_alu_or : public cc_alu_double_operation {
+    virtual vbyte command() const { return CMD_ALU_OR; }
+    virtual std::string name() const { return "ALU_OR"; }
+    cc_alu_or(vbyte in_register_a, vbyte in_register_b, vbyte out_register)
+            : cc_alu_double_operation(in_register_a, in_register_b, out_register) {}
+};
+
+struct cc_alu_xor : public cc_alu_double_operation {
+    virtual vbyte command() const { return CMD_ALU_XOR; }
+    virtual std::string name() const { return "ALU_XOR"; }
+    cc_alu_xor(vbyte in_register_a, vbyte in_register_b, vbyte out_register)
+            : cc_alu_double_operation(in_register_a, in_register_b, out_register) {}
+};
+
+struct cc_alu_shift_left : public cc_alu_double_operation {
+    virtual vbyte command() const { return CMD_ALU_SHL; }
+    virtual std::string name() const { return "ALU_SHL"; }
+    cc_alu_shift_left(vbyte in_register_a, vbyte in_register_b, vbyte out_register)
+            : cc_alu_double_operation(in_register_a, in_register_b, out_register) {}
+};
+
+struct cc_alu_shift_right : public cc_alu_double_operation {
+    virtual vbyte command() const { return CMD_ALU_SHR; }
+    virtual std::string name() const { return "ALU_SHR"; }
+    cc_alu_shift_right(vbyte in_register_a, vbyte in_register_b, vbyte out_register)
+            : cc_alu_double_operation(in_register_a, in_register_b, out_register) {}
+};
+
+struct cc_alu_shift_arithmetic : public cc_alu_double_operation {
+    virtual vbyte command() const { return CMD_ALU_SAR; }
+    virtual std::string name() const { return "ALU_SAR"; }
+    cc_alu_shift_arithmetic(vbyte in_register_a, vbyte in_register_b, vbyte out_register)
+            : cc_alu_double_operation(in_register_a, in_register_b, out_register) {}
+};
+
 struct cc_alu_const_operation : public compiler_command {
     vbyte _in_register;
     vbyte _out_register;
@@ -292,6 +617,10 @@ struct cc_alu_const_operation : public compiler_command {
                + ", Value=" + std::to_string(_value)
                + ", RegisterOut=" + std::to_string(_out_register);
     }
+    virtual bool reads(vbyte reg) const { return reg == _in_register; }
+    virtual bool writes(vbyte reg) const { return reg == _out_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_in_register; }
+    virtual bool writesField(const vbyte* field) const { return field == &_out_register; }
 };
 
 struct cc_alu_const_add : public cc_alu_const_operation {
@@ -342,6 +671,60 @@ struct cc_alu_const_modulus : public cc_alu_const_operation {
             : cc_alu_const_operation(in_register, out_register, value, width), _lhs(lhs) {}
 };
 
+struct cc_alu_const_and : public cc_alu_const_operation {
+    virtual vbyte command() const { return (vbyte) (CMD_ALU_AND_CONST | widthFlag(_value._width)); }
+    virtual std::string name() const { return "ALU_AND_CONST"; }
+    cc_alu_const_and(vbyte in_register, vbyte out_register, VariableValue value)
+            : cc_alu_const_operation(in_register, out_register, value) {}
+    cc_alu_const_and(vbyte in_register, vbyte out_register, int64_t value, BitWidth width)
+            : cc_alu_const_operation(in_register, out_register, value, width) {}
+};
+
+struct cc_alu_const_or : public cc_alu_const_operation {
+    virtual vbyte command() const { return (vbyte) (CMD_ALU_OR_CONST | widthFlag(_value._width)); }
+    virtual std::string name() const { return "ALU_OR_CONST"; }
+    cc_alu_const_or(vbyte in_register, vbyte out_register, VariableValue value)
+            : cc_alu_const_operation(in_register, out_register, value) {}
+    cc_alu_const_or(vbyte in_register, vbyte out_register, int64_t value, BitWidth width)
+            : cc_alu_const_operation(in_register, out_register, value, width) {}
+};
+
+struct cc_alu_const_xor : public cc_alu_const_operation {
+    virtual vbyte command() const { return (vbyte) (CMD_ALU_XOR_CONST | widthFlag(_value._width)); }
+    virtual std::string name() const { return "ALU_XOR_CONST"; }
+    cc_alu_const_xor(vbyte in_register, vbyte out_register, VariableValue value)
+            : cc_alu_const_operation(in_register, out_register, value) {}
+    cc_alu_const_xor(vbyte in_register, vbyte out_register, int64_t value, BitWidth width)
+            : cc_alu_const_operation(in_register, out_register, value, width) {}
+};
+
+struct cc_alu_const_shift_left : public cc_alu_const_operation {
+    virtual vbyte command() const { return (vbyte) (CMD_ALU_SHL_CONST | widthFlag(_value._width)); }
+    virtual std::string name() const { return "ALU_SHL_CONST"; }
+    cc_alu_const_shift_left(vbyte in_register, vbyte out_register, VariableValue value)
+            : cc_alu_const_operation(in_register, out_register, value) {}
+    cc_alu_const_shift_left(vbyte in_register, vbyte out_register, int64_t value, BitWidth width)
+            : cc_alu_const_operation(in_register, out_register, value, width) {}
+};
+
+struct cc_alu_const_shift_right : public cc_alu_const_operation {
+    virtual vbyte command() const { return (vbyte) (CMD_ALU_SHR_CONST | widthFlag(_value._width)); }
+    virtual std::string name() const { return "ALU_SHR_CONST"; }
+    cc_alu_const_shift_right(vbyte in_register, vbyte out_register, VariableValue value)
+            : cc_alu_const_operation(in_register, out_register, value) {}
+    cc_alu_const_shift_right(vbyte in_register, vbyte out_register, int64_t value, BitWidth width)
+            : cc_alu_const_operation(in_register, out_register, value, width) {}
+};
+
+struct cc_alu_const_shift_arithmetic : public cc_alu_const_operation {
+    virtual vbyte command() const { return (vbyte) (CMD_ALU_SAR_CONST | widthFlag(_value._width)); }
+    virtual std::string name() const { return "ALU_SAR_CONST"; }
+    cc_alu_const_shift_arithmetic(vbyte in_register, vbyte out_register, VariableValue value)
+            : cc_alu_const_operation(in_register, out_register, value) {}
+    cc_alu_const_shift_arithmetic(vbyte in_register, vbyte out_register, int64_t value, BitWidth width)
+            : cc_alu_const_operation(in_register, out_register, value, width) {}
+};
+
 struct cc_alu_single_operation : public compiler_command {
     vbyte _register;
     cc_alu_single_operation(vbyte in_register)
@@ -355,6 +738,10 @@ struct cc_alu_single_operation : public compiler_command {
         return compiler_command::to_string()
                + " TargetRegister=" + std::to_string(_register);
     }
+    virtual bool reads(vbyte reg) const { return reg == _register; }
+    virtual bool writes(vbyte reg) const { return reg == _register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_register; }
+    virtual bool writesField(const vbyte* field) const { return field == &_register; }
 };
 
 struct cc_alu_inversion : public cc_alu_single_operation {
@@ -375,6 +762,12 @@ struct cc_alu_decrement : public cc_alu_single_operation {
     cc_alu_decrement(vbyte in_register) : cc_alu_single_operation(in_register) {}
 };
 
+struct cc_alu_not : public cc_alu_single_operation {
+    virtual vbyte command() const { return CMD_ALU_NOT; }
+    virtual std::string name() const { return "ALU_NOT"; }
+    cc_alu_not(vbyte in_register) : cc_alu_single_operation(in_register) {}
+};
+
 struct cc_alu_move_operation : public compiler_command {
     vbyte _in_register;
     vbyte _out_register;
@@ -391,6 +784,10 @@ struct cc_alu_move_operation : public compiler_command {
                 + " InRegister=" + std::to_string(_in_register)
                 + ", OutRegister=" + std::to_string(_out_register);
     }
+    virtual bool reads(vbyte reg) const { return reg == _in_register; }
+    virtual bool writes(vbyte reg) const { return reg == _out_register; }
+    virtual bool readsField(const vbyte* field) const { return field == &_in_register; }
+    virtual bool writesField(const vbyte* field) const { return field == &_out_register; }
 };
 
 struct cc_alu_move_inversion : public cc_alu_move_operation {
@@ -411,14 +808,32 @@ struct cc_alu_move_decrement : public cc_alu_move_operation {
     cc_alu_move_decrement(vbyte in_register, vbyte out_register) : cc_alu_move_operation(in_register, out_register) {}
 };
 
+struct cc_alu_move_not : public cc_alu_move_operation {
+    virtual vbyte command() const { return CMD_ALU_NOT_MV; }
+    virtual std::string name() const { return "ALU_NOT_MV"; }
+    cc_alu_move_not(vbyte in_register, vbyte out_register) : cc_alu_move_operation(in_register, out_register) {}
+};
+
+// Labels are small integer handles into a label_map; names are optional and only used for printing
+typedef size_t label_id;
+#define SWM_LABEL_NONE (label_id)-1
+
+#if defined(DEBUG_MODE)
+#define SWM_LABEL_KEEP_NAMES true
+#else
+#define SWM_LABEL_KEEP_NAMES false
+#endif
+
 class label_map {
+public:
+    typedef struct { label_id label; size_t offset; BitWidth width; } FixupStruct;
 protected:
-    typedef struct { vbyte* pos; size_t offset; BitWidth width; } CacheStruct;
-    typedef std::unordered_map<std::string, size_t> LabelMap;
-    typedef std::unordered_multimap<std::string, CacheStruct> LabelMultimap;
-    LabelMap _map;
-    LabelMap _uniques;
-    LabelMultimap _cache;
+    static const size_t UNRESOLVED = (size_t)-1;
+    std::vector<size_t> _positions;
+    std::vector<const char*> _names;
+    std::vector<FixupStruct> _fixups;
+    size_t _resolved_count = 0;
+    bool _keep_names;
 
     void internSet(size_t index, vbyte* pos, size_t offset, BitWidth width) {
         VariableValue val(index, width);
@@ -435,62 +850,85 @@ protected:
 
 public:
 
-    void insert(const std::string &label, size_t index) {
-        if(_map.count(label)) return; // TODO: Throw exception if label exists
-        _map[label] = index;
-        std::pair<LabelMultimap::iterator, LabelMultimap::iterator> range = _cache.equal_range(label);
-        LabelMultimap::iterator it = range.first;
-        while(it != range.second) {
-            internSet(index, it->second.pos, it->second.offset, it->second.width);
-            it++;
+    label_map(bool keep_names = SWM_LABEL_KEEP_NAMES) : _keep_names(keep_names) {}
+
+    // Creates count consecutive labels and returns the first; the name must outlive the map (e.g. a string literal)
+    label_id create(const char* name = nullptr, size_t count = 1) {
+        label_id first = _positions.size();
+        _positions.resize(first + count, (size_t)UNRESOLVED);
+        if(_keep_names) _names.resize(first + count, name);
+        return first;
+    }
+
+    void insert(label_id label, size_t index) {
+        if(_positions[label] != UNRESOLVED) throw CompileException::DuplicateLabel(name(label));
+        _positions[label] = index;
+        _resolved_count++;
+    }
+
+    // Records a label address to write into the program once every label position is known
+    void addFixup(label_id label, size_t offset, BitWidth width) {
+        _fixups.push_back({ label, offset, width });
+    }
+
+    // Writes all resolvable fixups into the program; fixups for unplaced labels are kept
+    void resolve(vbyte* program) {
+        size_t kept = 0;
+        for(FixupStruct &fixup : _fixups) {
+            size_t index = _positions[fixup.label];
+            if(index != UNRESOLVED) internSet(index, program, fixup.offset, fixup.width);
+            else _fixups[kept++] = fixup;
         }
-        _cache.erase(range.first, range.second);
+        _fixups.resize(kept);
     }
 
-    void setIndex(const std::string &label, vbyte* pos, size_t offset, BitWidth width) {
-        if(_map.count(label)) internSet(_map[label], pos, offset, width);
-        else _cache.insert( {{ label, { pos, offset, width }}} );
+    bool position(label_id label, size_t &index) const {
+        if(label >= _positions.size() || _positions[label] == UNRESOLVED) return false;
+        index = _positions[label];
+        return true;
     }
 
-    size_t size() const { return _map.size(); }
-    size_t cacheSize() const { return _cache.size(); }
+    // Pending fixups, for callers that resolve them some other way than resolve()
+    const std::vector<FixupStruct> &fixups() const { return _fixups; }
+    void clearFixups() { _fixups.clear(); }
 
-    std::string uniqueLabel(const std::string &label) {
-        size_t id = 0;
-        if(_uniques.count(label))
-            id = ++_uniques[label];
-        else
-            _uniques.insert({{ label, 0 }});
-        return label + "_" + std::to_string(id);
+    std::string name(label_id label) const {
+        const char* prefix = (label < _names.size() && _names[label] != nullptr) ? _names[label] : "Label";
+        return std::string(prefix) + "_" + std::to_string(label);
     }
+
+    size_t size() const { return _resolved_count; }
+    size_t cacheSize() const { return _fixups.size(); }
 };
 
 struct cc_label : public compiler_command {
     label_map &_map;
-    std::string _label;
-    cc_label(label_map &map, const std::string &label) : _map(map), _label(label) {}
+    label_id _label;
+    cc_label(label_map &map, label_id label) : _map(map), _label(label) {}
     virtual void compile(vbyte* result, size_t pos) const {
         _map.insert(_label, pos);
     }
     virtual size_t size() const { return 0; }
     virtual vbyte command() const { return CMD_NOP; }
     virtual std::string name() const { return "LABEL"; }
-    virtual std::string to_string() const { return "[LABEL] " + _label; }
+    virtual std::string to_string() const { return "[LABEL] " + _map.name(_label); }
+    virtual label_map* labels() const { return &_map; }
 };
 
 struct cc_jump_operation : public compiler_command {
     label_map &_map;
-    std::string _label;
+    label_id _label;
     virtual size_t addressOffset() const = 0;
-    cc_jump_operation(label_map &map, const std::string &label) : _map(map), _label(label) {}
+    cc_jump_operation(label_map &map, label_id label) : _map(map), _label(label) {}
     virtual void compile(vbyte* result, size_t pos) const {
         result[pos + 0] = command();
-        _map.setIndex(_label, result, pos + addressOffset(), BIT_64);
+        _map.addFixup(_label, pos + addressOffset(), BIT_64);
     }
     virtual size_t size() const { return (size_t)(addressOffset()+BIT_64); }
+    virtual label_map* labels() const { return &_map; }
     virtual std::string to_string() const {
         return compiler_command::to_string()
-               + " Label=" + _label;
+               + " Label=" + _map.name(_label);
     }
 };
 
@@ -498,7 +936,7 @@ struct cc_jump : public cc_jump_operation {
     virtual size_t addressOffset() const { return 1; }
     virtual vbyte command() const { return (vbyte) (CMD_JMP | widthFlag(BIT_64)); }
     virtual std::string name() const { return "JMP"; }
-    cc_jump(label_map &map, const std::string &label)
+    cc_jump(label_map &map, label_id label)
             : cc_jump_operation(map, label) {}
 };
 
@@ -508,7 +946,7 @@ struct cc_jump_equal : public cc_jump_operation {
     virtual size_t addressOffset() const { return 3; }
     virtual vbyte command() const { return (vbyte) (CMD_JMP_EQL | widthFlag(BIT_64)); }
     virtual std::string name() const { return "JMP_EQL"; }
-    cc_jump_equal(label_map &map, const std::string &label, vbyte register_a, vbyte register_b)
+    cc_jump_equal(label_map &map, label_id label, vbyte register_a, vbyte register_b)
             : cc_jump_operation(map, label), _register_a(register_a), _register_b(register_b) {}
     virtual void compile(vbyte* result, size_t pos) const {
         cc_jump_operation::compile(result, pos);
@@ -520,6 +958,8 @@ struct cc_jump_equal : public cc_jump_operation {
                 + ", RegisterA=" + std::to_string(_register_a)
                 + ", RegisterB=" + std::to_string(_register_b);
     }
+    virtual bool reads(vbyte reg) const { return reg == _register_a || reg == _register_b; }
+    virtual bool readsField(const vbyte* field) const { return field == &_register_a || field == &_register_b; }
 };
 
 struct cc_jump_not_equal : public cc_jump_operation {
@@ -528,7 +968,7 @@ struct cc_jump_not_equal : public cc_jump_operation {
     virtual size_t addressOffset() const { return 3; }
     virtual vbyte command() const { return (vbyte) (CMD_JMP_NEQL | widthFlag(BIT_64)); }
     virtual std::string name() const { return "JMP_NEQL"; }
-    cc_jump_not_equal(label_map &map, const std::string &label, vbyte register_a, vbyte register_b)
+    cc_jump_not_equal(label_map &map, label_id label, vbyte register_a, vbyte register_b)
             : cc_jump_operation(map, label), _register_a(register_a), _register_b(register_b) {}
     virtual void compile(vbyte* result, size_t pos) const {
         cc_jump_operation::compile(result, pos);
@@ -540,6 +980,8 @@ struct cc_jump_not_equal : public cc_jump_operation {
                + ", RegisterA=" + std::to_string(_register_a)
                + ", RegisterB=" + std::to_string(_register_b);
     }
+    virtual bool reads(vbyte reg) const { return reg == _register_a || reg == _register_b; }
+    virtual bool readsField(const vbyte* field) const { return field == &_register_a || field == &_register_b; }
 };
 
 struct cc_jump_less : public cc_jump_operation {
@@ -548,7 +990,7 @@ struct cc_jump_less : public cc_jump_operation {
     virtual size_t addressOffset() const { return 3; }
     virtual vbyte command() const { return (vbyte) (CMD_JMP_LESS | widthFlag(BIT_64)); }
     virtual std::string name() const { return "JMP_LESS"; }
-    cc_jump_less(label_map &map, const std::string &label, vbyte register_a, vbyte register_b)
+    cc_jump_less(label_map &map, label_id label, vbyte register_a, vbyte register_b)
             : cc_jump_operation(map, label), _register_a(register_a), _register_b(register_b) {}
     virtual void compile(vbyte* result, size_t pos) const {
         cc_jump_operation::compile(result, pos);
@@ -560,4 +1002,34 @@ struct cc_jump_less : public cc_jump_operation {
                + ", RegisterA=" + std::to_string(_register_a)
                + ", RegisterB=" + std::to_string(_register_b);
     }
-};
\ No newline at end of file
+    virtual bool reads(vbyte reg) const { return reg == _register_a || reg == _register_b; }
+    virtual bool readsField(const vbyte* field) const { return field == &_register_a || field == &_register_b; }
+};
+
+// Arguments are passed in the registers from 0 up and the result is returned in register 0. The callee may overwrite
+// the registers below clobbered_count and keeps every other register it uses intact.
+struct cc_call : public cc_jump_operation {
+    vbyte _argument_count;
+    vbyte _clobbered_count;
+    virtual size_t addressOffset() const { return 1; }
+    virtual vbyte command() const { return (vbyte) (CMD_CALL | widthFlag(BIT_64)); }
+    virtual std::string name() const { return "CALL"; }
+    cc_call(label_map &map, label_id label, vbyte argument_count, vbyte clobbered_count)
+            : cc_jump_operation(map, label), _argument_count(argument_count), _clobbered_count(clobbered_count) {}
+    virtual std::string to_string() const {
+        return cc_jump_operation::to_string()
+               + ", Arguments=" + std::to_string(_argument_count);
+    }
+    virtual bool reads(vbyte reg) const { return reg < _argument_count; }
+    virtual bool writes(vbyte reg) const { return reg < _clobbered_count; }
+    virtual bool memoryBarrier() const { return true; }
+};
+
+struct cc_return : public compiler_command {
+    virtual void compile(vbyte* result, size_t pos) const { result[pos] = command(); }
+    virtual size_t size() const { return 1; }
+    virtual vbyte command() const { return CMD_RET; }
+    virtual std::string name() const { return "RET"; }
+    virtual bool reads(vbyte reg) const { return reg == 0; }
+    virtual bool memoryBarrier() const { return true; }
+};
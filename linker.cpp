@@ -0,0 +1,122 @@
+#include "linker.h"
+
+#include <algorithm>
+
+namespace {
+
+    // Addresses are stored most significant byte first, as written by the compiler commands
+    uint64_t readAddress(const std::vector<vbyte> &code, size_t offset, BitWidth width) {
+        uint64_t value = 0;
+        for(size_t i = 0; i < width; i++)
+            value = (value << 8) | code[offset + i];
+        return value;
+    }
+
+    void writeAddress(std::vector<vbyte> &code, size_t offset, BitWidth width, uint64_t value) {
+        if(width < BIT_64 && (value >> (width * 8)) != 0)
+            throw LinkException::RelocationOverflow(value, width);
+        for(size_t i = 0; i < width; i++)
+            code[offset + i] = (vbyte)(value >> ((width - 1 - i) * 8));
+    }
+
+}
+
+ve_module compileModule(const cc_list &cmds, size_t required_memory_size, const label_map &labels,
+                        const std::unordered_map<std::string, label_id> &symbols) {
+
+    DEBUG_PRINT("Compiling Module");
+
+    ve_module module;
+    module._heap_size = required_memory_size;
+    module._code.reserve(cmds.size() * 4);
+
+    // Emit the commands, recording every constant heap address for relocation
+    std::vector<label_map*> maps;
+    for(compiler_command* cmd : cmds) {
+        size_t index = module._code.size();
+        module._code.resize(index + cmd->size());
+        cmd->compile(module._code.data(), index);
+
+        size_t offset;
+        BitWidth width;
+        if(cmd->heapAddress(offset, width))
+            module._relocations.push_back({ ve_relocation::HEAP, index + offset, width,
+                                            readAddress(module._code, index + offset, width), "" });
+
+        label_map* map = cmd->labels();
+        if(map != nullptr && std::find(maps.begin(), maps.end(), map) == maps.end()) maps.push_back(map);
+    }
+
+    // Export the named labels placed in this module
+    std::unordered_map<label_id, const std::string*> names;
+    for(const std::pair<const std::string, label_id> &symbol : symbols) {
+        names[symbol.second] = &symbol.first;
+        size_t index;
+        if(labels.position(symbol.second, index)) module._symbols[symbol.first] = index;
+    }
+
+    // Turn the label fixups into relocations instead of patching them
+    for(label_map* map : maps) {
+        for(const label_map::FixupStruct &fixup : map->fixups()) {
+            size_t index;
+            if(map->position(fixup.label, index))
+                module._relocations.push_back({ ve_relocation::LABEL, fixup.offset, fixup.width, index, "" });
+            else if(map == &labels && names.count(fixup.label))
+                module._relocations.push_back({ ve_relocation::SYMBOL, fixup.offset, fixup.width, 0, *names[fixup.label] });
+            else
+                throw LinkException::UnresolvedLabel(map->name(fixup.label));
+        }
+        map->clearFixups();
+    }
+
+    DEBUG_PRINT("Module Size: " << module._code.size() << ", Relocations: " << module._relocations.size());
+
+    return module;
+}
+
+ve_program linkModules(const std::vector<const ve_module*> &modules) {
+
+    DEBUG_PRINT("Linking " << modules.size() << " Modules");
+
+    // Lay out the modules and collect their symbols
+    std::vector<size_t> code_base(modules.size());
+    std::vector<size_t> heap_base(modules.size());
+    std::unordered_map<std::string, size_t> symbols;
+    size_t code_size = 0;
+    size_t heap_size = 0;
+    for(size_t m = 0; m < modules.size(); m++) {
+        code_base[m] = code_size;
+        heap_base[m] = heap_size;
+        for(const std::pair<const std::string, size_t> &symbol : modules[m]->_symbols) {
+            if(!symbols.insert({ symbol.first, code_size + symbol.second }).second)
+                throw LinkException::DuplicateSymbol(symbol.first);
+        }
+        code_size += modules[m]->_code.size();
+        heap_size += modules[m]->_heap_size;
+    }
+
+    // Concatenate the code and patch the relocations in place
+    std::vector<vbyte> code;
+    code.reserve(code_size);
+    for(size_t m = 0; m < modules.size(); m++) {
+        const ve_module &module = *modules[m];
+        code.insert(code.end(), module._code.begin(), module._code.end());
+        for(const ve_relocation &reloc : module._relocations) {
+            size_t value = 0;
+            switch(reloc.type) {
+                case ve_relocation::LABEL: value = code_base[m] + reloc.addend; break;
+                case ve_relocation::HEAP:  value = heap_base[m] + reloc.addend; break;
+                case ve_relocation::SYMBOL: {
+                    std::unordered_map<std::string, size_t>::const_iterator it = symbols.find(reloc.symbol);
+                    if(it == symbols.end()) throw LinkException::UndefinedSymbol(reloc.symbol);
+                    value = it->second;
+                } break;
+            }
+            writeAddress(code, code_base[m] + reloc.offset, reloc.width, value);
+        }
+    }
+
+    DEBUG_PRINT("Program Size: " << code.size() << ", Heap Size: " << heap_size);
+
+    return ve_program(std::move(code), heap_size);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "compiler.h"
+
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class LinkException : public std::runtime_error {
+public:
+    enum Type {
+        UNRESOLVED_LABEL,
+        DUPLICATE_SYMBOL,
+        UNDEFINED_SYMBOL,
+        RELOCATION_OVERFLOW
+    };
+
+    Type type() { return _type; }
+
+    static LinkException UnresolvedLabel(const std::string &label) {
+        return LinkException(UNRESOLVED_LABEL,
+                             "The Label '" + label + "' is neither placed in the Module nor named as a Symbol");
+    }
+    static LinkException DuplicateSymbol(const std::string &symbol) {
+        return LinkException(DUPLICATE_SYMBOL,
+                             "The Symbol '" + symbol + "' is defined by more than one Module");
+    }
+    static LinkException UndefinedSymbol(const std::string &symbol) {
+        return LinkException(UNDEFINED_SYMBOL,
+                             "The Symbol '" + symbol + "' is not defined by any Module");
+    }
+    static LinkException RelocationOverflow(size_t value, BitWidth width) {
+        return LinkException(RELOCATION_OVERFLOW,
+                             "The relocated address " + std::to_string(value) + " does not fit into "
+                             + std::to_string(width) + " bytes");
+    }
+
+protected:
+    LinkException(Type type, const std::string &msg) : runtime_error(msg), _type(type) {}
+    Type _type;
+};
+
+struct ve_relocation {
+    enum Type {
+        LABEL,  // Address of a code offset within the same module
+        HEAP,   // Address within the module's own heap
+        SYMBOL  // Address of a symbol exported by some module
+    };
+    Type type;
+    size_t offset; // Position of the address in the module's code
+    BitWidth width;
+    size_t addend; // Code offset for LABEL, heap offset for HEAP
+    std::string symbol;
+};
+
+// Separately compiled bytecode; addresses are left relative to the module until it is linked
+struct ve_module {
+    std::vector<vbyte> _code;
+    size_t _heap_size = 0;
+    std::unordered_map<std::string, size_t> _symbols; // Exported symbol -> code offset
+    std::vector<ve_relocation> _relocations;
+};
+
+// Compiles the commands into a module. Labels of the given map named in symbols are exported when placed in
+// the commands and imported from other modules otherwise. Heap addresses should be encoded with enough width
+// for the linked heap (see optimizer_settings::relocatable).
+ve_module compileModule(const cc_list &cmds, size_t required_memory_size, const label_map &labels,
+                        const std::unordered_map<std::string, label_id> &symbols);
+
+// Lays out the modules' code and heaps in order and patches every relocation; execution starts at the first module
+ve_program linkModules(const std::vector<const ve_module*> &modules);
@@ -0,0 +1,593 @@
+#include "optimizer.h"
+#include "program_cache.h"
+#include "virtual_environment.h"
+
+#include <chrono>
+#include <iomanip>
+#include <unistd.h>
+
+namespace {
+
+    const size_t ALLOC_ITERATIONS = 200000;
+    const size_t ALLOC_WINDOW = 4;
+    const size_t ALLOC_SIZES[] = { 64, 128, 256, 1024 };
+
+    struct held_chunk {
+        size_t begin;
+        size_t end;
+    };
+
+    // Each thread keeps a small window of live chunks, freeing the oldest every time it allocates a new one
+    void allocWorker(ve_memory &mem, std::mutex* global_lock, size_t seed) {
+        held_chunk window[ALLOC_WINDOW];
+        size_t held = 0;
+        for(size_t i = 0; i < ALLOC_ITERATIONS; i++) {
+            size_t slot = i % ALLOC_WINDOW;
+            if(held == ALLOC_WINDOW) {
+                if(global_lock != nullptr) global_lock->lock();
+                mem.freeMemChunk(window[slot].begin, window[slot].end);
+                if(global_lock != nullptr) global_lock->unlock();
+                held--;
+            }
+            size_t size = ALLOC_SIZES[(i + seed) % (sizeof(ALLOC_SIZES) / sizeof(size_t))];
+            if(global_lock != nullptr) global_lock->lock();
+            vbyte* ptr = mem.allocMemChunk(size, &window[slot].begin, &window[slot].end);
+            if(global_lock != nullptr) global_lock->unlock();
+            if(ptr != nullptr) held++;
+        }
+        for(size_t i = 0; i < held; i++) {
+            if(global_lock != nullptr) global_lock->lock();
+            mem.freeMemChunk(window[i].begin, window[i].end);
+            if(global_lock != nullptr) global_lock->unlock();
+        }
+    }
+
+    double benchAlloc(size_t thread_count, bool concurrent) {
+        ve_memory mem(64, MEM_MB);
+        mem.setConcurrent(concurrent);
+        std::mutex global_lock;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for(size_t i = 0; i < thread_count; i++)
+            threads.push_back(std::thread(allocWorker, std::ref(mem), concurrent ? nullptr : &global_lock, i));
+        for(std::thread &t : threads) t.join();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        // Each iteration is one allocation and (past the warmup window) one free
+        return (double)(thread_count * ALLOC_ITERATIONS * 2) / elapsed.count();
+    }
+
+    const size_t COMPILE_UNITS = 32;
+    const size_t COMPILE_UNIT_STATEMENTS = 400;
+
+    // Each unit is a chain of assignments over its own variables
+    std::vector<stmt_list> buildUnits(id_map &ids) {
+        std::vector<stmt_list> units(COMPILE_UNITS);
+        for(stmt_list &unit : units) {
+            size_t prev = ids.getID();
+            unit.push_back(new stmt_assignment(new exp_constant(1), prev, true));
+            for(size_t i = 1; i < COMPILE_UNIT_STATEMENTS; i++) {
+                size_t var = ids.getID();
+                unit.push_back(new stmt_assignment(
+                        new exp_arithmetic_double(new exp_variable(prev), new exp_constant((int64_t)i), i % 2 ? ADDITION : MULTIPLICATION),
+                        var, true));
+                prev = var;
+            }
+        }
+        return units;
+    }
+
+    double benchCompile(const std::vector<stmt_list> &units, const id_map &ids, size_t thread_count) {
+        optimizer_settings settings{ BIT_64, 16, label_map() };
+
+        // The compiler's debug output would dominate the timing
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ve_program program = compileUnitsParallel(units, settings, ids, thread_count);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout.rdbuf(cout_buf);
+        std::cout.clear();
+
+        return elapsed.count() * 1000.0;
+    }
+
+    // Times the optimizer on a single unit of about four commands per statement
+    double benchOptimize(size_t statements) {
+        id_map ids;
+        stmt_list stmts;
+        size_t prev = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(1), prev, true));
+        for(size_t i = 1; i < statements; i++) {
+            size_t var = ids.getID();
+            stmts.push_back(new stmt_assignment(
+                    new exp_arithmetic_double(new exp_variable(prev), new exp_constant((int64_t)i), i % 2 ? ADDITION : MULTIPLICATION),
+                    var, true));
+            prev = var;
+        }
+        // Every statement would fold to a constant otherwise
+        optimizer_settings settings{ BIT_64, 16, label_map(), false, ALLOCATOR_LINEAR_SCAN, PASS_CONSTANT_FOLDING };
+
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        compileOptimizeList(stmts, settings, ids, nullptr);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout.rdbuf(cout_buf);
+        std::cout.clear();
+
+        for(abstract_statement* stmt : stmts) delete stmt;
+        return elapsed.count() * 1000.0;
+    }
+
+    const size_t PRESSURE_VARIABLES = 16;
+    const vbyte PRESSURE_REGISTERS[] = { 4, 8, 16 };
+
+    // Every variable is live across a loop that mixes them and steps them with increments
+    stmt_list buildPressureProgram(id_map &ids) {
+        stmt_list stmts;
+        std::vector<size_t> vars;
+        for(size_t i = 0; i < PRESSURE_VARIABLES; i++) {
+            vars.push_back(ids.getID());
+            stmts.push_back(new stmt_assignment(new exp_constant((int64_t)(i * 7 + 1)), vars[i], true));
+        }
+        size_t count = ids.getID();
+        stmt_list body;
+        for(size_t i = 0; i < PRESSURE_VARIABLES; i++) {
+            body.push_back(new stmt_assignment(new exp_arithmetic_double(
+                    new exp_variable(vars[i]),
+                    new exp_arithmetic_double(new exp_variable(vars[(i + 1) % PRESSURE_VARIABLES]),
+                                              new exp_arithmetic_single(new exp_variable(vars[(i + 3) % PRESSURE_VARIABLES]), INCREMENT, i % 2 == 0),
+                                              MULTIPLICATION),
+                    SUBTRACTION), vars[i]));
+        }
+        stmts.push_back(new stmt_loop(body, new stmt_assignment(new exp_constant(100), count, true), new exp_variable(count),
+                                      new stmt_expr(new exp_arithmetic_single(new exp_variable(count), DECREMENT))));
+        return stmts;
+    }
+
+    struct allocator_result {
+        double time;
+        size_t size;
+        size_t memory_moves;
+        size_t copies;
+    };
+
+    allocator_result benchAllocator(const stmt_list &stmts, const id_map &ids, vbyte registers, RegisterAllocator allocator) {
+        optimizer_settings settings{ BIT_64, registers, label_map(), false, allocator };
+        id_map unit_ids = ids;
+        size_t req_mem_size;
+
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        cc_list cmds = compileOptimizeList(stmts, settings, unit_ids, &req_mem_size);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ve_program program = compileCommandList(cmds, req_mem_size);
+        std::cout.rdbuf(cout_buf);
+        std::cout.clear();
+
+        allocator_result result{ elapsed.count() * 1000.0, program._size, 0, 0 };
+        for(compiler_command* cmd : cmds) {
+            if(dynamic_cast<cc_move_to_register_constant*>(cmd) != nullptr || dynamic_cast<cc_move_to_memory_constant*>(cmd) != nullptr)
+                result.memory_moves++;
+            else if(dynamic_cast<cc_copy_register*>(cmd) != nullptr)
+                result.copies++;
+        }
+        return result;
+    }
+
+    const size_t FOLDING_ITERATIONS = 20000;
+
+    // A loop whose body mostly works on values known before it runs, as produced by named constants and macros
+    stmt_list buildConstantProgram(id_map &ids) {
+        stmt_list stmts;
+        size_t width = ids.getID();
+        size_t height = ids.getID();
+        size_t scale = ids.getID();
+        size_t sum = ids.getID();
+        size_t count = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(640), width, true));
+        stmts.push_back(new stmt_assignment(new exp_constant(480), height, true));
+        stmts.push_back(new stmt_assignment(new exp_constant(3), scale, true));
+        stmts.push_back(new stmt_assignment(new exp_constant(0), sum, true));
+        stmt_list body;
+        body.push_back(new stmt_assignment(new exp_arithmetic_double(
+                new exp_variable(sum),
+                new exp_arithmetic_double(
+                        new exp_arithmetic_double(new exp_variable(width), new exp_variable(height), MULTIPLICATION),
+                        new exp_arithmetic_double(new exp_variable(scale), new exp_constant(2), SUBTRACTION),
+                        MULTIPLICATION),
+                ADDITION), sum));
+        body.push_back(new stmt_assignment(new exp_arithmetic_double(
+                new exp_arithmetic_double(new exp_variable(sum), new exp_constant(1), MULTIPLICATION),
+                new exp_arithmetic_double(new exp_variable(count), new exp_arithmetic_double(new exp_variable(scale), new exp_constant(3), MODULUS), MULTIPLICATION),
+                ADDITION), sum));
+        stmts.push_back(new stmt_loop(body, new stmt_assignment(new exp_constant((int64_t)FOLDING_ITERATIONS), count, true),
+                                      new exp_variable(count), new stmt_expr(new exp_arithmetic_single(new exp_variable(count), DECREMENT))));
+        return stmts;
+    }
+
+    // A loop body that recomputes the same expressions of the counter, as written out by hand or expanded from macros
+    stmt_list buildRedundantProgram(id_map &ids) {
+        stmt_list stmts;
+        size_t sum = ids.getID();
+        size_t count = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(0), sum, true));
+        stmt_list body;
+        for(int i = 0; i < 4; i++) {
+            body.push_back(new stmt_assignment(new exp_arithmetic_double(
+                    new exp_variable(sum),
+                    new exp_arithmetic_double(
+                            new exp_arithmetic_double(new exp_variable(count), new exp_variable(count), MULTIPLICATION),
+                            new exp_arithmetic_double(new exp_variable(count), new exp_constant(i + 2), MODULUS),
+                            ADDITION),
+                    ADDITION), sum));
+        }
+        stmts.push_back(new stmt_loop(body, new stmt_assignment(new exp_constant((int64_t)FOLDING_ITERATIONS), count, true),
+                                      new exp_variable(count), new stmt_expr(new exp_arithmetic_single(new exp_variable(count), DECREMENT))));
+        return stmts;
+    }
+
+    // A loop body working on sizes only known at runtime, which it reads but never changes
+    stmt_list buildInvariantProgram(id_map &ids) {
+        stmt_list stmts;
+        size_t base = ids.getID();
+        size_t width = ids.getID();
+        size_t height = ids.getID();
+        size_t sum = ids.getID();
+        size_t count = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_alloc(new exp_constant(16)), base, true));
+        stmts.push_back(new stmt_store(new exp_variable(base), new exp_constant(640), BIT_64));
+        stmts.push_back(new stmt_store(new exp_arithmetic_double(new exp_variable(base), new exp_constant(8), ADDITION), new exp_constant(480), BIT_64));
+        stmts.push_back(new stmt_assignment(new exp_load(new exp_variable(base), BIT_64), width, true));
+        stmts.push_back(new stmt_assignment(new exp_load(new exp_arithmetic_double(new exp_variable(base), new exp_constant(8), ADDITION), BIT_64), height, true));
+        stmts.push_back(new stmt_assignment(new exp_constant(0), sum, true));
+        stmt_list body;
+        body.push_back(new stmt_assignment(new exp_arithmetic_double(
+                new exp_arithmetic_double(new exp_variable(sum), new exp_variable(count), ADDITION),
+                new exp_arithmetic_double(
+                        new exp_arithmetic_double(new exp_variable(width), new exp_variable(height), MULTIPLICATION),
+                        new exp_constant(3), MULTIPLICATION),
+                ADDITION), sum));
+        body.push_back(new stmt_assignment(new exp_arithmetic_double(
+                new exp_variable(sum),
+                new exp_arithmetic_double(
+                        new exp_arithmetic_double(new exp_variable(width), new exp_variable(height), ADDITION),
+                        new exp_arithmetic_double(new exp_variable(width), new exp_variable(height), SUBTRACTION),
+                        MULTIPLICATION),
+                SUBTRACTION), sum));
+        stmts.push_back(new stmt_loop(body, new stmt_assignment(new exp_constant((int64_t)FOLDING_ITERATIONS), count, true),
+                                      new exp_variable(count), new stmt_expr(new exp_arithmetic_single(new exp_variable(count), DECREMENT))));
+        stmts.push_back(new stmt_free(new exp_variable(base)));
+        return stmts;
+    }
+
+    // A counting loop ending on the given condition of its counter
+    stmt_list buildConditionProgram(id_map &ids, size_t count, abstract_expression* cond) {
+        stmt_list stmts;
+        size_t sum = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(0), sum, true));
+        stmt_list body;
+        body.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(sum), new exp_variable(count), ADDITION), sum));
+        stmts.push_back(new stmt_loop(body, new stmt_assignment(new exp_constant((int64_t)FOLDING_ITERATIONS), count, true),
+                                      cond, new stmt_expr(new exp_arithmetic_single(new exp_variable(count), DECREMENT))));
+        return stmts;
+    }
+
+    // A counting loop summing the counter multiplied, divided or reduced by a power of two; masking it first tells the
+    // optimizer it can't be negative
+    stmt_list buildStrengthProgram(id_map &ids, ArithmeticOperatorDouble op, bool masked) {
+        stmt_list stmts;
+        size_t sum = ids.getID();
+        size_t count = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(0), sum, true));
+        stmt_list body;
+        abstract_expression* value = new exp_variable(count);
+        if(masked) value = new exp_arithmetic_double(value, new exp_constant(0xFFFF), BITWISE_AND);
+        body.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(sum),
+                new exp_arithmetic_double(value, new exp_constant(8), op), ADDITION), sum));
+        stmts.push_back(new stmt_loop(body, new stmt_assignment(new exp_constant((int64_t)FOLDING_ITERATIONS), count, true),
+                                      new exp_variable(count), new stmt_expr(new exp_arithmetic_single(new exp_variable(count), DECREMENT))));
+        return stmts;
+    }
+
+    // A loop scaling the counter by a factor it reads from the heap, keeping the running total next to it
+    stmt_list buildVersionProgram(id_map &ids) {
+        stmt_list stmts;
+        size_t base = ids.getID();
+        size_t sum = ids.getID();
+        size_t count = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_alloc(new exp_constant(16)), base, true));
+        stmts.push_back(new stmt_store(new exp_variable(base), new exp_constant(3), BIT_64));
+        stmts.push_back(new stmt_assignment(new exp_constant(0), sum, true));
+        stmt_list body;
+        body.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(sum),
+                new exp_arithmetic_double(new exp_variable(count), new exp_load(new exp_variable(base), BIT_64), MULTIPLICATION),
+                ADDITION), sum));
+        body.push_back(new stmt_store(new exp_arithmetic_double(new exp_variable(base), new exp_constant(8), ADDITION),
+                                      new exp_variable(sum), BIT_64));
+        stmts.push_back(new stmt_loop(body, new stmt_assignment(new exp_constant((int64_t)FOLDING_ITERATIONS), count, true),
+                                      new exp_variable(count), new stmt_expr(new exp_arithmetic_single(new exp_variable(count), DECREMENT))));
+        stmts.push_back(new stmt_free(new exp_variable(base)));
+        return stmts;
+    }
+
+    const size_t CALL_SITES = 8;
+
+    // Adds count to sum until count runs down
+    stmt_list buildSumLoop(size_t count, size_t sum) {
+        stmt_list stmts;
+        stmts.push_back(new stmt_assignment(new exp_constant(0), sum, true));
+        stmt_list body;
+        body.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(sum), new exp_variable(count), ADDITION), sum));
+        stmts.push_back(new stmt_loop(body, nullptr, new exp_variable(count),
+                                      new stmt_expr(new exp_arithmetic_single(new exp_variable(count), DECREMENT))));
+        return stmts;
+    }
+
+    // Totals the sum loop for a different count at each site, by calling a function or with the loop copied in place
+    stmt_list buildCallProgram(id_map &ids, bool call) {
+        stmt_list stmts;
+        size_t total = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(0), total, true));
+        size_t function = ids.getID();
+        if(call) {
+            size_t count = ids.getID();
+            size_t sum = ids.getID();
+            stmt_list body = buildSumLoop(count, sum);
+            body.push_back(new stmt_flow_control(RETURN, new exp_variable(sum)));
+            stmts.push_back(new stmt_function_definition(function, { count }, body));
+        }
+        for(size_t site = 1; site <= CALL_SITES; site++) {
+            int64_t count_value = (int64_t)(site * FOLDING_ITERATIONS / CALL_SITES);
+            abstract_expression* result;
+            if(call) {
+                result = new exp_call(function, { new exp_constant(count_value) });
+            } else {
+                size_t count = ids.getID();
+                size_t sum = ids.getID();
+                stmts.push_back(new stmt_assignment(new exp_constant(count_value), count, true));
+                stmts.splice(stmts.end(), buildSumLoop(count, sum));
+                result = new exp_variable(sum);
+            }
+            stmts.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(total), result, ADDITION), total));
+        }
+        return stmts;
+    }
+
+    struct pass_result {
+        size_t size;
+        double time;
+    };
+
+    // Compiles with the given passes disabled and times running the program
+    pass_result benchPasses(const stmt_list &stmts, const id_map &ids, unsigned disabled_passes, vbyte registers) {
+        optimizer_settings settings{ BIT_64, registers, label_map(), false, ALLOCATOR_LINEAR_SCAN, disabled_passes };
+        id_map unit_ids = ids;
+        size_t req_mem_size;
+
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        cc_list cmds = compileOptimizeList(stmts, settings, unit_ids, &req_mem_size);
+        ve_program program = compileCommandList(cmds, req_mem_size);
+        virtual_environment ve(BIT_64, 16, 1, MEM_KB, 128, MEM_BYTE);
+        ve.setProgram(program);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ve.run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout.rdbuf(cout_buf);
+        std::cout.clear();
+
+        return { program._size, elapsed.count() * 1000.0 };
+    }
+
+    // Prints the size and run time of the program with the pass disabled and enabled
+    void printPass(const std::string &title, const std::string &column, const stmt_list &stmts, const id_map &ids,
+                   OptimizerPass pass, vbyte registers = 16) {
+        std::cout << std::endl << title << std::endl;
+        std::cout << std::setw(10) << column << std::setw(8) << "Bytes" << std::setw(12) << "Run (ms)" << std::endl;
+        const unsigned disabled_passes[] = { (unsigned)pass, 0 };
+        for(unsigned disabled : disabled_passes) {
+            pass_result result = benchPasses(stmts, ids, disabled, registers);
+            std::cout << std::setw(10) << (disabled ? "Off" : "On") << std::setw(8) << result.size
+                      << std::setw(12) << result.time << std::endl;
+        }
+    }
+
+    // Times a cold compile and a recompile after changing a single statement of one unit
+    void benchIncremental(std::vector<stmt_list> &units, const id_map &ids, double &cold, double &edit) {
+        incremental_compiler compiler(optimizer_settings{ BIT_64, 16, label_map() });
+
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        compiler.compile(units, ids);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        cold = elapsed.count() * 1000.0;
+
+        stmt_assignment* first = dynamic_cast<stmt_assignment*>(units[0].front());
+        abstract_statement* edited = new stmt_assignment(new exp_constant(2), first->_varID, true);
+        units[0].front() = edited;
+
+        start = std::chrono::steady_clock::now();
+        compiler.compile(units, ids);
+        elapsed = std::chrono::steady_clock::now() - start;
+        edit = elapsed.count() * 1000.0;
+
+        units[0].front() = first;
+        delete edited;
+        std::cout.rdbuf(cout_buf);
+        std::cout.clear();
+    }
+
+    // Times a compile through an empty on-disk cache and the lookup a later process would do
+    void benchCache(const stmt_list &stmts, const id_map &ids, double &cold, double &warm) {
+        program_cache cache("benchmark_cache", 64 * MEM_MB);
+
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        optimizer_settings settings{ BIT_64, 16, label_map() };
+        id_map cold_ids = ids;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        cache.compile(stmts, settings, cold_ids);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        cold = elapsed.count() * 1000.0;
+
+        program_cache later("benchmark_cache", 64 * MEM_MB);
+        optimizer_settings later_settings{ BIT_64, 16, label_map() };
+        id_map later_ids = ids;
+        start = std::chrono::steady_clock::now();
+        later.compile(stmts, later_settings, later_ids);
+        elapsed = std::chrono::steady_clock::now() - start;
+        warm = elapsed.count() * 1000.0;
+
+        // Leave nothing behind
+        program_cache("benchmark_cache", 0).evict();
+        rmdir("benchmark_cache");
+        std::cout.rdbuf(cout_buf);
+        std::cout.clear();
+    }
+
+}
+
+int main() {
+
+    try {
+        size_t max_threads = std::thread::hardware_concurrency();
+        if(max_threads == 0) max_threads = 1;
+
+        std::cout << "ve_memory Allocation Scalability (ops/sec)" << std::endl;
+        std::cout << std::setw(8) << "Threads" << std::setw(16) << "GlobalLock" << std::setw(16) << "Concurrent" << std::endl;
+        for(size_t threads = 1; threads <= max_threads; threads *= 2) {
+            std::cout << std::setw(8) << threads
+                      << std::setw(16) << (size_t)benchAlloc(threads, false)
+                      << std::setw(16) << (size_t)benchAlloc(threads, true) << std::endl;
+            if(threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+        }
+
+        id_map ids;
+        std::vector<stmt_list> units = buildUnits(ids);
+        std::cout << std::endl << "Parallel Compile of " << COMPILE_UNITS << " Units (ms)" << std::endl;
+        std::cout << std::setw(8) << "Threads" << std::setw(16) << "Time" << std::endl;
+        for(size_t threads = 1; threads <= max_threads; threads *= 2) {
+            std::cout << std::setw(8) << threads << std::setw(16) << std::fixed << std::setprecision(2)
+                      << benchCompile(units, ids, threads) << std::endl;
+            if(threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+        }
+
+        std::cout << std::endl << "Optimize and Allocate Registers (ms)" << std::endl;
+        std::cout << std::setw(12) << "Statements" << std::setw(16) << "Time" << std::endl;
+        for(size_t statements = 6250; statements <= 50000; statements *= 2)
+            std::cout << std::setw(12) << statements << std::setw(16) << benchOptimize(statements) << std::endl;
+
+        stmt_list pressure = buildPressureProgram(ids);
+        std::cout << std::endl << "Register Allocators on " << PRESSURE_VARIABLES << " Live Variables" << std::endl;
+        std::cout << std::setw(10) << "Registers" << std::setw(16) << "Allocator" << std::setw(12) << "Time (ms)"
+                  << std::setw(8) << "Bytes" << std::setw(12) << "Mem Moves" << std::setw(8) << "CPREG" << std::endl;
+        for(vbyte registers : PRESSURE_REGISTERS) {
+            const RegisterAllocator allocators[] = { ALLOCATOR_LINEAR_SCAN, ALLOCATOR_GRAPH_COLORING };
+            for(RegisterAllocator allocator : allocators) {
+                allocator_result result = benchAllocator(pressure, ids, registers, allocator);
+                std::cout << std::setw(10) << (size_t)registers
+                          << std::setw(16) << (allocator == ALLOCATOR_LINEAR_SCAN ? "LinearScan" : "GraphColoring")
+                          << std::setw(12) << result.time << std::setw(8) << result.size
+                          << std::setw(12) << result.memory_moves << std::setw(8) << result.copies << std::endl;
+            }
+        }
+        for(abstract_statement* stmt : pressure) delete stmt;
+
+        const std::string iterations = " over " + std::to_string(FOLDING_ITERATIONS) + " Loop Iterations";
+        stmt_list constants = buildConstantProgram(ids);
+        printPass("Constant Folding" + iterations, "Folding", constants, ids, PASS_CONSTANT_FOLDING);
+        for(abstract_statement* stmt : constants) delete stmt;
+
+        stmt_list redundant = buildRedundantProgram(ids);
+        printPass("Value Numbering" + iterations, "Numbering", redundant, ids, PASS_VALUE_NUMBERING);
+        // Few registers, so the loop spills and reloads around every use
+        printPass("Memory Traffic with 4 Registers" + iterations, "Removal", redundant, ids, PASS_MEMORY_TRAFFIC, 4);
+        for(abstract_statement* stmt : redundant) delete stmt;
+
+        std::cout << std::endl << "Loop Conditions" << iterations << std::endl;
+        std::cout << std::setw(12) << "Condition" << std::setw(8) << "Bytes" << std::setw(12) << "Run (ms)" << std::endl;
+        // The plain counter is tested against a zero loaded ahead, comparisons jump on their operands
+        const ComparisonOperator comparisons[] = { GREATER, NOT_EQUAL, GREATER_EQUAL };
+        const char* conditions[] = { "count", "count > 0", "count != 0", "count >= 1" };
+        for(int variant = 0; variant < 4; variant++) {
+            size_t count = ids.getID();
+            abstract_expression* cond = new exp_variable(count);
+            if(variant > 0) cond = new exp_comparison(cond, new exp_constant(variant == 3 ? 1 : 0), comparisons[variant - 1]);
+            stmt_list loop = buildConditionProgram(ids, count, cond);
+            pass_result result = benchPasses(loop, ids, 0, 16);
+            std::cout << std::setw(12) << conditions[variant] << std::setw(8) << result.size << std::setw(12) << result.time << std::endl;
+            for(abstract_statement* stmt : loop) delete stmt;
+        }
+
+        std::cout << std::endl << "Strength Reduction" << iterations << std::endl;
+        std::cout << std::setw(18) << "Operation" << std::setw(10) << "Reduction" << std::setw(8) << "Bytes"
+                  << std::setw(12) << "Run (ms)" << std::endl;
+        const ArithmeticOperatorDouble reduced[] = { MULTIPLICATION, DIVISION, MODULUS, DIVISION, MODULUS };
+        for(int variant = 0; variant < 5; variant++) {
+            bool masked = variant >= 3;
+            stmt_list loop = buildStrengthProgram(ids, reduced[variant], masked);
+            std::string operation = (masked ? "(count & M) " : "count ") + std::to_string(reduced[variant]) + " 8";
+            const unsigned disabled_passes[] = { (unsigned)PASS_STRENGTH_REDUCTION, 0 };
+            for(unsigned disabled : disabled_passes) {
+                pass_result result = benchPasses(loop, ids, disabled, 16);
+                std::cout << std::setw(18) << operation << std::setw(10) << (disabled ? "Off" : "On")
+                          << std::setw(8) << result.size << std::setw(12) << result.time << std::endl;
+            }
+            for(abstract_statement* stmt : loop) delete stmt;
+        }
+
+        stmt_list invariant = buildInvariantProgram(ids);
+        printPass("Loop Invariant Code Motion" + iterations, "Motion", invariant, ids, PASS_LOOP_INVARIANTS);
+        for(abstract_statement* stmt : invariant) delete stmt;
+
+        std::cout << std::endl << "Loop Versioning" << iterations << std::endl;
+        std::cout << std::setw(10) << "Versioning" << std::setw(8) << "Bytes" << std::setw(12) << "Run (ms)" << std::endl;
+        // The store could overwrite the factor as far as the optimizer knows, until a check on entry rules it out;
+        // unrolling is left out, so both run the same single loop
+        stmt_list versioned = buildVersionProgram(ids);
+        const unsigned versioning_passes[] = { (unsigned)(PASS_LOOP_UNROLLING | PASS_LOOP_VERSIONING), (unsigned)PASS_LOOP_UNROLLING };
+        for(unsigned disabled : versioning_passes) {
+            pass_result result = benchPasses(versioned, ids, disabled, 16);
+            std::cout << std::setw(10) << (disabled & PASS_LOOP_VERSIONING ? "Off" : "On") << std::setw(8) << result.size
+                      << std::setw(12) << result.time << std::endl;
+        }
+        for(abstract_statement* stmt : versioned) delete stmt;
+
+        // Too many iterations to unroll fully, so the body is repeated in a main loop followed by a remainder loop
+        size_t unroll_count = ids.getID();
+        stmt_list counted = buildConditionProgram(ids, unroll_count, new exp_variable(unroll_count));
+        printPass("Loop Unrolling" + iterations, "Unrolling", counted, ids, PASS_LOOP_UNROLLING);
+        for(abstract_statement* stmt : counted) delete stmt;
+
+        std::cout << std::endl << "Function Calls from " << CALL_SITES << " Sites" << std::endl;
+        std::cout << std::setw(10) << "Routine" << std::setw(8) << "Bytes" << std::setw(12) << "Run (ms)" << std::endl;
+        // Unrolling is left out, so both keep one loop per copy of the routine
+        for(int variant = 0; variant < 2; variant++) {
+            stmt_list routine = buildCallProgram(ids, variant == 1);
+            pass_result result = benchPasses(routine, ids, PASS_LOOP_UNROLLING, 16);
+            std::cout << std::setw(10) << (variant == 1 ? "Called" : "Inlined") << std::setw(8) << result.size
+                      << std::setw(12) << result.time << std::endl;
+            for(abstract_statement* stmt : routine) delete stmt;
+        }
+
+        double cold, edit;
+        benchIncremental(units, ids, cold, edit);
+        std::cout << std::endl << "Incremental Compile of " << COMPILE_UNITS << " Units (ms)" << std::endl;
+        std::cout << std::setw(16) << "Cold" << std::setw(16) << "One Edit" << std::endl;
+        std::cout << std::setw(16) << cold << std::setw(16) << edit << std::endl;
+
+        double cache_cold, cache_warm;
+        benchCache(units[0], ids, cache_cold, cache_warm);
+        std::cout << std::endl << "On-Disk Program Cache (ms)" << std::endl;
+        std::cout << std::setw(16) << "Miss" << std::setw(16) << "Hit" << std::endl;
+        std::cout << std::setw(16) << cache_cold << std::setw(16) << cache_warm << std::endl;
+
+        for(stmt_list &unit : units)
+            for(abstract_statement* stmt : unit)
+                delete stmt;
+    } catch(std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -30,38 +30,41 @@ int main() {
 
         cc_list fbCmds;
         label_map lmap;
+        label_id loop_a = lmap.create("loop_a");
+        label_id loop_b = lmap.create("loop_b");
+        label_id loop_end = lmap.create("loop_end");
 
-        fbCmds.push_back(new cc_load_constant(0, 1, BIT_8));
-        fbCmds.push_back(new cc_load_constant(1, 2, BIT_8));
-        fbCmds.push_back(new cc_load_constant(7, 1000, BIT_16));
-        fbCmds.push_back(new cc_load_constant(6, 0, BIT_8));
-        fbCmds.push_back(new cc_load_constant(5, 0, BIT_8));
-        fbCmds.push_back(new cc_load_constant(4, 0, BIT_8));
-        fbCmds.push_back(new cc_load_constant(3, 0, BIT_8));
-        fbCmds.push_back(new cc_load_constant(2, 8, BIT_8));
+        fbCmds.emplace_back<cc_load_constant>(0, 1, BIT_8);
+        fbCmds.emplace_back<cc_load_constant>(1, 2, BIT_8);
+        fbCmds.emplace_back<cc_load_constant>(7, 1000, BIT_16);
+        fbCmds.emplace_back<cc_load_constant>(6, 0, BIT_8);
+        fbCmds.emplace_back<cc_load_constant>(5, 0, BIT_8);
+        fbCmds.emplace_back<cc_load_constant>(4, 0, BIT_8);
+        fbCmds.emplace_back<cc_load_constant>(3, 0, BIT_8);
+        fbCmds.emplace_back<cc_load_constant>(2, 8, BIT_8);
 
-        fbCmds.push_back(new cc_label(lmap, "loop_a"));
-        fbCmds.push_back(new cc_jump_not_equal(lmap, "loop_b", 4, 5));
-        fbCmds.push_back(new cc_alu_addition(0, 1, 0));
-        fbCmds.push_back(new cc_move_to_memory(0, 3, BIT_64));
-        fbCmds.push_back(new cc_load_constant(4, 1, BIT_8));
-        fbCmds.push_back(new cc_jump(lmap, "loop_end"));
+        fbCmds.emplace_back<cc_label>(lmap, loop_a);
+        fbCmds.emplace_back<cc_jump_not_equal>(lmap, loop_b, 4, 5);
+        fbCmds.emplace_back<cc_alu_addition>(0, 1, 0);
+        fbCmds.emplace_back<cc_move_to_memory>(0, 3, BIT_64);
+        fbCmds.emplace_back<cc_load_constant>(4, 1, BIT_8);
+        fbCmds.emplace_back<cc_jump>(lmap, loop_end);
 
-        fbCmds.push_back(new cc_label(lmap, "loop_b"));
-        fbCmds.push_back(new cc_alu_addition(0, 1, 1));
-        fbCmds.push_back(new cc_move_to_memory(1, 3, BIT_64));
-        fbCmds.push_back(new cc_load_constant(4, 0, BIT_8));
+        fbCmds.emplace_back<cc_label>(lmap, loop_b);
+        fbCmds.emplace_back<cc_alu_addition>(0, 1, 1);
+        fbCmds.emplace_back<cc_move_to_memory>(1, 3, BIT_64);
+        fbCmds.emplace_back<cc_load_constant>(4, 0, BIT_8);
 
-        fbCmds.push_back(new cc_label(lmap, "loop_end"));
-        fbCmds.push_back(new cc_alu_addition(3, 2, 3));
-        fbCmds.push_back(new cc_alu_increment(6));
-        fbCmds.push_back(new cc_jump_less(lmap, "loop_a", 6, 7));
+        fbCmds.emplace_back<cc_label>(lmap, loop_end);
+        fbCmds.emplace_back<cc_alu_addition>(3, 2, 3);
+        fbCmds.emplace_back<cc_alu_increment>(6);
+        fbCmds.emplace_back<cc_jump_less>(lmap, loop_a, 6, 7);
 
         ve_program fibProgram = compileCommandList(fbCmds, 8192);
 
         DEBUG_PRINT(lmap.size() << " : " << lmap.cacheSize());
 
-        virtual_environment ve(BIT_64, 8, 8, MEM_KB, 1, MEM_KB);
+        virtual_environment ve(BIT_64, 8, 8, MEM_KB, 1, MEM_KB, 16, MEM_KB);
         //ve.setProgram(ve_program(sizeof(fibonacci) / sizeof(vbyte), fibonacci));
         ve.setProgram(fibProgram);
         retcode result = ve.run();
@@ -1,4 +1,5 @@
 #include "optimizer.h"
+#include "peephole.h"
 #include "virtual_environment.h"
 
 int main() {
@@ -74,6 +75,15 @@ int main() {
             std::cout << cmd->to_string() << std::endl;
         std::cout << std::endl;
 
+        peephole_optimizer peephole;
+        peephole.run(cmds);
+        peephole.printStats();
+
+        std::cout << std::endl << "Post-Peephole:" << std::endl;
+        for (compiler_command *cmd : cmds)
+            std::cout << cmd->to_string() << std::endl;
+        std::cout << std::endl;
+
         ve_program program = compileCommandList(cmds, req_mem_size);
 
         virtual_environment ve(BIT_64, 32, 1, MEM_KB, 128, MEM_BYTE);
@@ -87,8 +97,6 @@ int main() {
         // Delete Heap-Allocated Lists
         for (abstract_statement *stmt : stmts)
             delete stmt;
-        for (compiler_command *cmd : cmds)
-            delete cmd;
     } catch(std::exception &e) {
         std::cerr << e.what() << std::endl;
         return -1;
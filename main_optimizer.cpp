@@ -56,8 +56,6 @@ int main() {
         // Delete Heap-Allocated Lists
         for (abstract_statement *stmt : stmts)
             delete stmt;
-        for (compiler_command *cmd : cmds)
-            delete cmd;
     } catch(std::exception &e) {
         std::cerr << e.what() << std::endl;
         return -1;
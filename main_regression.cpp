@@ -0,0 +1,334 @@
+#include "optimizer.h"
+#include "virtual_environment.h"
+
+namespace {
+
+    struct run_result {
+        retcode code;
+        int64_t first;  // The value of the first variable
+    };
+
+    // Compiles and runs the statements, keeping the output of both quiet
+    run_result runProgram(const stmt_list &stmts, const id_map &ids, vbyte registers, RegisterAllocator allocator, size_t stack_size) {
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        optimizer_settings settings{ BIT_64, registers, label_map(), false, allocator };
+        id_map run_ids = ids;
+        size_t req_mem_size;
+        cc_list cmds;
+        try {
+            cmds = compileOptimizeList(stmts, settings, run_ids, &req_mem_size);
+        } catch(...) {
+            std::cout.rdbuf(cout_buf);
+            throw;
+        }
+
+        virtual_environment ve(BIT_64, registers, 8, MEM_KB, stack_size, MEM_BYTE);
+        ve.setProgram(compileCommandList(cmds, req_mem_size));
+        run_result result{ ve.run(), 0 };
+        // The stack is taken from the memory first, the heap follows it; values are stored most significant byte first
+        for(size_t i = 0; i < BIT_64; i++) result.first = (result.first << 8) | ve.getMemory()._data[stack_size + i];
+        std::cout.rdbuf(cout_buf);
+        return result;
+    }
+
+    bool check(const std::string &name, bool passed) {
+        std::cout << (passed ? "PASS " : "FAIL ") << name << std::endl;
+        return passed;
+    }
+
+    // A function keeping more values than fit the stack twice saved while it's called from within another function
+    bool testStackOverflow() {
+        id_map ids;
+        stmt_list stmts;
+        size_t result = ids.getID();
+        size_t inner = ids.getID();
+        size_t outer = ids.getID();
+        size_t inner_param = ids.getID();
+        size_t outer_param = ids.getID();
+
+        stmt_list inner_body;
+        abstract_expression* sum = nullptr;
+        for(int64_t i = 0; i < 30; i++) {
+            size_t value = ids.getID();
+            inner_body.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(inner_param), new exp_constant(i), MULTIPLICATION), value, true));
+            sum = sum == nullptr ? (abstract_expression*)new exp_variable(value) : new exp_arithmetic_double(sum, new exp_variable(value), ADDITION);
+        }
+        inner_body.push_back(new stmt_flow_control(RETURN, sum));
+        stmts.push_back(new stmt_function_definition(inner, { inner_param }, inner_body));
+
+        stmt_list outer_body;
+        outer_body.push_back(new stmt_flow_control(RETURN, new exp_arithmetic_double(
+                new exp_call(inner, { new exp_variable(outer_param) }),
+                new exp_call(inner, { new exp_arithmetic_double(new exp_variable(outer_param), new exp_constant(1), ADDITION) }),
+                ADDITION)));
+        stmts.push_back(new stmt_function_definition(outer, { outer_param }, outer_body));
+        stmts.push_back(new stmt_assignment(new exp_call(outer, { new exp_constant(3) }), result, true));
+
+        // 3 * 435 + 4 * 435
+        run_result large = runProgram(stmts, ids, 32, ALLOCATOR_GRAPH_COLORING, 4096);
+        run_result small = runProgram(stmts, ids, 32, ALLOCATOR_GRAPH_COLORING, 256);
+        for(abstract_statement* stmt : stmts) delete stmt;
+        return check("Saved registers fit a large stack", large.code == SWM_RET_SUCCESS && large.first == 3045)
+               & check("Saved registers overflow a small stack", small.code == SWM_RET_STACK_OVERFLOW);
+    }
+
+    // A program calling a function needs a register besides the ones passing the arguments
+    bool testArgumentRegisters() {
+        id_map ids;
+        stmt_list stmts;
+        size_t result = ids.getID();
+        size_t function = ids.getID();
+        std::vector<size_t> params;
+        std::vector<const abstract_expression*> args;
+        abstract_expression* sum = nullptr;
+        for(int64_t i = 0; i < 3; i++) {
+            params.push_back(ids.getID());
+            args.push_back(new exp_constant(i + 1));
+            sum = sum == nullptr ? (abstract_expression*)new exp_variable(params.back()) : new exp_arithmetic_double(sum, new exp_variable(params.back()), ADDITION);
+        }
+        stmt_list body;
+        body.push_back(new stmt_flow_control(RETURN, sum));
+        stmts.push_back(new stmt_function_definition(function, params, body));
+        stmts.push_back(new stmt_assignment(new exp_call(function, args), result, true));
+
+        bool rejected = false;
+        try {
+            runProgram(stmts, ids, 3 + SWM_OPT_CALL_REGISTERS - 1, ALLOCATOR_LINEAR_SCAN, 256);
+        } catch(OptimizeException &e) {
+            rejected = e.type() == OptimizeException::OUT_OF_REGISTERS;
+        }
+        run_result linear = runProgram(stmts, ids, 3 + SWM_OPT_CALL_REGISTERS, ALLOCATOR_LINEAR_SCAN, 256);
+        run_result coloring = runProgram(stmts, ids, 3 + SWM_OPT_CALL_REGISTERS, ALLOCATOR_GRAPH_COLORING, 256);
+        for(abstract_statement* stmt : stmts) delete stmt;
+        return check("Too few registers for the arguments are rejected", rejected)
+               & check("The fewest registers for the arguments suffice",
+                       linear.code == SWM_RET_SUCCESS && linear.first == 6 && coloring.code == SWM_RET_SUCCESS && coloring.first == 6);
+    }
+
+    // A function only names its own parameters and variables; writes to the caller's would never reach it
+    bool testOutsideVariable() {
+        id_map ids;
+        stmt_list stmts;
+        size_t result = ids.getID();
+        size_t global = ids.getID();
+        size_t function = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(5), global, true));
+        stmt_list body;
+        body.push_back(new stmt_assignment(new exp_constant(9), global));
+        body.push_back(new stmt_flow_control(RETURN, new exp_constant(0)));
+        stmts.push_back(new stmt_function_definition(function, {}, body));
+        stmts.push_back(new stmt_assignment(new exp_call(function, {}), result, true));
+        stmts.push_back(new stmt_assignment(new exp_variable(global), result));
+
+        bool rejected = false;
+        try {
+            runProgram(stmts, ids, 16, ALLOCATOR_LINEAR_SCAN, 256);
+        } catch(OptimizeException &e) {
+            rejected = e.type() == OptimizeException::SCOPE_CONTROL;
+        }
+        for(abstract_statement* stmt : stmts) delete stmt;
+        return check("Functions naming the caller's variables are rejected", rejected);
+    }
+
+    // Parameters and variables of a function that share their IDs with the caller's keep apart, whatever is spilled
+    bool testFunctionSlots() {
+        id_map ids;
+        stmt_list stmts;
+        size_t result = ids.getID();
+        size_t function = ids.getID();
+        size_t x = ids.getID();
+        size_t i = ids.getID();
+
+        // f(i) { x = i; i = 9; return x + i }
+        stmt_list body;
+        body.push_back(new stmt_assignment(new exp_variable(i), x, true));
+        body.push_back(new stmt_assignment(new exp_constant(9), i));
+        body.push_back(new stmt_flow_control(RETURN, new exp_arithmetic_double(new exp_variable(x), new exp_variable(i), ADDITION)));
+        stmts.push_back(new stmt_function_definition(function, { i }, body));
+
+        // for(x = 1, i = 0, n = 0; n < 100; n++) { result += f(n) + x + i; x++; i += 2 }
+        size_t n = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(0), result, true));
+        stmts.push_back(new stmt_assignment(new exp_constant(1), x, true));
+        stmts.push_back(new stmt_assignment(new exp_constant(0), i, true));
+        stmt_list loop;
+        loop.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(result), new exp_arithmetic_double(
+                new exp_call(function, { new exp_variable(n) }), new exp_arithmetic_double(new exp_variable(x), new exp_variable(i), ADDITION),
+                ADDITION), ADDITION), result));
+        loop.push_back(new stmt_expr(new exp_arithmetic_single(new exp_variable(x), INCREMENT)));
+        loop.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(i), new exp_constant(2), ADDITION), i));
+        stmts.push_back(new stmt_loop(loop, new stmt_assignment(new exp_constant(0), n, true),
+                                      new exp_comparison(new exp_variable(n), new exp_constant(100), LESS),
+                                      new stmt_expr(new exp_arithmetic_single(new exp_variable(n), INCREMENT))));
+
+        // The sums of n + 9, of x and of i over the iterations
+        bool passed = true;
+        const vbyte registers[] = { 7, 8, 12, 16 };
+        const RegisterAllocator allocators[] = { ALLOCATOR_LINEAR_SCAN, ALLOCATOR_GRAPH_COLORING };
+        for(vbyte count : registers)
+            for(RegisterAllocator allocator : allocators) {
+                run_result run = runProgram(stmts, ids, count, allocator, 256);
+                passed &= run.code == SWM_RET_SUCCESS && run.first == 4950 + 900 + 5050 + 9900;
+            }
+        for(abstract_statement* stmt : stmts) delete stmt;
+        return check("Function variables don't share the caller's slots", passed);
+    }
+
+    // Only values live across a call are kept out of the registers passing arguments; the commands around it use them
+    bool testCallerSaved() {
+        id_map ids;
+        stmt_list stmts;
+        size_t result = ids.getID();
+        size_t function = ids.getID();
+        size_t a = ids.getID();
+        size_t b = ids.getID();
+        size_t c = ids.getID();
+
+        // f(a, b, c) { return a * b + c }
+        stmt_list body;
+        body.push_back(new stmt_flow_control(RETURN, new exp_arithmetic_double(
+                new exp_arithmetic_double(new exp_variable(a), new exp_variable(b), MULTIPLICATION), new exp_variable(c), ADDITION)));
+        stmts.push_back(new stmt_function_definition(function, { a, b, c }, body));
+
+        // for(n = 0; n < 10; n++) result += f(n, n + 1, n + 2) * (n - 1)
+        size_t n = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(0), result, true));
+        stmt_list loop;
+        loop.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_variable(result), new exp_arithmetic_double(
+                new exp_call(function, { new exp_variable(n),
+                                         new exp_arithmetic_double(new exp_variable(n), new exp_constant(1), ADDITION),
+                                         new exp_arithmetic_double(new exp_variable(n), new exp_constant(2), ADDITION) }),
+                new exp_arithmetic_double(new exp_variable(n), new exp_constant(1), SUBTRACTION), MULTIPLICATION), ADDITION), result));
+        stmts.push_back(new stmt_loop(loop, new stmt_assignment(new exp_constant(0), n, true),
+                                      new exp_comparison(new exp_variable(n), new exp_constant(10), LESS),
+                                      new stmt_expr(new exp_arithmetic_single(new exp_variable(n), INCREMENT))));
+
+        // With a single register left besides the arguments, every command outside the calls needs them
+        bool passed = true;
+        const vbyte registers[] = { 3 + SWM_OPT_CALL_REGISTERS, 5, 8 };
+        const RegisterAllocator allocators[] = { ALLOCATOR_LINEAR_SCAN, ALLOCATOR_GRAPH_COLORING };
+        for(vbyte count : registers)
+            for(RegisterAllocator allocator : allocators) {
+                run_result run = runProgram(stmts, ids, count, allocator, 256);
+                passed &= run.code == SWM_RET_SUCCESS && run.first == 2290;
+            }
+        for(abstract_statement* stmt : stmts) delete stmt;
+        return check("Calls keep only the values live across them out of the argument registers", passed);
+    }
+
+    // Units compiled incrementally come out the same as compiled in one go, down to the disabled passes
+    bool testIncrementalSettings() {
+        id_map ids;
+        std::vector<stmt_list> units(2);
+        for(stmt_list &unit : units) {
+            size_t value = ids.getID();
+            unit.push_back(new stmt_assignment(new exp_arithmetic_double(new exp_constant(6), new exp_constant(7), MULTIPLICATION), value, true));
+        }
+
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        optimizer_settings settings{ BIT_64, 16, label_map(), false, ALLOCATOR_LINEAR_SCAN, PASS_CONSTANT_FOLDING };
+        ve_program parallel = compileUnitsParallel(units, settings, ids, 1);
+        incremental_compiler compiler(settings);
+        ve_program incremental = compiler.compile(units, ids);
+        std::cout.rdbuf(cout_buf);
+
+        for(stmt_list &unit : units)
+            for(abstract_statement* stmt : unit)
+                delete stmt;
+        return check("Incremental compiles keep the disabled passes", incremental._exec == parallel._exec);
+    }
+
+    // Threads sharing a concurrent memory get disjoint chunks, and all of it coalesces again once they are done; the
+    // largest chunks run across several arenas
+    bool testConcurrentArenas() {
+        const size_t THREADS = 4;
+        const size_t SIZES[] = { 24, 200, 3000, 20000 };
+        ve_memory mem(64, MEM_KB);
+        mem.setConcurrent(true);
+        std::atomic<bool> disjoint(true);
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < THREADS; t++)
+            threads.push_back(std::thread([&mem, &disjoint, &SIZES, t]() {
+                for(size_t i = 0; i < 500; i++) {
+                    size_t size = SIZES[(i + t) % 4];
+                    size_t begin, end;
+                    if(mem.allocMemChunk(size, &begin, &end) == nullptr) continue;
+                    for(size_t b = begin; b <= end; b++) mem._data[b] = (vbyte)(t + 1);
+                    std::this_thread::yield();
+                    for(size_t b = begin; b <= end; b++)
+                        if(mem._data[b] != (vbyte)(t + 1)) disjoint = false;
+                    mem.freeMemChunk(begin, end);
+                }
+            }));
+        for(std::thread &thread : threads) thread.join();
+
+        size_t begin, end;
+        bool spanning = mem.allocMemChunk(40 * MEM_KB, &begin, &end) != nullptr;
+        if(spanning) mem.freeMemChunk(begin, end);
+        mem.flushThreadCaches();
+        bool flushed = mem.getStats().bytes_cached == 0;
+        mem.setConcurrent(false);
+        const ve_memory_stats &stats = mem.getStats();
+        return check("Concurrent allocations are disjoint and coalesce again",
+                     disjoint && spanning && flushed && stats.hole_count == 1 && stats.largest_free_block == 64 * MEM_KB);
+    }
+
+    // A chunk handed out again doesn't show what its last owner left in it
+    bool testAllocZeroed() {
+        id_map ids;
+        stmt_list stmts;
+        size_t result = ids.getID();
+        size_t first = ids.getID();
+        size_t second = ids.getID();
+        stmts.push_back(new stmt_assignment(new exp_constant(1), result, true));
+        stmts.push_back(new stmt_assignment(new exp_alloc(new exp_constant(16)), first, true));
+        stmts.push_back(new stmt_store(new exp_variable(first), new exp_constant(99), BIT_64));
+        stmts.push_back(new stmt_free(new exp_variable(first)));
+        stmts.push_back(new stmt_assignment(new exp_alloc(new exp_constant(16)), second, true));
+        stmts.push_back(new stmt_assignment(new exp_load(new exp_variable(second), BIT_64), result));
+
+        run_result run = runProgram(stmts, ids, 16, ALLOCATOR_LINEAR_SCAN, 128);
+        for(abstract_statement* stmt : stmts) delete stmt;
+        return check("Allocated chunks start out zeroed", run.code == SWM_RET_SUCCESS && run.first == 0);
+    }
+
+    // A label placed twice would leave jumps to it pointing at whichever came last
+    bool testDuplicateLabel() {
+        label_map labels;
+        label_id label = labels.create();
+        cc_list cmds;
+        cmds.emplace_back<cc_label>(labels, label);
+        cmds.emplace_back<cc_jump>(labels, label);
+        cmds.emplace_back<cc_label>(labels, label);
+        bool rejected = false;
+        std::streambuf* cout_buf = std::cout.rdbuf(nullptr);
+        try {
+            compileCommandList(cmds, 0);
+        } catch(CompileException &e) {
+            rejected = e.type() == CompileException::DUPLICATE_LABEL;
+        }
+        std::cout.rdbuf(cout_buf);
+        return check("Labels placed twice are rejected", rejected);
+    }
+
+}
+
+int main() {
+
+    try {
+        bool passed = true;
+        passed &= testStackOverflow();
+        passed &= testArgumentRegisters();
+        passed &= testOutsideVariable();
+        passed &= testFunctionSlots();
+        passed &= testCallerSaved();
+        passed &= testIncrementalSettings();
+        passed &= testConcurrentArenas();
+        passed &= testAllocZeroed();
+        passed &= testDuplicateLabel();
+        return passed ? 0 : 1;
+    } catch(std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+}
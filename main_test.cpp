@@ -33,5 +33,15 @@ int main() {
     mem.printFreeSectionsChronological();
     mem.printFreeSectionsOrdered();
 
+    mem.allocMemChunk(4096);
+    mem.printStats();
+
+    // Growable memory starts small and commits more as allocations need it
+    ve_memory growable(1024, MEM_BYTE, 1, MEM_MB);
+    growable.allocMemChunk(512);
+    growable.allocMemChunk(4096);
+    growable.printFreeSectionsChronological();
+    growable.printStats();
+
     return 0;
 }
\ No newline at end of file
@@ -1,4 +1,436 @@
 #include "optimizer.h"
+#include "linker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <thread>
+
+stmt_list foldConstants(const stmt_list &stmts, const optimizer_settings &settings) {
+    DEBUG_PRINT("Folding Constants");
+    constant_map constants;
+    return abstract_statement::fold(stmts, constants, settings);
+}
+
+stmt_list unrollLoops(const stmt_list &stmts, const optimizer_settings &settings) {
+    DEBUG_PRINT("Unrolling Loops");
+    return abstract_statement::unroll(stmts, settings);
+}
+
+namespace {
+
+    typedef std::pair<size_t, BitWidth> mem_slot; // Constant address and width of a memory access
+
+    bool slotsOverlap(const mem_slot &a, const mem_slot &b) {
+        return a.first < b.first + b.second && b.first < a.first + a.second;
+    }
+
+    // Whether a store to outer replaces all of inner
+    bool slotCovers(const mem_slot &outer, const mem_slot &inner) {
+        return outer.first <= inner.first && inner.first + inner.second <= outer.first + outer.second;
+    }
+
+    // Every slot accessed by a constant address, with the slots sharing bytes with it
+    struct slot_table {
+        std::map<mem_slot, size_t> index;
+        std::vector<mem_slot> slots;
+        std::vector<std::vector<size_t>> overlapping; // Including the slot itself
+        std::vector<std::vector<size_t>> covered;     // Replaced entirely by a store to the slot, including itself
+
+        size_t find(size_t address, BitWidth width) const { return index.at({ address, width }); }
+    };
+
+    enum FlowKind {
+        FLOW_REMOVED,
+        FLOW_OTHER,
+        FLOW_LOAD,      // MVTOREG_CONST
+        FLOW_STORE,     // MVTOMEM_CONST
+        FLOW_BARRIER    // Nothing is assumed about memory across it
+    };
+
+    // A command as the memory traffic passes see it, classified once as the passes revisit commands until their
+    // results settle
+    struct flow_command {
+        cc_iter iter;
+        FlowKind kind;
+        size_t slot;
+        vbyte reg;          // Register loaded or stored
+        BitWidth width;
+    };
+
+    // Straight-line run of commands starting at a label or after a jump
+    struct flow_block {
+        std::vector<flow_command> commands;
+        cc_jump_operation* jump;
+        std::vector<size_t> successors;
+        std::vector<size_t> predecessors;
+        bool exit; // Leaves the command list, either at its end or by jumping to a label placed elsewhere
+    };
+
+    std::vector<flow_block> buildFlowBlocks(cc_list &cmds, const slot_table &table) {
+        std::vector<flow_block> blocks;
+        std::map<std::pair<label_map*, label_id>, size_t> targets;
+        bool open = false;
+        bool after_label = false;
+        for(cc_iter it = cmds.begin(); it != cmds.end(); it++) {
+            compiler_command* cmd = *it;
+            label_map* map = cmd->labels();
+            cc_label* label = map != nullptr ? dynamic_cast<cc_label*>(cmd) : nullptr;
+
+            // A run of labels starts a single block
+            if(!open || (label != nullptr && !after_label)) {
+                blocks.push_back({ {}, nullptr, {}, {}, false });
+                open = true;
+            }
+            after_label = label != nullptr;
+            flow_block &block = blocks.back();
+            if(label != nullptr) {
+                targets[{ map, label->_label }] = blocks.size() - 1;
+                continue;
+            }
+
+            flow_command command{ it, FLOW_OTHER, 0, 0, BIT_8 };
+            size_t offset;
+            BitWidth width;
+            if(cmd->heapAddress(offset, width)) {
+                if(cc_move_to_register_constant* load = dynamic_cast<cc_move_to_register_constant*>(cmd)) {
+                    command = { it, FLOW_LOAD, table.find(load->_mem_address.getu(), load->_width), load->_target_register, load->_width };
+                } else if(cc_move_to_memory_constant* store = dynamic_cast<cc_move_to_memory_constant*>(cmd)) {
+                    command = { it, FLOW_STORE, table.find(store->_mem_address.getu(), store->_width), store->_target_register, store->_width };
+                } else command.kind = FLOW_BARRIER;
+            } else if(cmd->memoryBarrier()) command.kind = FLOW_BARRIER;
+            block.commands.push_back(command);
+
+            if(map != nullptr && (block.jump = dynamic_cast<cc_jump_operation*>(cmd)) != nullptr) open = false;
+        }
+
+        for(size_t b = 0; b < blocks.size(); b++) {
+            flow_block &block = blocks[b];
+            if(block.jump != nullptr) {
+                std::map<std::pair<label_map*, label_id>, size_t>::iterator target = targets.find({ block.jump->labels(), block.jump->_label });
+                if(target != targets.end()) block.successors.push_back(target->second);
+                else block.exit = true;
+            }
+            if(block.jump == nullptr || dynamic_cast<cc_jump*>(block.jump) == nullptr) {
+                if(b + 1 < blocks.size()) block.successors.push_back(b + 1);
+                else block.exit = true;
+            }
+            for(size_t successor : block.successors) blocks[successor].predecessors.push_back(b);
+        }
+        return blocks;
+    }
+
+    // Registers known to hold what reloading a slot would give them, sorted
+    typedef std::vector<std::pair<vbyte, size_t>> held_set;
+
+    void holdSlot(held_set &held, vbyte reg, size_t slot) {
+        std::pair<vbyte, size_t> entry(reg, slot);
+        held_set::iterator pos = std::lower_bound(held.begin(), held.end(), entry);
+        if(pos == held.end() || *pos != entry) held.insert(pos, entry);
+    }
+
+    void releaseRegister(held_set &held, vbyte reg) {
+        held.erase(std::remove_if(held.begin(), held.end(), [reg](const std::pair<vbyte, size_t> &entry) {
+            return entry.first == reg;
+        }), held.end());
+    }
+
+    // Forward pass: reloads of a slot into a register already holding it are dropped, reloads of a slot held by another
+    // register become copies, and stores of a value the slot already holds are dropped. The blocks are updated to match.
+    size_t removeRedundantMoves(cc_list &cmds, std::vector<flow_block> &blocks, const slot_table &table, BitWidth register_width) {
+
+        // Applies a command to the state; returns false if the command can be removed
+        auto transfer = [&](held_set &held, const flow_command &command) -> bool {
+            switch(command.kind) {
+                case FLOW_LOAD: {
+                    if(std::binary_search(held.begin(), held.end(), std::make_pair(command.reg, command.slot))) return false;
+                    releaseRegister(held, command.reg);
+                    holdSlot(held, command.reg, command.slot);
+                } break;
+                case FLOW_STORE: {
+                    if(std::binary_search(held.begin(), held.end(), std::make_pair(command.reg, command.slot))) return false;
+                    const mem_slot &slot = table.slots[command.slot];
+                    held.erase(std::remove_if(held.begin(), held.end(), [&](const std::pair<vbyte, size_t> &entry) {
+                        return slotsOverlap(table.slots[entry.second], slot);
+                    }), held.end());
+                    // A narrower store truncates the value, so reloading it may not give the register back
+                    if(command.width == register_width) holdSlot(held, command.reg, command.slot);
+                } break;
+                case FLOW_BARRIER:
+                    held.clear();
+                    break;
+                case FLOW_OTHER: {
+                    // Entries are sorted by register, so each register is only checked once
+                    const compiler_command* cmd = *command.iter;
+                    held_set::iterator kept = held.begin();
+                    for(held_set::iterator it = held.begin(); it != held.end();) {
+                        held_set::iterator next = it;
+                        while(next != held.end() && next->first == it->first) next++;
+                        if(!cmd->writes(it->first)) kept = std::copy(it, next, kept);
+                        it = next;
+                    }
+                    held.erase(kept, held.end());
+                } break;
+                case FLOW_REMOVED:
+                    break;
+            }
+            return true;
+        };
+
+        // Iterate to the greatest fixed point, treating unreached blocks as holding everything
+        std::vector<held_set> in(blocks.size());
+        std::vector<held_set> out(blocks.size());
+        std::vector<bool> reached(blocks.size(), false);
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(size_t b = 0; b < blocks.size(); b++) {
+                held_set state;
+                bool any = b == 0;
+                if(b != 0) {
+                    for(size_t pred : blocks[b].predecessors) {
+                        if(!reached[pred]) continue;
+                        if(!any) state = out[pred];
+                        else {
+                            held_set common;
+                            std::set_intersection(state.begin(), state.end(), out[pred].begin(), out[pred].end(),
+                                                  std::back_inserter(common));
+                            state.swap(common);
+                        }
+                        any = true;
+                    }
+                }
+                if(!any) continue;
+                in[b] = state;
+                for(const flow_command &command : blocks[b].commands) transfer(state, command);
+                if(!reached[b] || state != out[b]) {
+                    out[b].swap(state);
+                    reached[b] = true;
+                    // Later blocks see the new state in this sweep already
+                    for(size_t successor : blocks[b].successors)
+                        if(successor <= b) changed = true;
+                }
+            }
+        }
+
+        size_t removed = 0;
+        for(size_t b = 0; b < blocks.size(); b++) {
+            flow_block &block = blocks[b];
+            held_set state = reached[b] ? in[b] : held_set();
+            for(flow_command &command : block.commands) {
+                // A reload of a slot another register holds becomes a copy from it
+                vbyte source = command.reg;
+                if(command.kind == FLOW_LOAD)
+                    for(const std::pair<vbyte, size_t> &entry : state)
+                        if(entry.second == command.slot) source = entry.first;
+
+                if(!transfer(state, command)) {
+                    cmds.erase(command.iter);
+                    command.kind = FLOW_REMOVED;
+                    removed++;
+                } else if(command.kind == FLOW_LOAD && source != command.reg) {
+                    cmds.emplace<cc_copy_register>(command.iter, source, command.reg);
+                    cc_iter copy = std::prev(command.iter);
+                    cmds.erase(command.iter);
+                    command.iter = copy;
+                    command.kind = FLOW_OTHER;
+                }
+            }
+        }
+        return removed;
+    }
+
+    // Loads into a register the same block writes again before reading it
+    size_t removeDeadLoads(cc_list &cmds, std::vector<flow_block> &blocks) {
+        size_t removed = 0;
+        for(flow_block &block : blocks) {
+            for(size_t c = 0; c < block.commands.size(); c++) {
+                flow_command &load = block.commands[c];
+                if(load.kind != FLOW_LOAD) continue;
+                for(size_t next = c + 1; next < block.commands.size(); next++) {
+                    const flow_command &command = block.commands[next];
+                    if(command.kind == FLOW_REMOVED) continue;
+                    if((*command.iter)->reads(load.reg)) break;
+                    if((*command.iter)->writes(load.reg)) {
+                        cmds.erase(load.iter);
+                        load.kind = FLOW_REMOVED;
+                        removed++;
+                        break;
+                    }
+                }
+            }
+        }
+        return removed;
+    }
+
+    // Backward pass: stores are dropped unless a later load, a barrier or the end of the commands can observe the slot
+    size_t removeDeadStores(cc_list &cmds, std::vector<flow_block> &blocks, const slot_table &table) {
+        const size_t n = table.slots.size();
+
+        // Applies a command to the live slots, going backwards; returns false for a dead store
+        auto transfer = [&](std::vector<bool> &live, const flow_command &command) -> bool {
+            switch(command.kind) {
+                case FLOW_LOAD:
+                    for(size_t i : table.overlapping[command.slot]) live[i] = true;
+                    break;
+                case FLOW_STORE:
+                    if(!live[command.slot]) return false;
+                    for(size_t i : table.covered[command.slot]) live[i] = false;
+                    break;
+                case FLOW_BARRIER:
+                    live.assign(n, true);
+                    break;
+                case FLOW_OTHER:
+                case FLOW_REMOVED:
+                    break;
+            }
+            return true;
+        };
+
+        std::vector<std::vector<bool>> out(blocks.size(), std::vector<bool>(n, false));
+        std::vector<std::vector<bool>> in(blocks.size(), std::vector<bool>(n, false));
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(size_t b = blocks.size(); b-- > 0;) {
+                std::vector<bool> live(n, blocks[b].exit);
+                for(size_t successor : blocks[b].successors)
+                    for(size_t i = 0; i < n; i++)
+                        if(in[successor][i]) live[i] = true;
+                out[b] = live;
+                const std::vector<flow_command> &commands = blocks[b].commands;
+                for(size_t c = commands.size(); c-- > 0;) transfer(live, commands[c]);
+                if(live != in[b]) {
+                    in[b].swap(live);
+                    // Earlier blocks see the new state in this sweep already
+                    for(size_t pred : blocks[b].predecessors)
+                        if(pred >= b) changed = true;
+                }
+            }
+        }
+
+        size_t removed = 0;
+        for(size_t b = 0; b < blocks.size(); b++) {
+            std::vector<bool> &live = out[b];
+            std::vector<flow_command> &commands = blocks[b].commands;
+            for(size_t c = commands.size(); c-- > 0;) {
+                if(!transfer(live, commands[c])) {
+                    cmds.erase(commands[c].iter);
+                    commands[c].kind = FLOW_REMOVED;
+                    removed++;
+                }
+            }
+        }
+        return removed;
+    }
+
+}
+
+size_t removeMemoryTraffic(cc_list &cmds, BitWidth register_width) {
+    DEBUG_PRINT("Removing Memory Traffic");
+
+    slot_table table;
+    for(compiler_command* cmd : cmds) {
+        if(cc_move_to_register_constant* load = dynamic_cast<cc_move_to_register_constant*>(cmd))
+            table.index.insert({ { load->_mem_address.getu(), load->_width }, 0 });
+        else if(cc_move_to_memory_constant* store = dynamic_cast<cc_move_to_memory_constant*>(cmd))
+            table.index.insert({ { store->_mem_address.getu(), store->_width }, 0 });
+    }
+    if(table.index.empty()) return 0;
+
+    // Slots are ordered by address, so only the following ones up to the end of a slot can overlap it
+    for(std::pair<const mem_slot, size_t> &entry : table.index) {
+        entry.second = table.slots.size();
+        table.slots.push_back(entry.first);
+    }
+    const size_t n = table.slots.size();
+    table.overlapping.resize(n);
+    table.covered.resize(n);
+    for(size_t i = 0; i < n; i++) {
+        table.overlapping[i].push_back(i);
+        table.covered[i].push_back(i);
+        for(size_t j = i + 1; j < n && slotsOverlap(table.slots[i], table.slots[j]); j++) {
+            table.overlapping[i].push_back(j);
+            table.overlapping[j].push_back(i);
+            if(slotCovers(table.slots[i], table.slots[j])) table.covered[i].push_back(j);
+            if(slotCovers(table.slots[j], table.slots[i])) table.covered[j].push_back(i);
+        }
+    }
+
+    // Dropping loads first leaves more stores without a reader
+    std::vector<flow_block> blocks = buildFlowBlocks(cmds, table);
+    if(blocks.empty()) return 0;
+    size_t removed = removeRedundantMoves(cmds, blocks, table, register_width);
+    removed += removeDeadLoads(cmds, blocks);
+    return removed + removeDeadStores(cmds, blocks, table);
+}
+
+namespace {
+
+    // Functions a list of commands calls, by their index
+    std::set<size_t> calledFunctions(const cc_list &cmds, const std::unordered_map<label_id, size_t> &functions) {
+        std::set<size_t> result;
+        for(compiler_command* cmd : cmds)
+            if(cc_call* call = dynamic_cast<cc_call*>(cmd)) result.insert(functions.at(call->_label));
+        return result;
+    }
+
+    // Adds the entry and exit of a compiled function body. The entry pushes the registers the body overwrites, apart
+    // from the ones passing arguments, and the exit pops them again before returning. A function that may call itself
+    // also keeps the heap slots [frame_begin, frame_end) of its variables on the stack meanwhile, as the calls share them.
+    void addFunctionFrame(cc_list &body, label_map &labels, label_id label, const optimizer_settings &settings,
+                          vbyte argument_registers, size_t frame_begin, size_t frame_end) {
+        std::vector<vbyte> saved;
+        for(vbyte reg = argument_registers; reg < settings.max_register_count; reg++)
+            for(compiler_command* cmd : body)
+                if(cmd->writes(reg)) {
+                    saved.push_back(reg);
+                    break;
+                }
+
+        std::vector<std::pair<size_t, BitWidth>> frame;
+        for(size_t pos = frame_begin; pos < frame_end;) {
+            // In the widest pieces a register holds
+            size_t left = std::min<size_t>(frame_end - pos, settings.program_width);
+            BitWidth width = left >= BIT_64 ? BIT_64 : left >= BIT_32 ? BIT_32 : left >= BIT_16 ? BIT_16 : BIT_8;
+            frame.push_back({ pos, width });
+            pos += width;
+        }
+        // The frame is copied through the lowest register the body may use
+        vbyte scratch = argument_registers;
+        if(!frame.empty() && std::find(saved.begin(), saved.end(), scratch) == saved.end())
+            saved.insert(saved.begin(), scratch);
+
+        cc_iter first = body.begin();
+        body.emplace<cc_label>(first, labels, label);
+        for(vbyte reg : saved) {
+            body.emplace<cc_move_to_memory>(first, reg, SWM_REG_STACK, settings.program_width);
+            body.emplace<cc_alu_const_add>(first, SWM_REG_STACK, SWM_REG_STACK, settings.program_width, BIT_8);
+        }
+        for(const std::pair<size_t, BitWidth> &slot : frame) {
+            BitWidth address_width = scope_struct::addressWidth(settings, slot.first);
+            body.emplace<cc_move_to_register_constant>(first, scratch, slot.first, address_width, slot.second);
+            body.emplace<cc_move_to_memory>(first, scratch, SWM_REG_STACK, slot.second);
+            body.emplace<cc_alu_const_add>(first, SWM_REG_STACK, SWM_REG_STACK, slot.second, BIT_8);
+        }
+
+        for(size_t i = frame.size(); i-- > 0;) {
+            BitWidth address_width = scope_struct::addressWidth(settings, frame[i].first);
+            body.emplace_back<cc_alu_const_subtract>(SWM_REG_STACK, SWM_REG_STACK, frame[i].second, BIT_8);
+            body.emplace_back<cc_move_to_register>(scratch, SWM_REG_STACK, frame[i].second);
+            body.emplace_back<cc_move_to_memory_constant>(scratch, frame[i].first, address_width, frame[i].second);
+        }
+        for(size_t i = saved.size(); i-- > 0;) {
+            body.emplace_back<cc_alu_const_subtract>(SWM_REG_STACK, SWM_REG_STACK, settings.program_width, BIT_8);
+            body.emplace_back<cc_move_to_register>(saved[i], SWM_REG_STACK, settings.program_width);
+        }
+        body.emplace_back<cc_return>();
+    }
+
+}
 
 cc_list compileOptimizeList(const std::list<abstract_statement*> &stmts, optimizer_settings &settings, id_map &ids, size_t* req_mem_size) {
 
@@ -8,16 +440,421 @@ cc_list compileOptimizeList(const std::list<abstract_statement*> &stmts, optimiz
 
     DEBUG_PRINT("Optimizing");
 
-    for(abstract_statement* stmt : stmts) {
-        stmt->compile(output, scope, settings, mem, ids);
+    // The AST passes work on copies, so the caller's statements stay untouched. Unrolling goes first, so the copies of
+    // a fully unrolled body are folded with the counter's value known.
+    bool unroll = !(settings.disabled_passes & PASS_LOOP_UNROLLING);
+    bool fold = !(settings.disabled_passes & PASS_CONSTANT_FOLDING);
+    bool traffic = !(settings.disabled_passes & PASS_MEMORY_TRAFFIC);
+    stmt_list unrolled, folded;
+    if(unroll) unrolled = unrollLoops(stmts, settings);
+    const stmt_list &source = unroll ? unrolled : stmts;
+    if(fold) folded = foldConstants(source, settings);
+    const stmt_list &lowered = fold ? folded : source;
+
+    // Function definitions are taken out of the top level, so calls may come before them. Arguments and results are
+    // passed in the lowest registers, which calls may overwrite; only values live across a call are kept out of them.
+    std::vector<const stmt_function_definition*> definitions;
+    size_t argument_registers = 0;
+    for(abstract_statement* stmt : lowered)
+        if(const stmt_function_definition* definition = dynamic_cast<const stmt_function_definition*>(stmt)) {
+            definitions.push_back(definition);
+            argument_registers = std::max(argument_registers, std::max<size_t>(1, definition->_params.size()));
+        }
+
+    std::vector<cc_list> bodies(definitions.size());
+    std::vector<label_id> function_labels;
+    std::vector<size_t> frame_begin, frame_end;
+    size_t heap_end = 0;
+    try {
+        // Fewer would leave no register to reload spilled arguments into while the others are in place
+        size_t required_registers = definitions.empty() ? 0 : argument_registers + SWM_OPT_CALL_REGISTERS;
+        if(required_registers > settings.max_register_count)
+            throw OptimizeException::ArgumentRegisters(argument_registers, required_registers, settings.max_register_count);
+
+        for(const stmt_function_definition* definition : definitions) {
+            function_labels.push_back(settings.labels.create(SWM_OPT_LABEL_FUNCTION));
+            scope.addFunction(definition->_functionID, { function_labels.back(), definition->_params.size(), (vbyte)argument_registers });
+        }
+
+        for(abstract_statement* stmt : lowered) {
+            if(dynamic_cast<const stmt_function_definition*>(stmt) == nullptr)
+                stmt->compile(output, scope, settings, mem, ids);
+        }
+
+        DEBUG_PRINT("Calculating Registers");
+
+        scope.calculateRegisters(output, settings, mem, (vbyte)argument_registers);
+        heap_end = mem.size();
+
+        // Each body gets heap slots of its own behind the ones of the top level and of the bodies before, so
+        // parameters and variables sharing an ID with the caller's don't share their slot. These are the frame of a
+        // body that calls itself.
+        for(size_t f = 0; f < definitions.size(); f++) {
+            mem_map body_mem(heap_end);
+            frame_begin.push_back(heap_end);
+            definitions[f]->compileBody(bodies[f], scope, settings, body_mem, ids, (vbyte)argument_registers);
+            heap_end = body_mem.size();
+            frame_end.push_back(heap_end);
+        }
+    } catch(...) {
+        for(abstract_statement* stmt : unrolled) delete stmt;
+        for(abstract_statement* stmt : folded) delete stmt;
+        throw;
+    }
+    for(abstract_statement* stmt : unrolled) delete stmt;
+    for(abstract_statement* stmt : folded) delete stmt;
+
+    if(traffic)
+        removeMemoryTraffic(output, settings.program_width);
+
+    if(req_mem_size != nullptr) *req_mem_size = heap_end;
+
+    if(definitions.empty()) return output;
+
+    // Only the functions reached from the top level are emitted
+    std::unordered_map<label_id, size_t> function_index;
+    for(size_t f = 0; f < function_labels.size(); f++) function_index[function_labels[f]] = f;
+    std::vector<std::set<size_t>> callees;
+    for(const cc_list &body : bodies) callees.push_back(calledFunctions(body, function_index));
+
+    std::vector<bool> reached(bodies.size(), false);
+    std::set<size_t> main_callees = calledFunctions(output, function_index);
+    std::vector<size_t> pending(main_callees.begin(), main_callees.end());
+    while(!pending.empty()) {
+        size_t f = pending.back();
+        pending.pop_back();
+        if(reached[f]) continue;
+        reached[f] = true;
+        pending.insert(pending.end(), callees[f].begin(), callees[f].end());
+    }
+    if(std::find(reached.begin(), reached.end(), true) == reached.end()) return output;
+
+    DEBUG_PRINT("Adding Functions");
+
+    cc_list program;
+    label_id label_main = settings.labels.create(SWM_OPT_LABEL_MAIN);
+    program.emplace_back<cc_jump>(settings.labels, label_main);
+    for(size_t f = 0; f < bodies.size(); f++) {
+        if(!reached[f]) continue;
+
+        // Recursive if the function reaches itself again
+        std::vector<bool> visited(bodies.size(), false);
+        std::vector<size_t> path(callees[f].begin(), callees[f].end());
+        while(!path.empty() && !visited[f]) {
+            size_t g = path.back();
+            path.pop_back();
+            if(visited[g]) continue;
+            visited[g] = true;
+            path.insert(path.end(), callees[g].begin(), callees[g].end());
+        }
+        bool recursive = visited[f];
+
+        if(traffic)
+            removeMemoryTraffic(bodies[f], settings.program_width);
+        addFunctionFrame(bodies[f], settings.labels, function_labels[f], settings, (vbyte)argument_registers,
+                         recursive ? frame_begin[f] : 0, recursive ? frame_end[f] : 0);
+        program.splice(program.end(), bodies[f]);
+    }
+    program.emplace_back<cc_label>(settings.labels, label_main);
+    program.splice(program.end(), output);
+
+    return program;
+}
+
+ve_module compileUnit(const stmt_list &unit, const optimizer_settings &settings, const id_map &ids) {
+    optimizer_settings unit_settings{ settings.program_width, settings.max_register_count, label_map(), true, settings.allocator,
+                                      settings.disabled_passes, settings.unroll_factor, settings.unroll_budget };
+    id_map unit_ids = ids;
+    size_t req_mem_size;
+    cc_list cmds = compileOptimizeList(unit, unit_settings, unit_ids, &req_mem_size);
+    return compileModule(cmds, req_mem_size, unit_settings.labels, {});
+}
+
+ve_program compileUnitsParallel(const std::vector<stmt_list> &units, const optimizer_settings &settings, const id_map &ids, size_t thread_count) {
+
+    if(thread_count == 0) thread_count = std::thread::hardware_concurrency();
+    if(thread_count == 0) thread_count = 1;
+    if(thread_count > units.size()) thread_count = units.size();
+
+    DEBUG_PRINT("Compiling " << units.size() << " Units on " << thread_count << " Threads");
+
+    // Results are stored by unit index, so the linked program doesn't depend on which thread compiled what
+    std::vector<ve_module> modules(units.size());
+    std::vector<std::exception_ptr> errors(units.size());
+    std::atomic<size_t> next_unit(0);
+
+    auto worker = [&]() {
+        size_t u;
+        while((u = next_unit++) < units.size()) {
+            try {
+                modules[u] = compileUnit(units[u], settings, ids);
+            } catch(...) {
+                errors[u] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < thread_count; i++) threads.push_back(std::thread(worker));
+    worker();
+    for(std::thread &t : threads) t.join();
+
+    // Report the first failing unit in program order
+    for(std::exception_ptr &error : errors)
+        if(error) std::rethrow_exception(error);
+
+    std::vector<const ve_module*> module_ptrs;
+    for(ve_module &module : modules) module_ptrs.push_back(&module);
+    return linkModules(module_ptrs);
+}
+
+ve_program incremental_compiler::compile(const std::vector<stmt_list> &units, const id_map &ids) {
+
+    // Look up every unit, compiling the ones not seen before
+    std::unordered_map<uint64_t, ve_module> used;
+    std::vector<uint64_t> keys;
+    for(const stmt_list &unit : units) {
+        uint64_t key = abstract_statement::hash(unit);
+        keys.push_back(key);
+        if(used.count(key)) {
+            _hits++;
+            continue;
+        }
+        std::unordered_map<uint64_t, ve_module>::iterator it = _cache.find(key);
+        if(it != _cache.end()) {
+            used[key] = std::move(it->second);
+            _hits++;
+        } else {
+            used[key] = compileUnit(unit, _settings, ids);
+            _misses++;
+        }
     }
+    _cache = std::move(used);
+
+    DEBUG_PRINT("Incremental Compile: " << _hits << " Hits, " << _misses << " Misses");
+
+    std::vector<const ve_module*> modules;
+    for(uint64_t key : keys) modules.push_back(&_cache[key]);
+    return linkModules(modules);
+}
+
+std::vector<cc_iter> scope_struct::colorRegisters(std::deque<live_interval> &intervals, const std::set<vbyte> &available, const mem_map &mem,
+                                                  const CallSpans &spans, vbyte argument_registers) {
+
+    const std::vector<vbyte> colors(available.begin(), available.end());
+    const size_t k = colors.size();
+    // Groups live during a call span only take the colors from here up
+    const size_t first_allowed = std::distance(available.begin(), available.lower_bound(argument_registers));
+
+    // Whether b can take over a's register in the command where a ends and b begins. a may only be read and b
+    // only written there, and neither a store of a after the command nor a load of b before it may clobber the
+    // other; a store after a copy from a to b still sees a's value.
+    auto handoff = [&](const live_interval &a, const live_interval &b) -> bool {
+        if(a.end != b.begin || *a.last->iter != *b.first->iter) return false;
+        for(const reg_alloc* entry = a.last; entry != nullptr && entry->index_hint == a.end; entry = entry->prev) {
+            if(entry->reg_ptr == nullptr || entry->written) return false;
+            if(entry == a.first) break;
+        }
+        for(const reg_alloc* entry = b.first; entry != nullptr && entry->index_hint == b.begin; entry = entry->next) {
+            if(entry->reg_ptr == nullptr || entry->read || !entry->written) return false;
+            if(entry == b.last) break;
+        }
+        bool copy = dynamic_cast<cc_copy_register*>(*a.last->iter) != nullptr;
+        bool store_a = !a.use && mem.exists(a.last->varID);
+        bool load_b = !b.use && mem.exists(b.first->varID) && !b.first->defined;
+        return !load_b && (!store_a || copy);
+    };
+
+    // Whether b starts as a copy of a and neither is written again while both are live, so they hold the same value
+    // throughout and can share a register (Chaitin's rule for moves)
+    auto copyOf = [&](const live_interval &a, const live_interval &b) -> bool {
+        const cc_copy_register* copy = dynamic_cast<const cc_copy_register*>(*b.first->iter);
+        if(copy == nullptr || b.first->reg_ptr != &copy->_to_register || a.begin > b.begin || a.end < b.begin) return false;
 
-    DEBUG_PRINT("Calculating Registers");
+        size_t end = std::min(a.end, b.end);
+        bool source = false;
+        for(const reg_alloc* entry = a.last; entry != nullptr && entry->index_hint >= b.begin; entry = entry->prev) {
+            if(entry->index_hint <= end && entry->written) return false;
+            if(entry->reg_ptr == &copy->_from_register) source = true;
+            if(entry == a.first) break;
+        }
+        for(const reg_alloc* entry = b.first->next; entry != nullptr && entry->index_hint <= end; entry = entry->next) {
+            if(entry->written) return false;
+            if(entry == b.last) break;
+        }
 
-    std::unordered_set<vbyte> empty_reg_set;
-    scope.calculateRegisters(output, settings, mem, empty_reg_set);
+        // A load of b before the copy would overwrite a
+        bool load_b = !b.use && mem.exists(b.first->varID) && !b.first->defined;
+        return source && !load_b;
+    };
 
-    if(req_mem_size != nullptr) *req_mem_size = mem.size();
+    struct register_move {
+        cc_iter iter;
+        size_t from;
+        size_t to;
+    };
 
-    return output;
-}
\ No newline at end of file
+    while(true) {
+        const size_t n = intervals.size();
+
+        std::vector<size_t> order;
+        for(size_t i = 0; i < n; i++)
+            if(!intervals[i].split) order.push_back(i);
+        std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+            return intervals[lhs].begin < intervals[rhs].begin || (intervals[lhs].begin == intervals[rhs].begin && lhs < rhs);
+        });
+
+        // Build the interference graph by sweeping over the intervals
+        std::vector<std::unordered_set<size_t>> adj(n);
+        IntervalQueue active;
+        for(size_t i : order) {
+            while(!active.empty() && active.begin()->first < intervals[i].begin)
+                active.erase(active.begin());
+            for(const std::pair<size_t, size_t> &other : active) {
+                const live_interval &a = intervals[other.second];
+                const live_interval &b = intervals[i];
+                if(handoff(a, b) || handoff(b, a) || copyOf(a, b) || copyOf(b, a)) continue;
+                adj[i].insert(other.second);
+                adj[other.second].insert(i);
+            }
+            active.insert({ intervals[i].end, i });
+        }
+
+        // Collect the copies between two intervals, in program order of their operands
+        std::vector<register_move> moves;
+        std::unordered_map<cc_copy_register*, size_t> move_index;
+        for(size_t i : order) {
+            reg_alloc* entry = intervals[i].first;
+            while(true) {
+                cc_copy_register* copy = entry->reg_ptr != nullptr ? dynamic_cast<cc_copy_register*>(*entry->iter) : nullptr;
+                if(copy != nullptr) {
+                    std::unordered_map<cc_copy_register*, size_t>::iterator it = move_index.find(copy);
+                    if(it == move_index.end()) {
+                        it = move_index.insert({ copy, moves.size() }).first;
+                        moves.push_back({ entry->iter, n, n });
+                    }
+                    if(entry->reg_ptr == &copy->_from_register) moves[it->second].from = i;
+                    else moves[it->second].to = i;
+                }
+                if(entry == intervals[i].last) break;
+                entry = entry->next;
+            }
+        }
+
+        // Coalesce conservatively (Briggs): only if the merged node has fewer than k neighbours of significant degree
+        std::vector<size_t> alias(n);
+        for(size_t i = 0; i < n; i++) alias[i] = i;
+        std::function<size_t(size_t)> find = [&](size_t i) -> size_t {
+            return alias[i] == i ? i : (alias[i] = find(alias[i]));
+        };
+
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(const register_move &move : moves) {
+                if(move.from == n || move.to == n) continue;
+                size_t x = find(move.from);
+                size_t y = find(move.to);
+                if(x == y || adj[x].count(y)) continue;
+
+                size_t significant = 0;
+                for(size_t neighbour : adj[x])
+                    if(adj[neighbour].size() - (adj[y].count(neighbour) ? 1 : 0) >= k) significant++;
+                for(size_t neighbour : adj[y])
+                    if(!adj[x].count(neighbour) && adj[neighbour].size() >= k) significant++;
+                if(significant >= k) continue;
+
+                alias[y] = x;
+                for(size_t neighbour : adj[y]) {
+                    adj[neighbour].erase(y);
+                    adj[neighbour].insert(x);
+                    adj[x].insert(neighbour);
+                }
+                adj[y].clear();
+                changed = true;
+            }
+        }
+
+        // Uses of spilled variables can't be spilled again, so groups made up of them only are never spill candidates
+        std::vector<bool> splittable(n, false), restricted(n, false);
+        for(size_t i : order) {
+            if(!intervals[i].use) splittable[find(i)] = true;
+            if(intervals[i].call) restricted[find(i)] = true;
+        }
+
+        // Simplify, optimistically pushing the node of highest degree when all are significant
+        std::vector<size_t> degree(n, 0);
+        std::set<std::pair<size_t, size_t>> worklist;
+        for(size_t i : order) {
+            if(find(i) != i) continue;
+            degree[i] = adj[i].size();
+            worklist.insert({ degree[i], i });
+        }
+        std::vector<bool> removed(n, false);
+        std::vector<size_t> stack;
+        while(!worklist.empty()) {
+            std::set<std::pair<size_t, size_t>>::iterator pick = worklist.begin();
+            if(pick->first >= k) {
+                std::set<std::pair<size_t, size_t>>::reverse_iterator candidate = worklist.rbegin();
+                while(candidate != worklist.rend() && !splittable[candidate->second]) candidate++;
+                if(candidate != worklist.rend()) pick = std::next(candidate).base();
+            }
+            size_t node = pick->second;
+            worklist.erase(pick);
+            removed[node] = true;
+            stack.push_back(node);
+            for(size_t neighbour : adj[node]) {
+                if(removed[neighbour]) continue;
+                worklist.erase({ degree[neighbour], neighbour });
+                worklist.insert({ --degree[neighbour], neighbour });
+            }
+        }
+
+        // Select the lowest color not taken by a neighbour
+        const size_t NO_COLOR = k;
+        std::vector<size_t> color(n, NO_COLOR);
+        std::vector<size_t> failed;
+        while(!stack.empty()) {
+            size_t node = stack.back();
+            stack.pop_back();
+            std::vector<bool> taken(k, false);
+            for(size_t neighbour : adj[node])
+                if(color[neighbour] != NO_COLOR) taken[color[neighbour]] = true;
+            size_t c = restricted[node] ? first_allowed : 0;
+            while(c < k && taken[c]) c++;
+            if(c == k) failed.push_back(node);
+            else color[node] = c;
+        }
+
+        if(failed.empty()) {
+            for(size_t i : order) {
+                intervals[i].reg = colors[color[find(i)]];
+                intervals[i].assigned = true;
+            }
+            std::vector<cc_iter> coalesced;
+            for(const register_move &move : moves)
+                if(move.from != n && move.to != n && intervals[move.from].reg == intervals[move.to].reg)
+                    coalesced.push_back(move.iter);
+            return coalesced;
+        }
+
+        // Spill the failed nodes and start over with their uses. Uses of spilled variables only fail next to other
+        // live values, so those are spilled in their place.
+        std::vector<bool> spill(n, false);
+        for(size_t node : failed) {
+            spill[node] = true;
+            if(!splittable[node])
+                for(size_t neighbour : adj[node]) spill[neighbour] = true;
+        }
+        IntervalQueue unused;
+        bool progress = false;
+        for(size_t i : order) {
+            if(!spill[find(i)] || intervals[i].use) continue;
+            DEBUG_PRINT("Spilling ID " << intervals[i].first->varID);
+            splitInterval(intervals, i, 0, unused, spans);
+            progress = true;
+        }
+        if(!progress)
+            throw OptimizeException::OutOfRegisters();
+    }
+}
@@ -1,22 +1,48 @@
 #pragma once
 
 #include "compiler.h"
+#include "linker.h"
 
+#include <deque>
+#include <initializer_list>
 #include <limits>
+#include <map>
 #include <set>
 #include <stack>
+#include <tuple>
 #include <unordered_set>
 
 
 #define SWM_OPT_LABEL_LOOP_BEGIN            "LoopBegin"
 #define SWM_OPT_LABEL_LOOP_CHECK            "LoopCondition"
 #define SWM_OPT_LABEL_LOOP_END              "LoopEnd"
+#define SWM_OPT_LABEL_LOOP_SAFE             "LoopSafe"
+#define SWM_OPT_LABEL_LOOP_DONE             "LoopDone"
 
 #define SWM_OPT_LABEL_CONDITIONAL_IF        "ConditionalIf"
 #define SWM_OPT_LABEL_CONDITIONAL_ELSE      "ConditionalElse"
 #define SWM_OPT_LABEL_CONDITIONAL_END       "ConditionalEnd"
 
-#define OPT_LABEL_FUNCTION      "Function"
+#define SWM_OPT_LABEL_CONDITION_SKIP        "ConditionSkip"
+#define SWM_OPT_LABEL_CONDITION_TRUE        "ConditionTrue"
+#define SWM_OPT_LABEL_CONDITION_END         "ConditionEnd"
+
+#define SWM_OPT_LABEL_FUNCTION              "Function"
+#define SWM_OPT_LABEL_FUNCTION_RETURN       "FunctionReturn"
+#define SWM_OPT_LABEL_MAIN                  "Main"
+
+// Width of heap addresses in relocatable code; lets the linked heap grow up to 4GB
+#define SWM_OPT_RELOCATABLE_ADDRESS_WIDTH   BIT_32
+
+// Defaults for the unrolling settings left at 0
+#define SWM_OPT_UNROLL_FACTOR               4
+#define SWM_OPT_UNROLL_BUDGET               64
+
+// Most overlap checks between a loop's stores and loads worth versioning it for
+#define SWM_OPT_VERSION_CHECKS              4
+
+// Registers a call needs besides the ones passing the arguments, to hold the values live across it
+#define SWM_OPT_CALL_REGISTERS              1
 
 
 enum ArithmeticOperatorDouble {
@@ -24,13 +50,32 @@ enum ArithmeticOperatorDouble {
     SUBTRACTION,
     MULTIPLICATION,
     DIVISION,
-    MODULUS
+    MODULUS,
+    BITWISE_AND,
+    BITWISE_OR,
+    BITWISE_XOR,
+    SHIFT_LEFT,
+    SHIFT_RIGHT, // Arithmetic, as on signed values
+    SHIFT_RIGHT_LOGICAL
 };
 enum ArithmeticOperatorSingle {
     POSITIVE, // Usually a Positive Unary operation is NOOP
     NEGATIVE,
     INCREMENT,
-    DECREMENT
+    DECREMENT,
+    BITWISE_NOT
+};
+enum ComparisonOperator {
+    LESS,
+    LESS_EQUAL,
+    EQUAL,
+    NOT_EQUAL,
+    GREATER,
+    GREATER_EQUAL
+};
+enum LogicalOperator {
+    LOGICAL_AND,
+    LOGICAL_OR
 };
 enum FlowControl {
     BREAK,
@@ -46,6 +91,12 @@ namespace std {
             case MULTIPLICATION: return "*";
             case DIVISION: return "/";
             case MODULUS: return "%";
+            case BITWISE_AND: return "&";
+            case BITWISE_OR: return "|";
+            case BITWISE_XOR: return "^";
+            case SHIFT_LEFT: return "<<";
+            case SHIFT_RIGHT: return ">>";
+            case SHIFT_RIGHT_LOGICAL: return ">>>";
             default: return "(?)";
         }
     }
@@ -55,6 +106,25 @@ namespace std {
             case NEGATIVE: return "-";
             case INCREMENT: return "++";
             case DECREMENT: return "--";
+            case BITWISE_NOT: return "~";
+            default: return "(?)";
+        }
+    }
+    inline std::string to_string(ComparisonOperator op) {
+        switch(op) {
+            case LESS: return "<";
+            case LESS_EQUAL: return "<=";
+            case EQUAL: return "==";
+            case NOT_EQUAL: return "!=";
+            case GREATER: return ">";
+            case GREATER_EQUAL: return ">=";
+            default: return "(?)";
+        }
+    }
+    inline std::string to_string(LogicalOperator op) {
+        switch(op) {
+            case LOGICAL_AND: return "&&";
+            case LOGICAL_OR: return "||";
             default: return "(?)";
         }
     }
@@ -77,7 +147,9 @@ public:
         OUT_OF_REGISTERS,
         UNKNOWN_COMMAND,
         INVALID_OPERATION,
-        MISSING_EXPRESSION
+        MISSING_EXPRESSION,
+        FUNCTION_NOT_FOUND,
+        ARGUMENT_COUNT
     };
 
     Type type() { return _type; }
@@ -99,7 +171,7 @@ public:
 
     static OptimizeException OutOfRegisters() {
         return OptimizeException(OUT_OF_REGISTERS,
-                                 "Ran out of available registers when filling out register values");
+                                 "A single command uses more registers than are available, even with spilling");
     }
 
     static OptimizeException UnknownCommand() {
@@ -117,6 +189,35 @@ public:
                                  "No Expression set for the Statement of type '" + statement + "'");
     }
 
+    static OptimizeException FunctionNotFound(size_t id) {
+        return OptimizeException(FUNCTION_NOT_FOUND,
+                                 "The Function with ID '" + std::to_string(id) + "' has not been defined");
+    }
+
+    static OptimizeException ArgumentCount(size_t id, size_t expected, size_t given) {
+        return OptimizeException(ARGUMENT_COUNT,
+                                 "The Function with ID '" + std::to_string(id) + "' takes " + std::to_string(expected) +
+                                 " Arguments, but was called with " + std::to_string(given));
+    }
+
+    static OptimizeException NestedFunction(size_t id) {
+        return OptimizeException(SCOPE_CONTROL,
+                                 "The Function with ID '" + std::to_string(id) + "' is not defined at the top level");
+    }
+
+    static OptimizeException OutsideVariable(size_t function, size_t variable) {
+        return OptimizeException(SCOPE_CONTROL,
+                                 "The Function with ID '" + std::to_string(function) + "' uses the Variable with ID '" +
+                                 std::to_string(variable) + "', which is neither one of its Parameters nor defined before in its Body");
+    }
+
+    static OptimizeException ArgumentRegisters(size_t count, size_t required, vbyte registers) {
+        return OptimizeException(OUT_OF_REGISTERS,
+                                 "Passing " + std::to_string(count) + " Arguments takes at least " +
+                                 std::to_string(required) + " Registers, but only " + std::to_string(registers) +
+                                 " are available");
+    }
+
 protected:
     OptimizeException(Type type, const std::string &msg) : _type(type), runtime_error(msg) {}
     Type _type;
@@ -132,8 +233,11 @@ public:
     };
 protected:
     std::unordered_map<size_t, mem_spot> _data;
-    size_t _next = 0;
+    size_t _next;
 public:
+    // Spots are handed out from begin up
+    mem_map(size_t begin = 0) : _next(begin) {}
+
     mem_spot create(size_t varID, BitWidth width) {
         mem_spot val{ _next, varID, width };
         _next += width;
@@ -155,10 +259,32 @@ public:
 };
 
 
+enum RegisterAllocator {
+    ALLOCATOR_LINEAR_SCAN,      // Allocates in a single pass over the live intervals
+    ALLOCATOR_GRAPH_COLORING    // Slower, but shares registers more tightly and removes register copies
+};
+
+// Passes run by compileOptimizeList; unrolling and folding work on the AST, numbering, invariant motion, strength
+// reduction and loop versioning during lowering and the memory traffic pass on the allocated commands
+enum OptimizerPass {
+    PASS_CONSTANT_FOLDING   = 1 << 0,
+    PASS_VALUE_NUMBERING    = 1 << 1,
+    PASS_MEMORY_TRAFFIC     = 1 << 2,
+    PASS_LOOP_INVARIANTS    = 1 << 3,
+    PASS_STRENGTH_REDUCTION = 1 << 4,
+    PASS_LOOP_UNROLLING     = 1 << 5,
+    PASS_LOOP_VERSIONING    = 1 << 6
+};
+
 struct optimizer_settings {
     BitWidth program_width;
     vbyte max_register_count;
     label_map labels;
+    bool relocatable; // Encode heap addresses at a fixed width so the linker can move them
+    RegisterAllocator allocator;
+    unsigned disabled_passes; // OptimizerPass flags of the passes to skip
+    size_t unroll_factor; // Copies of a counted loop's body per iteration, 0 for SWM_OPT_UNROLL_FACTOR
+    size_t unroll_budget; // Statements a loop may grow to by unrolling, 0 for SWM_OPT_UNROLL_BUDGET
 };
 
 
@@ -169,7 +295,41 @@ public:
     size_t getID() { return _nextID++; }
 };
 
+// Structural hashing of the AST; stable across processes, so it can also key persistent caches
+enum AstHashTag {
+    HASH_NONE,
+    HASH_VARIABLE,
+    HASH_CONSTANT,
+    HASH_ARITHMETIC_DOUBLE,
+    HASH_ARITHMETIC_SINGLE,
+    HASH_ALLOC,
+    HASH_LOAD,
+    HASH_ASSIGNMENT,
+    HASH_EXPRESSION,
+    HASH_STORE,
+    HASH_FREE,
+    HASH_FLOW_CONTROL,
+    HASH_LOOP,
+    HASH_CONDITIONAL,
+    HASH_COMPARISON,
+    HASH_LOGICAL,
+    HASH_FUNCTION,
+    HASH_CALL
+};
+
+inline uint64_t hashCombine(uint64_t seed, uint64_t value) {
+    uint64_t x = seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Variables with a value known at compile time; used by the constant folding pass
+typedef std::unordered_map<size_t, int64_t> constant_map;
+
 struct abstract_expression;
+struct exp_load;
+struct stmt_store;
 typedef abstract_expression* ae_ptr;
 /*struct std::hash<ae_ptr> {
     size_t operator()(const ae_ptr &expr) const {
@@ -185,14 +345,18 @@ struct reg_alloc {
     bool defined;
     vbyte* reg_ptr;
     cc_iter iter;
-    reg_alloc(reg_alloc* prev, reg_alloc* next, size_t index_hint, size_t varID, bool defined, vbyte* reg_ptr, const cc_iter &iter)
-            : prev(prev), next(next), index_hint(index_hint), varID(varID), defined(defined), reg_ptr(reg_ptr), iter(iter) {}
+    bool read;      // The command reads the variable through reg_ptr
+    bool written;   // The command writes the variable through reg_ptr
+    reg_alloc(reg_alloc* prev, reg_alloc* next, size_t index_hint, size_t varID, bool defined, vbyte* reg_ptr, const cc_iter &iter,
+              bool read, bool written)
+            : prev(prev), next(next), index_hint(index_hint), varID(varID), defined(defined), reg_ptr(reg_ptr), iter(iter),
+              read(read), written(written) {}
 };
 
-// Assumes non-nullptr
+// Assumes non-nullptr; variables first used at the same index are told apart by their ID
 struct ra_cmp {
     bool operator()(reg_alloc* const& lhs, reg_alloc* const& rhs) const
-    { return lhs->index_hint < rhs->index_hint; }
+    { return lhs->index_hint < rhs->index_hint || (lhs->index_hint == rhs->index_hint && lhs->varID < rhs->varID); }
 };
 
 struct scope_struct {
@@ -203,7 +367,39 @@ protected:
     std::unordered_map<size_t, reg_alloc*> _last_pos_cache;
     std::set<reg_alloc*, ra_cmp> _begin_cache;
 
-    std::stack<std::set<size_t>> _loop_cache;
+    std::stack<std::set<size_t>> _block_cache;
+
+public:
+    // Operation and operands of a computed value; operands are IDs, or values for constants
+    typedef std::tuple<uint64_t, uint64_t, uint64_t> ValueKey;
+
+protected:
+    struct value_entry {
+        size_t id;
+        bool temporary; // Only temporaries are never written again, so only they may be read later
+    };
+    std::map<ValueKey, value_entry> _values;
+    std::unordered_multimap<size_t, ValueKey> _value_users; // ID -> keys it is an operand or the holder of
+    std::vector<std::vector<ValueKey>> _value_scopes;
+
+    // Loop invariant expressions computed ahead of the loops they are in -> ID holding the value
+    std::unordered_map<const abstract_expression*, size_t> _invariants;
+
+public:
+    // Where a function starts, how many arguments it takes and how many registers from 0 up a call may overwrite
+    struct function_entry {
+        label_id label;
+        size_t param_count;
+        vbyte argument_registers;
+    };
+
+    // Ranges of index hints over which a call or the entry of a function overwrites the argument registers,
+    // begin -> end; they never overlap
+    typedef std::map<size_t, size_t> CallSpans;
+
+protected:
+    std::unordered_map<size_t, function_entry> _functions;
+    CallSpans _call_spans;
 
     scope_struct(scope_struct* const parent) : _parent(parent) {}
 
@@ -211,8 +407,9 @@ public:
     //scope_struct &_parent;
     scope_struct* const _parent;
 
-    std::string _label_break = "";
-    std::string _label_continue = "";
+    label_id _label_break = SWM_LABEL_NONE;
+    label_id _label_continue = SWM_LABEL_NONE;
+    label_id _label_return = SWM_LABEL_NONE;
 
     virtual ~scope_struct() {
         for(reg_alloc* entry : _begin_cache) {
@@ -231,6 +428,9 @@ public:
 
         DEBUG_PRINT("Adding Register Entry for ID " << std::to_string(varID) << " and Index Hint " << std::to_string(index_hint))
 
+        bool read = reg_ptr != nullptr && (*iter)->readsField(reg_ptr);
+        bool written = reg_ptr != nullptr && (*iter)->writesField(reg_ptr);
+
         // Previous Entry Exists
         if(cpos != nullptr) {
 
@@ -243,7 +443,7 @@ public:
                     if(cpos == nullptr) break;
                     if(index_hint >= cpos->index_hint) break;
                 }
-                npos = new reg_alloc( cpos, last, index_hint, varID, defined, reg_ptr, iter );
+                npos = new reg_alloc( cpos, last, index_hint, varID, defined, reg_ptr, iter, read, written );
                 if(cpos != nullptr) cpos->next = npos;
                 last->prev = npos;
             }
@@ -256,7 +456,7 @@ public:
                     if(cpos == nullptr) break;
                     if(index_hint <= cpos->index_hint) break;
                 }
-                npos = new reg_alloc( last, cpos, index_hint, varID, defined, reg_ptr, iter );
+                npos = new reg_alloc( last, cpos, index_hint, varID, defined, reg_ptr, iter, read, written );
                 if(cpos != nullptr) cpos->prev = npos;
                 last->next = npos;
             }
@@ -270,134 +470,315 @@ public:
         }
         // No Previous Entry, create one
         else {
-            npos = new reg_alloc( nullptr, nullptr, index_hint, varID, defined, reg_ptr, iter );
+            npos = new reg_alloc( nullptr, nullptr, index_hint, varID, defined, reg_ptr, iter, read, written );
             _begin_cache.insert( npos );
         }
         // Update last_pos_cache
         _last_pos_cache[varID] = npos;
 
-        // Add to Loop Cache if necessary
-        if(!_loop_cache.empty())
-            _loop_cache.top().insert(varID);
+        // Add to Block Cache if necessary
+        if(!_block_cache.empty())
+            _block_cache.top().insert(varID);
+
+        if(written) killValues(varID);
+    }
+
+    // Returns the ID already holding the value, if any. A value held by a variable can only be copied right away,
+    // as the variable may change before a later read.
+    bool findValue(const ValueKey &key, size_t &id, bool temporary_only) const {
+        std::map<ValueKey, value_entry>::const_iterator it = _values.find(key);
+        if(it == _values.end() || (temporary_only && !it->second.temporary)) return false;
+        id = it->second.id;
+        return true;
+    }
+
+    // Records the value until one of the operands or the holder is written, or the current value scope ends
+    void addValue(const ValueKey &key, size_t id, bool temporary, std::initializer_list<size_t> operands) {
+        for(size_t operand : operands)
+            if(operand == id) return;
+        std::map<ValueKey, value_entry>::iterator it = _values.find(key);
+        if(it != _values.end() && (it->second.temporary || !temporary)) return;
+        _values[key] = { id, temporary };
+        for(size_t operand : operands)
+            _value_users.insert({ operand, key });
+        _value_users.insert({ id, key });
+        if(!_value_scopes.empty()) _value_scopes.back().push_back(key);
     }
 
-    void pushLoopCache() { _loop_cache.push(std::set<size_t>()); }
+    // Invariants are computed once before the loop starts and only read within it, until the loop removes them again
+    bool findInvariant(const abstract_expression* expr, size_t &id) const {
+        std::unordered_map<const abstract_expression*, size_t>::const_iterator it = _invariants.find(expr);
+        if(it == _invariants.end()) return false;
+        id = it->second;
+        return true;
+    }
+    void addInvariant(const abstract_expression* expr, size_t id) { _invariants[expr] = id; }
+    void removeInvariant(const abstract_expression* expr) { _invariants.erase(expr); }
+
+    // Functions are defined for the whole list of statements, so enclosing scopes are searched too
+    bool findFunction(size_t id, function_entry &entry) const {
+        std::unordered_map<size_t, function_entry>::const_iterator it = _functions.find(id);
+        if(it != _functions.end()) {
+            entry = it->second;
+            return true;
+        }
+        return _parent != nullptr && _parent->findFunction(id, entry);
+    }
+    void addFunction(size_t id, const function_entry &entry) { _functions[id] = entry; }
+
+    // Values live anywhere in [begin, end] are kept out of the argument registers
+    void addCallSpan(size_t begin, size_t end) { _call_spans[begin] = end; }
+
+    // Throws if the variable can't be named here; only function bodies restrict this
+    virtual void checkVariable(size_t varID, const mem_map &mem) const {}
+
+    // Returns a temporary holding the constant, which is only loaded if none holds it yet when values are numbered
+    size_t loadConstant(cc_list &output, id_map &ids, int64_t value, bool numbered) {
+        ValueKey key = std::make_tuple((uint64_t)HASH_CONSTANT << 16, (uint64_t)value, 0);
+        size_t id;
+        if(numbered && findValue(key, id, true)) {
+            DEBUG_PRINT("Reusing Constant of ID " << id);
+            return id;
+        }
+        id = ids.getID();
+        cc_load_constant* cmd = output.emplace_back<cc_load_constant>(0, value, VariableValue::minimalWidth(value));
+        addRegisterEntry(&cmd->_target_register, output.size()-1, id, std::prev(output.end()));
+        if(numbered) addValue(key, id, true, {});
+        return id;
+    }
+
+    void copyRegister(cc_list &output, size_t from, size_t to) {
+        cc_copy_register* cmd = output.emplace_back<cc_copy_register>(0, 0);
+        cc_iter it = std::prev(output.end());
+        addRegisterEntry(&cmd->_from_register, output.size()-1, from, it);
+        addRegisterEntry(&cmd->_to_register,   output.size()-1, to,   it);
+    }
+
+    void killValues(size_t id) {
+        typedef std::unordered_multimap<size_t, ValueKey>::const_iterator UserIter;
+        std::pair<UserIter, UserIter> range = _value_users.equal_range(id);
+        for(UserIter it = range.first; it != range.second; ++it)
+            _values.erase(it->second);
+        _value_users.erase(id);
+    }
+
+    // Values computed within a scope don't reach past it, as the code may not have run
+    void pushValueScope() { _value_scopes.emplace_back(); }
+
+    void popValueScope() {
+        for(const ValueKey &key : _value_scopes.back())
+            _values.erase(key);
+        _value_scopes.pop_back();
+    }
 
-    void popLoopCache(size_t index_hint, cc_iter iter) {
-        if(!_loop_cache.empty()) {
-            std::set<size_t> &ids = _loop_cache.top();
-            for (size_t id : ids)
-                addRegisterEntry(nullptr, index_hint, id, iter);
-            _loop_cache.pop();
+    // Loops and conditionals collect the variables used within them
+    void pushBlockCache() { _block_cache.push(std::set<size_t>()); }
+
+    // Keeps every variable used in the block in its register from begin to end, so it is loaded before the first
+    // branch and stored after all paths join again rather than on whichever path happens to come last. Temporaries
+    // are only extended to the end, which loops need for values reused across iterations.
+    void popBlockCache(const mem_map &mem, size_t begin_hint, cc_iter begin, size_t end_hint, cc_iter end, bool temporaries) {
+        if(!_block_cache.empty()) {
+            std::set<size_t> ids;
+            ids.swap(_block_cache.top());
+            _block_cache.pop();
+            for(size_t id : ids) {
+                bool variable = mem.exists(id);
+                if(variable) addRegisterEntry(nullptr, begin_hint, id, begin);
+                if(variable || temporaries) addRegisterEntry(nullptr, end_hint, id, end);
+                // An enclosing loop still has to keep temporaries the block used
+                else if(!_block_cache.empty()) _block_cache.top().insert(id);
+            }
         }
     }
 
+    static BitWidth addressWidth(const optimizer_settings &settings, size_t address) {
+        return settings.relocatable ? SWM_OPT_RELOCATABLE_ADDRESS_WIDTH : VariableValue::minimalWidthUnsigned(address);
+    }
+
 private:
-    struct UsedRegSpan {
-        UsedRegSpan* prev;
-        UsedRegSpan* next;
+
+    struct live_interval {
+        reg_alloc* first;
+        reg_alloc* last;
         size_t begin;
         size_t end;
-        UsedRegSpan(UsedRegSpan* prev, UsedRegSpan* next, size_t begin, size_t end)
-                : prev(prev), next(next), begin(begin), end(end) {}
+        bool use;       // A single command's use of a spilled variable, which is reloaded and stored around it
+        bool split;     // Spilled and replaced by its uses
+        bool assigned;
+        vbyte reg;
+        bool call;      // Live during a call span, so it can't hold an argument register
     };
 
-public:
-    void calculateRegisters(cc_list &cmds, optimizer_settings &settings, mem_map &mem, const std::unordered_set<vbyte> &reserved_registers) {
+    static bool crossesCall(const CallSpans &spans, size_t begin, size_t end) {
+        // The spans don't overlap, so only the last one starting up to end can reach back to begin
+        CallSpans::const_iterator it = spans.upper_bound(end);
+        return it != spans.begin() && std::prev(it)->second >= begin;
+    }
 
-        UsedRegSpan* used_regs[settings.max_register_count] = { nullptr };
+    typedef std::set<std::pair<size_t, size_t>> IntervalQueue; // Position -> index into the interval list
+
+    // Replaces a spilled interval by one interval per command using the variable. Uses before split_index keep the
+    // register the interval held up to there, the others are queued for allocation.
+    static void splitInterval(std::deque<live_interval> &intervals, size_t index, size_t split_index, IntervalQueue &pending,
+                              const CallSpans &spans) {
+        intervals[index].split = true;
+        reg_alloc* current = intervals[index].first;
+        while(current != nullptr) {
+            reg_alloc* last = current;
+            bool used = current->reg_ptr != nullptr;
+            while(last->next != nullptr && last->next->index_hint == current->index_hint) {
+                last = last->next;
+                used |= last->reg_ptr != nullptr;
+            }
 
-        // Iterate through all
-        for(reg_alloc* ra : _begin_cache) {
+            // Loop markers alone don't need a register, the value is kept in memory anyway
+            if(used) {
+                live_interval use{ current, last, current->index_hint, current->index_hint, true, false, false, 0,
+                                   crossesCall(spans, current->index_hint, current->index_hint) };
+                if(intervals[index].assigned && use.begin < split_index) {
+                    use.assigned = true;
+                    use.reg = intervals[index].reg;
+                    intervals.push_back(use);
+                } else {
+                    intervals.push_back(use);
+                    pending.insert({ use.begin, intervals.size() - 1 });
+                }
+            }
+            current = last->next;
+        }
+    }
 
-            reg_alloc* current = ra;
-            reg_alloc* last = ra;
-            while(current != nullptr) {
-                last = current;
-                current = current->next;
+    // Linear scan over the variables' live intervals in order of their first use. A register becomes free again
+    // once the interval holding it has ended strictly before the next one begins. If no register is free, the
+    // interval reaching furthest is spilled to memory and reloaded around each of its uses. Intervals live during a
+    // call span only take registers from argument_registers up.
+    static void scanRegisters(std::deque<live_interval> &intervals, const std::set<vbyte> &available, const CallSpans &spans,
+                              vbyte argument_registers) {
+
+        std::set<vbyte> free_regs = available;
+
+        IntervalQueue pending;
+        for(size_t i = 0; i < intervals.size(); i++)
+            pending.insert({ intervals[i].begin, i });
+
+        // Intervals holding a register, ordered by their end
+        IntervalQueue active;
+
+        while(!pending.empty()) {
+            size_t index = pending.begin()->second;
+            pending.erase(pending.begin());
+            live_interval &interval = intervals[index];
+            vbyte lowest = interval.call ? argument_registers : 0;
+
+            // Release the registers of all intervals that have ended
+            while(!active.empty() && active.begin()->first < interval.begin) {
+                free_regs.insert(intervals[active.begin()->second].reg);
+                active.erase(active.begin());
             }
 
-            size_t begin = ra->index_hint;
-            size_t end = last->index_hint;
+            if(free_regs.lower_bound(lowest) == free_regs.end()) {
+                // Uses of spilled variables can't be spilled again, and only a register the interval may take helps
+                IntervalQueue::reverse_iterator victim = active.rbegin();
+                while(victim != active.rend() && (intervals[victim->second].use || intervals[victim->second].reg < lowest)) victim++;
 
-            // Find register with unused space matching the required usage space
-            vbyte reg = settings.max_register_count;
-            for(vbyte i = 0; i < settings.max_register_count; i++) {
-                if(reserved_registers.count(i)) continue;
+                if(victim == active.rend() && interval.use)
+                    throw OptimizeException::OutOfRegisters();
 
-                UsedRegSpan* c = used_regs[i];
-                if(c == nullptr) {
-                    // This register isn't used at all, so there is nothing but empty space
-                    used_regs[i] = new UsedRegSpan( nullptr, nullptr, begin, end );
-                    reg = i;
-                    break;
-                } else {
-                    size_t last_index = 0;
-                    UsedRegSpan* l = c;
-                    while(c != nullptr) {
-                        // Found empty space either in the beginning or in the middle
-                        if( ((begin > last_index) || (c->prev == nullptr)) && end < c->begin ) {
-                            UsedRegSpan* n = new UsedRegSpan( c->prev, c, begin, end );
-                            c->prev = n;
-                            if(c->prev == nullptr) used_regs[i] = n;
-                            else c->prev->next = n;
-                            reg = i;
-                            break;
-                        }
-                        last_index = c->end;
-                        l = c;
-                        c = c->next;
-                    }
-                    // Found empty space at the end
-                    if(begin > last_index) {
-                        UsedRegSpan* n = new UsedRegSpan( l, nullptr, begin, end );
-                        l->next = n;
-                        reg = i;
-                        break;
-                    }
+                if(!interval.use && (victim == active.rend() || victim->first <= interval.end)) {
+                    DEBUG_PRINT("Spilling ID " << interval.first->varID);
+                    splitInterval(intervals, index, interval.begin, pending, spans);
+                    continue;
                 }
+
+                size_t victim_index = victim->second;
+                DEBUG_PRINT("Spilling ID " << intervals[victim_index].first->varID);
+                active.erase(std::next(victim).base());
+                free_regs.insert(intervals[victim_index].reg);
+                splitInterval(intervals, victim_index, interval.begin, pending, spans);
             }
 
-            // For now, throw exception if out of registers
-            // TODO: Determine and store a used register temporarily in order to enable more register usage
-            if(reg == settings.max_register_count)
-                throw OptimizeException::OutOfRegisters();
+            // Prefer the lowest free register
+            live_interval &assigned = intervals[index];
+            std::set<vbyte>::iterator reg = free_regs.lower_bound(lowest);
+            assigned.reg = *reg;
+            assigned.assigned = true;
+            free_regs.erase(reg);
+            active.insert({ assigned.end, index });
+        }
+    }
 
-            // Add a Load Cmd if needed
-            if(mem.exists(ra->varID) && !ra->defined) {
-                const mem_map::mem_spot spot = mem.get(ra->varID);
-                compiler_command* cc = new cc_move_to_register_constant(reg, spot.index, settings.program_width, spot.width);
-                cmds.insert(ra->iter, cc);
-            }
+    // Chaitin/Briggs graph coloring with conservative coalescing of CPREG operands; defined in optimizer.cpp.
+    // Returns the copies whose operands ended up in the same register.
+    static std::vector<cc_iter> colorRegisters(std::deque<live_interval> &intervals, const std::set<vbyte> &available, const mem_map &mem,
+                                               const CallSpans &spans, vbyte argument_registers);
+
+    // Writes the assigned registers into the commands and adds the loads and stores of variables kept in memory
+    static void emitRegisters(cc_list &cmds, optimizer_settings &settings, mem_map &mem, std::deque<live_interval> &intervals) {
+        for(live_interval &interval : intervals) {
+            if(interval.split) continue;
+
+            vbyte reg = interval.reg;
+            size_t varID = interval.first->varID;
+            bool read = false;
+            bool written = false;
 
             // Set all the register values
-            current = ra;
-            last = ra;
-            while(current != nullptr) {
+            reg_alloc* current = interval.first;
+            while(true) {
                 if(current->reg_ptr != nullptr) *(current->reg_ptr) = reg;
-                last = current;
+                read |= current->read;
+                written |= current->written;
+                if(current == interval.last) break;
                 current = current->next;
             }
 
+            if(interval.use) {
+                // Spilled variables live in their memory spot, temporaries get one on their first spill
+                const mem_map::mem_spot spot = mem.exists(varID) ? mem.get(varID) : mem.create(varID, settings.program_width);
+                if(read)
+                    cmds.emplace<cc_move_to_register_constant>(interval.first->iter, reg, spot.index, addressWidth(settings, spot.index), spot.width);
+                if(written)
+                    cmds.emplace<cc_move_to_memory_constant>(std::next(interval.last->iter), reg, spot.index, addressWidth(settings, spot.index), spot.width);
+                continue;
+            }
+
+            // Add a Load Cmd if needed
+            if(mem.exists(varID) && !interval.first->defined) {
+                const mem_map::mem_spot spot = mem.get(varID);
+                cmds.emplace<cc_move_to_register_constant>(interval.first->iter, reg, spot.index, addressWidth(settings, spot.index), spot.width);
+            }
+
             // Add a Store Cmd if needed
-            if(mem.exists(ra->varID)) {
-                const mem_map::mem_spot spot = mem.get(ra->varID);
-                compiler_command* cc = new cc_move_to_memory_constant(reg, spot.index, settings.program_width, spot.width);
-                cc_iter i = last->iter;
-                i++;
-                cmds.insert(i, cc);
+            if(mem.exists(varID)) {
+                const mem_map::mem_spot spot = mem.get(varID);
+                cmds.emplace<cc_move_to_memory_constant>(std::next(interval.last->iter), reg, spot.index, addressWidth(settings, spot.index), spot.width);
             }
+        }
+    }
 
+public:
+    void calculateRegisters(cc_list &cmds, optimizer_settings &settings, mem_map &mem, vbyte argument_registers) {
+
+        std::set<vbyte> available;
+        for(vbyte i = 0; i < settings.max_register_count; i++) available.insert(i);
+
+        // Intervals are only added at the back, so indices stay valid
+        std::deque<live_interval> intervals;
+        for(reg_alloc* ra : _begin_cache) {
+            reg_alloc* last = ra;
+            while(last->next != nullptr) last = last->next;
+            intervals.push_back({ ra, last, ra->index_hint, last->index_hint, false, false, false, 0,
+                                  crossesCall(_call_spans, ra->index_hint, last->index_hint) });
         }
 
-        // Delete Heap Created Data
-        for(vbyte i = 0; i < settings.max_register_count; i++) {
-            UsedRegSpan* c = used_regs[i];
-            while(c != nullptr) {
-                UsedRegSpan* n = c->next;
-                delete c;
-                c = n;
-            }
+        if(settings.allocator == ALLOCATOR_GRAPH_COLORING) {
+            std::vector<cc_iter> coalesced = colorRegisters(intervals, available, mem, _call_spans, argument_registers);
+            emitRegisters(cmds, settings, mem, intervals);
+            for(cc_iter &it : coalesced) cmds.erase(it);
+        } else {
+            scanRegisters(intervals, available, _call_spans, argument_registers);
+            emitRegisters(cmds, settings, mem, intervals);
         }
     }
 
@@ -407,8 +788,14 @@ struct scope_global : public scope_struct {
     scope_global() : scope_struct(nullptr) {}
 };
 
+// A body only has its own heap spots, so it can't name the caller's variables; the caller may hold them in registers
+// and would never see the body's writes
 struct scope_function : public scope_struct {
-    scope_function(scope_struct &parent) : scope_struct(&parent) {}
+    const size_t _functionID;
+    scope_function(scope_struct &parent, size_t functionID) : scope_struct(&parent), _functionID(functionID) {}
+    virtual void checkVariable(size_t varID, const mem_map &mem) const {
+        if(!mem.exists(varID)) throw OptimizeException::OutsideVariable(_functionID, varID);
+    }
 };
 
 struct scope_loop : public scope_struct {
@@ -433,6 +820,103 @@ struct abstract_expression {
             pre += "  ";
         return pre + to_string();
     }
+    // Equal for structurally equal trees
+    virtual uint64_t hash() const = 0;
+    static uint64_t hash(const abstract_expression* expr) { return expr != nullptr ? expr->hash() : HASH_NONE; }
+    // Returns a new, identical tree; the caller owns it
+    virtual abstract_expression* clone() const = 0;
+    static abstract_expression* clone(const abstract_expression* expr) { return expr != nullptr ? expr->clone() : nullptr; }
+    // Returns a new tree with constant subtrees folded, known variables replaced by their values and identities
+    // removed; constants is updated with the effects the expression has on variables
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const = 0;
+    static abstract_expression* fold(const abstract_expression* expr, constant_map &constants, const optimizer_settings &settings) {
+        return expr != nullptr ? expr->fold(constants, settings) : nullptr;
+    }
+    // Whether evaluating the expression changes anything besides producing its value
+    virtual bool hasSideEffects() const { return false; }
+    // Adds the variables the expression changes
+    virtual void collectWrites(std::set<size_t> &writes) const {}
+    // Returns whether the value stays the same while none of writes change. Otherwise adds the largest parts of the
+    // expression that do and are worth computing only once.
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const { return false; }
+    static void collectInvariants(const abstract_expression* expr, const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) {
+        if(expr != nullptr && expr->collectInvariants(writes, invariants)) addInvariant(expr, invariants);
+    }
+    // Adds the loads made whenever the expression is evaluated. Returns whether the expression leaves memory alone.
+    virtual bool collectLoads(std::vector<const exp_load*> &loads) const { return true; }
+    // Variables and constants are left where they are used
+    static void addInvariant(const abstract_expression* expr, std::vector<const abstract_expression*> &invariants);
+    static bool moveInvariants(const optimizer_settings &settings) { return !(settings.disabled_passes & PASS_LOOP_INVARIANTS); }
+    // Jumps to label if the condition holds, or if it doesn't when jump_when is false. Values hold if they are above
+    // zero, which is tested against zero_id; the caller loads it with 0 before the first branch if branchesOnValue().
+    virtual void compileBranch(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids,
+                               label_id label, bool jump_when, size_t zero_id) const {
+        DEBUG_PRINT("Compiling Branch on Value");
+        size_t value = compile(output, scope_parent, settings, mem, ids);
+        if(jump_when) {
+            compileJump<cc_jump_less>(output, scope_parent, settings, label, zero_id, value);
+        } else {
+            // There is no jump on less or equal, so values that hold jump past the one to the label
+            label_id label_skip = settings.labels.create(SWM_OPT_LABEL_CONDITION_SKIP);
+            compileJump<cc_jump_less>(output, scope_parent, settings, label_skip, zero_id, value);
+            output.emplace_back<cc_jump>(settings.labels, label);
+            output.emplace_back<cc_label>(settings.labels, label_skip);
+        }
+    }
+    // Compiles the expression only for what it changes, as a statement whose value is unused
+    virtual void compileEffects(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        compile(output, scope_parent, settings, mem, ids);
+    }
+    // Whether compileBranch compares a value against zero_id
+    virtual bool branchesOnValue() const { return true; }
+    // Compiles the condition into resID as 1 if it holds and 0 otherwise
+    size_t compileCondition(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
+        // The branches only run in part, so variables used in them are loaded ahead like in conditionals
+        scope_parent.pushBlockCache();
+        cc_iter before = std::prev(output.end());
+        size_t begin_index = output.size();
+        size_t zeroConstID = 0;
+        if(branchesOnValue()) zeroConstID = scope_parent.loadConstant(output, ids, 0, numberValues(settings));
+
+        label_id label_true = settings.labels.create(SWM_OPT_LABEL_CONDITION_TRUE);
+        label_id label_end = settings.labels.create(SWM_OPT_LABEL_CONDITION_END);
+        compileBranch(output, scope_parent, settings, mem, ids, label_true, true, zeroConstID);
+        cc_iter begin_it = std::next(before);
+
+        const int64_t values[] = { 0, 1 };
+        for(int64_t value : values) {
+            if(value == 1) output.emplace_back<cc_label>(settings.labels, label_true);
+            cc_load_constant* cmd = output.emplace_back<cc_load_constant>(0, value, BIT_8);
+            scope_parent.addRegisterEntry(&cmd->_target_register, output.size()-1, resID, std::prev(output.end()));
+            if(value == 0) output.emplace_back<cc_jump>(settings.labels, label_end);
+        }
+        output.emplace_back<cc_label>(settings.labels, label_end);
+
+        scope_parent.popBlockCache(mem, begin_index, begin_it, output.size() - 1, --output.end(), false);
+        return resID;
+    }
+    template<typename T>
+    static void compileJump(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, label_id label, size_t a, size_t b) {
+        T* cmd = output.emplace_back<T>(settings.labels, label, 0, 0);
+        cc_iter it = std::prev(output.end());
+        scope_parent.addRegisterEntry(&cmd->_register_a, output.size() - 1, a, it);
+        scope_parent.addRegisterEntry(&cmd->_register_b, output.size() - 1, b, it);
+    }
+    // Uses the value computed ahead of the loop, if the expression has been moved out of it
+    static bool reuseInvariant(cc_list &output, scope_struct &scope_parent, const abstract_expression* expr, size_t &resID, bool fixed) {
+        size_t held;
+        if(!scope_parent.findInvariant(expr, held)) return false;
+        DEBUG_PRINT("Reusing Loop Invariant ID " << held);
+        if(fixed && held != resID) scope_parent.copyRegister(output, held, resID);
+        else resID = held;
+        return true;
+    }
+    static bool constantValue(const abstract_expression* expr, int64_t &value);
+    static bool numberValues(const optimizer_settings &settings) { return !(settings.disabled_passes & PASS_VALUE_NUMBERING); }
+    // Truncates to the program width the way the registers do
+    static int64_t wrap(uint64_t value, const optimizer_settings &settings) {
+        return VariableValue((int64_t)value, settings.program_width).get();
+    }
     virtual ~abstract_expression() {};
 };
 
@@ -442,15 +926,25 @@ struct exp_variable : public abstract_expression {
     exp_variable(size_t varID) : _varID(varID) {}
     virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
         DEBUG_PRINT("Compiling Variable Expression");
-        return _varID;
+        scope_parent.checkVariable(_varID, mem);
+        // Copy if the value is wanted somewhere else, as in assignments of one variable to another
+        if(resID != _varID) scope_parent.copyRegister(output, _varID, resID);
+        return resID;
     }
     virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
         DEBUG_PRINT("Compiling Variable Expression");
+        scope_parent.checkVariable(_varID, mem);
         return _varID;
     }
     virtual std::string to_string() const {
         return "{" + std::to_string(_varID) + "}";
     }
+    virtual uint64_t hash() const { return hashCombine(HASH_VARIABLE, _varID); }
+    virtual abstract_expression* clone() const { return new exp_variable(_varID); }
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const;
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        return !writes.count(_varID);
+    }
 };
 
 struct exp_constant : public abstract_expression {
@@ -458,16 +952,49 @@ struct exp_constant : public abstract_expression {
     exp_constant(int64_t value) : _value(value) {}
     virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
         DEBUG_PRINT("Compiling Constant Value Expression");
-        cc_load_constant* cmd = new cc_load_constant(0, _value, settings.program_width);
-        cc_iter it = output.insert(output.end(), &*cmd);
+        // Truncate to the program width first, then encode at the smallest width that sign extends back to it
+        int64_t value = VariableValue(_value, settings.program_width).get();
+        cc_load_constant* cmd = output.emplace_back<cc_load_constant>(0, value, VariableValue::minimalWidth(value));
+        cc_iter it = std::prev(output.end());
         scope_parent.addRegisterEntry(&cmd->_target_register, output.size()-1, resID, it);
         return resID;
     }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        // Comparisons in loops have their constant operands loaded ahead
+        size_t held;
+        if(reuseInvariant(output, scope_parent, this, held, false)) return held;
+        DEBUG_PRINT("Compiling Constant Value Expression");
+        return scope_parent.loadConstant(output, ids, VariableValue(_value, settings.program_width).get(), numberValues(settings));
+    }
     virtual std::string to_string() const {
         return std::to_string(_value);
     }
+    virtual uint64_t hash() const { return hashCombine(HASH_CONSTANT, (uint64_t)_value); }
+    virtual abstract_expression* clone() const { return new exp_constant(_value); }
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const {
+        return new exp_constant(wrap(_value, settings));
+    }
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const { return true; }
 };
 
+inline bool abstract_expression::constantValue(const abstract_expression* expr, int64_t &value) {
+    const exp_constant* constant = dynamic_cast<const exp_constant*>(expr);
+    if(constant == nullptr) return false;
+    value = constant->_value;
+    return true;
+}
+
+inline void abstract_expression::addInvariant(const abstract_expression* expr, std::vector<const abstract_expression*> &invariants) {
+    if(dynamic_cast<const exp_variable*>(expr) == nullptr && dynamic_cast<const exp_constant*>(expr) == nullptr)
+        invariants.push_back(expr);
+}
+
+inline abstract_expression* exp_variable::fold(constant_map &constants, const optimizer_settings &settings) const {
+    constant_map::const_iterator it = constants.find(_varID);
+    if(it != constants.end()) return new exp_constant(it->second);
+    return new exp_variable(_varID);
+}
+
 struct exp_arithmetic_double : public abstract_expression {
     const abstract_expression* _lhs;
     const abstract_expression* _rhs;
@@ -479,32 +1006,270 @@ struct exp_arithmetic_double : public abstract_expression {
         if(_rhs != nullptr) delete _rhs;
     }
     virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
+        return compileValue(output, scope_parent, settings, mem, ids, resID, true);
+    }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        return compileValue(output, scope_parent, settings, mem, ids, 0, false);
+    }
+    // Compiles into resID if fixed, otherwise into a new temporary or one already holding the value
+    size_t compileValue(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID, bool fixed) const {
         DEBUG_PRINT("Compiling Double Arithmetic Expression of Type " + std::to_string(_op));
+        if(reuseInvariant(output, scope_parent, this, resID, fixed)) return resID;
+        bool numbered = numberValues(settings);
+
+        // Constants are numbered by value, so they only need loading if the value isn't there yet
+        int64_t lhs_value = 0, rhs_value = 0;
+        bool lhs_constant = numbered && constantValue(_lhs, lhs_value);
+        bool rhs_constant = numbered && constantValue(_rhs, rhs_value);
+
+        // A power of two is never loaded; the operation is reduced to shifts and masks of the other operand
+        unsigned shift = 0;
+        bool reduce_lhs = false;
+        if(reduceStrength(settings) && (_op == MULTIPLICATION || _op == DIVISION || _op == MODULUS)) {
+            shift = powerOfTwo(_rhs, settings);
+            if(shift == 0 && _op == MULTIPLICATION) reduce_lhs = (shift = powerOfTwo(_lhs, settings)) != 0;
+        }
+        bool reduce_rhs = shift != 0 && !reduce_lhs;
+
         // Order matters; right to left
-        size_t ret_rhs = _rhs->compile(output, scope_parent, settings, mem, ids);
-        size_t ret_lhs = _lhs->compile(output, scope_parent, settings, mem, ids);
+        size_t ret_rhs = rhs_constant || reduce_rhs ? 0 : _rhs->compile(output, scope_parent, settings, mem, ids);
+        size_t ret_lhs = lhs_constant || reduce_lhs ? 0 : _lhs->compile(output, scope_parent, settings, mem, ids);
+
+        scope_struct::ValueKey key;
+        if(numbered) {
+            uint64_t a = lhs_constant ? (uint64_t)wrap(lhs_value, settings) : ret_lhs;
+            uint64_t b = rhs_constant ? (uint64_t)wrap(rhs_value, settings) : ret_rhs;
+            bool a_constant = lhs_constant, b_constant = rhs_constant;
+            if(commutative() && std::make_pair(a_constant, a) > std::make_pair(b_constant, b)) {
+                std::swap(a, b);
+                std::swap(a_constant, b_constant);
+            }
+            key = std::make_tuple(((uint64_t)HASH_ARITHMETIC_DOUBLE << 16) | ((uint64_t)_op << 8) | (a_constant << 1) | b_constant, a, b);
+
+            size_t held;
+            if(scope_parent.findValue(key, held, !fixed)) {
+                DEBUG_PRINT("Reusing Value of ID " << held);
+                if(!fixed || held == resID) return held;
+                scope_parent.copyRegister(output, held, resID);
+                return resID;
+            }
+
+            if(rhs_constant && !reduce_rhs) ret_rhs = _rhs->compile(output, scope_parent, settings, mem, ids);
+            if(lhs_constant && !reduce_lhs) ret_lhs = _lhs->compile(output, scope_parent, settings, mem, ids);
+        }
+        if(!fixed) resID = ids.getID();
+
+        if(shift != 0) {
+            size_t ret_operand = reduce_lhs ? ret_rhs : ret_lhs;
+            compileReduced(output, scope_parent, ret_operand, resID, shift, nonNegative(reduce_lhs ? _rhs : _lhs, settings));
+            if(numbered) scope_parent.addValue(key, resID, !fixed, { ret_operand });
+            return resID;
+        }
 
         cc_alu_double_operation* cmd = nullptr;
         switch(_op) {
-            case ADDITION:          cmd = new cc_alu_addition(0, 0, 0); break;
-            case SUBTRACTION:       cmd = new cc_alu_subtraction(0, 0, 0); break;
-            case MULTIPLICATION:    cmd = new cc_alu_multiplication(0, 0, 0); break;
-            case DIVISION:          cmd = new cc_alu_division(0, 0, 0); break;
-            case MODULUS:           cmd = new cc_alu_modulus(0, 0, 0); break;
+            case ADDITION:              cmd = output.emplace_back<cc_alu_addition>(0, 0, 0); break;
+            case SUBTRACTION:           cmd = output.emplace_back<cc_alu_subtraction>(0, 0, 0); break;
+            case MULTIPLICATION:        cmd = output.emplace_back<cc_alu_multiplication>(0, 0, 0); break;
+            case DIVISION:              cmd = output.emplace_back<cc_alu_division>(0, 0, 0); break;
+            case MODULUS:               cmd = output.emplace_back<cc_alu_modulus>(0, 0, 0); break;
+            case BITWISE_AND:           cmd = output.emplace_back<cc_alu_and>(0, 0, 0); break;
+            case BITWISE_OR:            cmd = output.emplace_back<cc_alu_or>(0, 0, 0); break;
+            case BITWISE_XOR:           cmd = output.emplace_back<cc_alu_xor>(0, 0, 0); break;
+            case SHIFT_LEFT:            cmd = output.emplace_back<cc_alu_shift_left>(0, 0, 0); break;
+            case SHIFT_RIGHT:           cmd = output.emplace_back<cc_alu_shift_arithmetic>(0, 0, 0); break;
+            case SHIFT_RIGHT_LOGICAL:   cmd = output.emplace_back<cc_alu_shift_right>(0, 0, 0); break;
             default: throw OptimizeException::UnknownCommand();
         }
 
-        cc_iter it = output.insert(output.end(), &*cmd);
+        cc_iter it = std::prev(output.end());
 
         scope_parent.addRegisterEntry(&cmd->_in_register_a, output.size()-1, ret_lhs, it);
         scope_parent.addRegisterEntry(&cmd->_in_register_b, output.size()-1, ret_rhs, it);
         scope_parent.addRegisterEntry(&cmd->_out_register,  output.size()-1, resID,  it);
 
+        if(numbered) scope_parent.addValue(key, resID, !fixed, { ret_lhs, ret_rhs });
+
         return resID;
     }
+    bool commutative() const {
+        return _op == ADDITION || _op == MULTIPLICATION || _op == BITWISE_AND || _op == BITWISE_OR || _op == BITWISE_XOR;
+    }
+    static bool reduceStrength(const optimizer_settings &settings) { return !(settings.disabled_passes & PASS_STRENGTH_REDUCTION); }
+    // Shift of a constant power of two above one, or 0 if the operand isn't one
+    static unsigned powerOfTwo(const abstract_expression* expr, const optimizer_settings &settings) {
+        int64_t value;
+        if(!constantValue(expr, value)) return 0;
+        value = wrap(value, settings);
+        if(value < 2 || (value & (value - 1)) != 0) return 0;
+        unsigned shift = 0;
+        while(value >>= 1) shift++;
+        return shift;
+    }
+    template<typename T>
+    static void compileConstOperation(cc_list &output, scope_struct &scope_parent, size_t inID, size_t outID, int64_t value) {
+        T* cmd = output.emplace_back<T>(0, 0, value, VariableValue::minimalWidth(value));
+        cc_iter it = std::prev(output.end());
+        scope_parent.addRegisterEntry(&cmd->_in_register,  output.size()-1, inID,  it);
+        scope_parent.addRegisterEntry(&cmd->_out_register, output.size()-1, outID, it);
+    }
+    // Whether the value can't be negative, as masked with a positive constant or shifted right logically
+    static bool nonNegative(const abstract_expression* expr, const optimizer_settings &settings) {
+        int64_t value;
+        if(constantValue(expr, value)) return wrap(value, settings) >= 0;
+        const exp_arithmetic_double* arith = dynamic_cast<const exp_arithmetic_double*>(expr);
+        if(arith == nullptr) return false;
+        switch(arith->_op) {
+            case BITWISE_AND:           return nonNegative(arith->_lhs, settings) || nonNegative(arith->_rhs, settings);
+            case SHIFT_RIGHT:
+            case MODULUS:               return nonNegative(arith->_lhs, settings);
+            case SHIFT_RIGHT_LOGICAL:   return constantValue(arith->_rhs, value) && VariableValue(value, settings.program_width).getu() != 0;
+            default: return false;
+        }
+    }
+    // Signed division and modulus round towards zero, which a shift or mask only matches on values that can't be
+    // negative. Biasing negative values first takes more commands than a single division in the VM, so otherwise
+    // only loading the divisor is saved.
+    void compileReduced(cc_list &output, scope_struct &scope_parent, size_t operand, size_t resID, unsigned shift, bool non_negative) const {
+        int64_t divisor = (int64_t)1 << shift;
+        switch(_op) {
+            case MULTIPLICATION: compileConstOperation<cc_alu_const_shift_left>(output, scope_parent, operand, resID, shift); break;
+            case DIVISION: {
+                if(non_negative) compileConstOperation<cc_alu_const_shift_arithmetic>(output, scope_parent, operand, resID, shift);
+                else compileConstOperation<cc_alu_const_division>(output, scope_parent, operand, resID, divisor);
+            } break;
+            case MODULUS: {
+                if(non_negative) compileConstOperation<cc_alu_const_and>(output, scope_parent, operand, resID, divisor - 1);
+                else compileConstOperation<cc_alu_const_modulus>(output, scope_parent, operand, resID, divisor);
+            } break;
+            default: throw OptimizeException::UnknownCommand();
+        }
+    }
     virtual std::string to_string() const {
         return "(" + _lhs->to_string() + " " + std::to_string(_op) + " " + _rhs->to_string() + ")";
     }
+    virtual uint64_t hash() const {
+        return hashCombine(hashCombine(hashCombine(HASH_ARITHMETIC_DOUBLE, _op), abstract_expression::hash(_lhs)), abstract_expression::hash(_rhs));
+    }
+    virtual abstract_expression* clone() const { return new exp_arithmetic_double(_lhs->clone(), _rhs->clone(), _op); }
+    // An operand simplified to a changed variable would be read when the operation runs rather than where it was
+    // computed, so it is copied to a temporary as before
+    static abstract_expression* keepRead(const abstract_expression* original, abstract_expression* folded, const std::set<size_t> &writes);
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const {
+        // Registers of variables are read when the operation runs, after the side effects of both operands, so
+        // variables changed within the expression are left to be read at runtime
+        std::set<size_t> writes;
+        collectWrites(writes);
+        for(size_t varID : writes) constants.erase(varID);
+
+        abstract_expression* rhs = keepRead(_rhs, _rhs->fold(constants, settings), writes);
+        abstract_expression* lhs = keepRead(_lhs, _lhs->fold(constants, settings), writes);
+
+        int64_t a, b;
+        bool const_a = constantValue(lhs, a);
+        bool const_b = constantValue(rhs, b);
+
+        // Both constant; division by zero and the overflowing division are left to fail at runtime
+        if(const_a && const_b) {
+            bool folded = true;
+            int64_t result = 0;
+            switch(_op) {
+                case ADDITION:          result = wrap((uint64_t)a + (uint64_t)b, settings); break;
+                case SUBTRACTION:       result = wrap((uint64_t)a - (uint64_t)b, settings); break;
+                case MULTIPLICATION:    result = wrap((uint64_t)a * (uint64_t)b, settings); break;
+                case DIVISION:
+                case MODULUS: {
+                    if(b == 0 || (a == std::numeric_limits<int64_t>::min() && b == -1)) folded = false;
+                    else result = wrap(_op == DIVISION ? a / b : a % b, settings);
+                } break;
+                case BITWISE_AND:           result = a & b; break;
+                case BITWISE_OR:            result = a | b; break;
+                case BITWISE_XOR:           result = a ^ b; break;
+                case SHIFT_LEFT:
+                case SHIFT_RIGHT:
+                case SHIFT_RIGHT_LOGICAL: {
+                    // The amount is unsigned, the logical shift takes the value unsigned at the program width
+                    uint64_t amount = VariableValue(b, settings.program_width).getu();
+                    if(_op == SHIFT_LEFT)       result = wrap(amount >= 64 ? 0 : (uint64_t)a << amount, settings);
+                    else if(_op == SHIFT_RIGHT) result = a >> (amount >= 64 ? 63 : amount);
+                    else result = wrap(amount >= 64 ? 0 : VariableValue(a, settings.program_width).getu() >> amount, settings);
+                } break;
+                default: folded = false; break;
+            }
+            if(folded) {
+                delete lhs;
+                delete rhs;
+                return new exp_constant(result);
+            }
+        }
+
+        // Identities; an operand may only be dropped if evaluating it does nothing else
+        abstract_expression* keep = nullptr;
+        abstract_expression* drop = nullptr;
+        switch(_op) {
+            case ADDITION: {
+                if(const_b && b == 0)       { keep = lhs; drop = rhs; }
+                else if(const_a && a == 0)  { keep = rhs; drop = lhs; }
+            } break;
+            case SUBTRACTION:
+            case DIVISION: {
+                if(const_b && b == (_op == SUBTRACTION ? 0 : 1)) { keep = lhs; drop = rhs; }
+            } break;
+            case MULTIPLICATION: {
+                if(const_b && b == 1)       { keep = lhs; drop = rhs; }
+                else if(const_a && a == 1)  { keep = rhs; drop = lhs; }
+                else if(const_b && b == 0 && !lhs->hasSideEffects()) { keep = rhs; drop = lhs; }
+                else if(const_a && a == 0 && !rhs->hasSideEffects()) { keep = lhs; drop = rhs; }
+            } break;
+            case MODULUS: {
+                if(const_b && (b == 1 || b == -1) && !lhs->hasSideEffects()) {
+                    delete lhs;
+                    delete rhs;
+                    return new exp_constant(0);
+                }
+            } break;
+            case BITWISE_AND: {
+                if(const_b && b == -1)      { keep = lhs; drop = rhs; }
+                else if(const_a && a == -1) { keep = rhs; drop = lhs; }
+                else if(const_b && b == 0 && !lhs->hasSideEffects()) { keep = rhs; drop = lhs; }
+                else if(const_a && a == 0 && !rhs->hasSideEffects()) { keep = lhs; drop = rhs; }
+            } break;
+            case BITWISE_OR:
+            case BITWISE_XOR: {
+                if(const_b && b == 0)       { keep = lhs; drop = rhs; }
+                else if(const_a && a == 0)  { keep = rhs; drop = lhs; }
+            } break;
+            case SHIFT_LEFT:
+            case SHIFT_RIGHT:
+            case SHIFT_RIGHT_LOGICAL: {
+                if(const_b && b == 0)       { keep = lhs; drop = rhs; }
+            } break;
+            default: break;
+        }
+        if(keep != nullptr) {
+            delete drop;
+            return keep;
+        }
+
+        return new exp_arithmetic_double(lhs, rhs, _op);
+    }
+    virtual bool hasSideEffects() const { return _lhs->hasSideEffects() || _rhs->hasSideEffects(); }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        _lhs->collectWrites(writes);
+        _rhs->collectWrites(writes);
+    }
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        bool lhs = _lhs->collectInvariants(writes, invariants);
+        bool rhs = _rhs->collectInvariants(writes, invariants);
+        // Divisions stay in the loop, which might not run at all, as they can fail
+        if(lhs && rhs && _op != DIVISION && _op != MODULUS) return true;
+        if(lhs) addInvariant(_lhs, invariants);
+        if(rhs) addInvariant(_rhs, invariants);
+        return false;
+    }
+    virtual bool collectLoads(std::vector<const exp_load*> &loads) const {
+        return _lhs->collectLoads(loads) && _rhs->collectLoads(loads);
+    }
 };
 
 struct exp_arithmetic_single : public abstract_expression {
@@ -517,8 +1282,37 @@ struct exp_arithmetic_single : public abstract_expression {
         if(_expr != nullptr) delete _expr;
     }
     virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
+        return compileValue(output, scope_parent, settings, mem, ids, resID, true);
+    }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        return compileValue(output, scope_parent, settings, mem, ids, 0, false);
+    }
+    // Compiles into resID if fixed, otherwise into a new temporary or, for negations and bitwise nots, one already
+    // holding the value
+    size_t compileValue(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID, bool fixed) const {
         DEBUG_PRINT("Compiling Single Arithmetic Expression of Type " + std::string(_post ? "Post" : "Pre") + std::to_string(_op));
-        size_t ret_expr = _expr->compile(output, scope_parent, settings, mem, ids);
+        if(reuseInvariant(output, scope_parent, this, resID, fixed)) return resID;
+        if(!fixed) resID = ids.getID();
+        // The value is unchanged, so it may as well be computed where it is wanted
+        if(_op == POSITIVE && !_post) return _expr->compile(output, scope_parent, settings, mem, ids, resID);
+        // Increments and decrements change the register of their operand, so one that isn't a variable gets a new one
+        // rather than one holding a value that is reused
+        bool changed = (_op == INCREMENT || _op == DECREMENT) && dynamic_cast<const exp_variable*>(_expr) == nullptr;
+        size_t ret_expr = changed ? _expr->compile(output, scope_parent, settings, mem, ids, ids.getID())
+                                  : _expr->compile(output, scope_parent, settings, mem, ids);
+
+        // Assigning a variable its own post increment or decrement stores the old value, which it already holds
+        if(_post && resID == ret_expr && (_op == INCREMENT || _op == DECREMENT)) return resID;
+
+        bool numbered = (_op == NEGATIVE || _op == BITWISE_NOT) && numberValues(settings);
+        scope_struct::ValueKey key = std::make_tuple(((uint64_t)HASH_ARITHMETIC_SINGLE << 16) | ((uint64_t)_op << 8), ret_expr, 0);
+        size_t held;
+        if(numbered && scope_parent.findValue(key, held, !fixed)) {
+            DEBUG_PRINT("Reusing Value of ID " << held);
+            if(!fixed || held == resID) return held;
+            scope_parent.copyRegister(output, held, resID);
+            return resID;
+        }
 
         switch(_op) {
             case POSITIVE: {
@@ -527,45 +1321,54 @@ struct exp_arithmetic_single : public abstract_expression {
             }
             case NEGATIVE: {
                 if(_post) throw OptimizeException::InvalidSingleOperation("Negative", _post);
-                cc_alu_move_inversion* cmd = new cc_alu_move_inversion(0, 0);
-                cc_iter it = output.insert(output.end(), &*cmd);
+                cc_alu_move_inversion* cmd = output.emplace_back<cc_alu_move_inversion>(0, 0);
+                cc_iter it = std::prev(output.end());
                 scope_parent.addRegisterEntry(&cmd->_in_register,  output.size()-1, ret_expr, it);
                 scope_parent.addRegisterEntry(&cmd->_out_register, output.size()-1, resID,   it);
+                if(numbered) scope_parent.addValue(key, resID, !fixed, { ret_expr });
+            } break;
+            case BITWISE_NOT: {
+                if(_post) throw OptimizeException::InvalidSingleOperation("Bitwise Not", _post);
+                cc_alu_move_not* cmd = output.emplace_back<cc_alu_move_not>(0, 0);
+                cc_iter it = std::prev(output.end());
+                scope_parent.addRegisterEntry(&cmd->_in_register,  output.size()-1, ret_expr, it);
+                scope_parent.addRegisterEntry(&cmd->_out_register, output.size()-1, resID,   it);
+                if(numbered) scope_parent.addValue(key, resID, !fixed, { ret_expr });
             } break;
             case INCREMENT: {
                 if(_post) {
-                    cc_copy_register* cmd1 = new cc_copy_register(0, 0);
-                    cc_iter it = output.insert(output.end(), &*cmd1);
+                    cc_copy_register* cmd1 = output.emplace_back<cc_copy_register>(0, 0);
+                    cc_iter it = std::prev(output.end());
                     scope_parent.addRegisterEntry(&cmd1->_from_register, output.size()-1, ret_expr, it);
                     scope_parent.addRegisterEntry(&cmd1->_to_register,   output.size()-1, resID,   it);
-                    cc_alu_increment* cmd2 = new cc_alu_increment(0);
-                    it = output.insert(output.end(), &*cmd2);
+                    cc_alu_increment* cmd2 = output.emplace_back<cc_alu_increment>(0);
+                    it = std::prev(output.end());
                     scope_parent.addRegisterEntry(&cmd2->_register, output.size()-1, ret_expr, it);
                 } else {
-                    cc_alu_increment* cmd1 = new cc_alu_increment(0);
-                    cc_iter it = output.insert(output.end(), &*cmd1);
+                    cc_alu_increment* cmd1 = output.emplace_back<cc_alu_increment>(0);
+                    cc_iter it = std::prev(output.end());
                     scope_parent.addRegisterEntry(&cmd1->_register, output.size()-1, ret_expr, it);
-                    cc_copy_register* cmd2 = new cc_copy_register(0, 0);
-                    it = output.insert(output.end(), &*cmd2);
+                    cc_copy_register* cmd2 = output.emplace_back<cc_copy_register>(0, 0);
+                    it = std::prev(output.end());
                     scope_parent.addRegisterEntry(&cmd2->_from_register, output.size()-1, ret_expr, it);
                     scope_parent.addRegisterEntry(&cmd2->_to_register,   output.size()-1, resID,   it);
                 }
             } break;
             case DECREMENT: {
                 if(_post) {
-                    cc_copy_register* cmd1 = new cc_copy_register(0, 0);
-                    cc_iter it = output.insert(output.end(), &*cmd1);
+                    cc_copy_register* cmd1 = output.emplace_back<cc_copy_register>(0, 0);
+                    cc_iter it = std::prev(output.end());
                     scope_parent.addRegisterEntry(&cmd1->_from_register, output.size()-1, ret_expr, it);
                     scope_parent.addRegisterEntry(&cmd1->_to_register,   output.size()-1, resID,   it);
-                    cc_alu_decrement* cmd2 = new cc_alu_decrement(0);
-                    it = output.insert(output.end(), &*cmd2);
+                    cc_alu_decrement* cmd2 = output.emplace_back<cc_alu_decrement>(0);
+                    it = std::prev(output.end());
                     scope_parent.addRegisterEntry(&cmd2->_register, output.size()-1, ret_expr, it);
                 } else {
-                    cc_alu_decrement* cmd1 = new cc_alu_decrement(0);
-                    cc_iter it = output.insert(output.end(), &*cmd1);
+                    cc_alu_decrement* cmd1 = output.emplace_back<cc_alu_decrement>(0);
+                    cc_iter it = std::prev(output.end());
                     scope_parent.addRegisterEntry(&cmd1->_register, output.size()-1, ret_expr, it);
-                    cc_copy_register* cmd2 = new cc_copy_register(0, 0);
-                    it = output.insert(output.end(), &*cmd2);
+                    cc_copy_register* cmd2 = output.emplace_back<cc_copy_register>(0, 0);
+                    it = std::prev(output.end());
                     scope_parent.addRegisterEntry(&cmd2->_from_register, output.size()-1, ret_expr, it);
                     scope_parent.addRegisterEntry(&cmd2->_to_register,   output.size()-1, resID,   it);
                 }
@@ -575,11 +1378,427 @@ struct exp_arithmetic_single : public abstract_expression {
 
         return resID;
     }
+    // Only the operand changes, so neither the old nor the new value is copied out
+    virtual void compileEffects(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        if(_op != INCREMENT && _op != DECREMENT) return abstract_expression::compileEffects(output, scope_parent, settings, mem, ids);
+        DEBUG_PRINT("Compiling Single Arithmetic Effects of Type " + std::to_string(_op));
+        bool changed = dynamic_cast<const exp_variable*>(_expr) == nullptr;
+        size_t ret_expr = changed ? _expr->compile(output, scope_parent, settings, mem, ids, ids.getID())
+                                  : _expr->compile(output, scope_parent, settings, mem, ids);
+        cc_alu_single_operation* cmd = _op == INCREMENT ? (cc_alu_single_operation*)output.emplace_back<cc_alu_increment>(0)
+                                                        : (cc_alu_single_operation*)output.emplace_back<cc_alu_decrement>(0);
+        scope_parent.addRegisterEntry(&cmd->_register, output.size()-1, ret_expr, std::prev(output.end()));
+    }
     virtual std::string to_string() const {
         return _post ? ( _expr->to_string() + std::to_string(_op) ) : ( std::to_string(_op) + _expr->to_string() );
     }
+    virtual uint64_t hash() const {
+        return hashCombine(hashCombine(hashCombine(HASH_ARITHMETIC_SINGLE, _op), _post), abstract_expression::hash(_expr));
+    }
+    virtual abstract_expression* clone() const { return new exp_arithmetic_single(_expr->clone(), _op, _post); }
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const {
+        int64_t value;
+        switch(_op) {
+            case POSITIVE:
+            case NEGATIVE:
+            case BITWISE_NOT: {
+                abstract_expression* expr = _expr->fold(constants, settings);
+                if(_post) return new exp_arithmetic_single(expr, _op, _post);
+                if(_op == POSITIVE) return expr;
+                if(constantValue(expr, value)) {
+                    delete expr;
+                    return new exp_constant(_op == NEGATIVE ? wrap(0 - (uint64_t)value, settings) : ~value);
+                }
+                return new exp_arithmetic_single(expr, _op, _post);
+            }
+            case INCREMENT:
+            case DECREMENT: {
+                uint64_t step = _op == INCREMENT ? 1 : (uint64_t)-1;
+
+                // The variable itself is changed, so it stays; its new value is still known if the old one was
+                const exp_variable* var = dynamic_cast<const exp_variable*>(_expr);
+                if(var != nullptr) {
+                    constant_map::iterator it = constants.find(var->_varID);
+                    if(it != constants.end()) it->second = wrap((uint64_t)it->second + step, settings);
+                    return new exp_arithmetic_single(new exp_variable(var->_varID), _op, _post);
+                }
+
+                // Otherwise only a temporary is changed, which must stay so even if the operand folds to a variable
+                abstract_expression* expr = _expr->fold(constants, settings);
+                if(constantValue(expr, value)) {
+                    delete expr;
+                    return new exp_constant(_post ? value : wrap((uint64_t)value + step, settings));
+                }
+                if(dynamic_cast<const exp_variable*>(expr) != nullptr) expr = new exp_arithmetic_single(expr, POSITIVE);
+                return new exp_arithmetic_single(expr, _op, _post);
+            }
+            default: return new exp_arithmetic_single(_expr->fold(constants, settings), _op, _post);
+        }
+    }
+    virtual bool hasSideEffects() const {
+        return ((_op == INCREMENT || _op == DECREMENT) && dynamic_cast<const exp_variable*>(_expr) != nullptr) || _expr->hasSideEffects();
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        const exp_variable* var = dynamic_cast<const exp_variable*>(_expr);
+        if((_op == INCREMENT || _op == DECREMENT) && var != nullptr) writes.insert(var->_varID);
+        _expr->collectWrites(writes);
+    }
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        // Changed variables are in writes, so an increment or decrement can only be invariant on a temporary
+        return _expr->collectInvariants(writes, invariants);
+    }
+    virtual bool collectLoads(std::vector<const exp_load*> &loads) const { return _expr->collectLoads(loads); }
+};
+
+inline abstract_expression* exp_arithmetic_double::keepRead(const abstract_expression* original, abstract_expression* folded,
+                                                           const std::set<size_t> &writes) {
+    const exp_variable* var = dynamic_cast<const exp_variable*>(folded);
+    if(var == nullptr || dynamic_cast<const exp_variable*>(original) != nullptr || !writes.count(var->_varID)) return folded;
+    return new exp_arithmetic_single(folded, POSITIVE);
+}
+
+struct exp_alloc : public abstract_expression {
+    const abstract_expression* _size;
+    exp_alloc(const abstract_expression* size)
+            : _size(size) {}
+    virtual ~exp_alloc() {
+        if(_size != nullptr) delete _size;
+    }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
+        DEBUG_PRINT("Compiling Allocation Expression");
+        size_t ret_size = _size->compile(output, scope_parent, settings, mem, ids);
+        cc_alloc* cmd = output.emplace_back<cc_alloc>(0, 0);
+        cc_iter it = std::prev(output.end());
+        scope_parent.addRegisterEntry(&cmd->_size_register, output.size()-1, ret_size, it);
+        scope_parent.addRegisterEntry(&cmd->_out_register,  output.size()-1, resID,    it);
+        return resID;
+    }
+    virtual std::string to_string() const {
+        return "alloc(" + _size->to_string() + ")";
+    }
+    virtual uint64_t hash() const { return hashCombine(HASH_ALLOC, abstract_expression::hash(_size)); }
+    virtual abstract_expression* clone() const { return new exp_alloc(_size->clone()); }
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const {
+        return new exp_alloc(_size->fold(constants, settings));
+    }
+    virtual bool hasSideEffects() const { return true; }
+    virtual void collectWrites(std::set<size_t> &writes) const { _size->collectWrites(writes); }
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_expression::collectInvariants(_size, writes, invariants);
+        return false;
+    }
+    // Loads moved ahead of it might read memory it hasn't handed out yet
+    virtual bool collectLoads(std::vector<const exp_load*> &loads) const { return false; }
+};
+
+struct exp_load : public abstract_expression {
+    const abstract_expression* _address;
+    const BitWidth _width;
+    exp_load(const abstract_expression* address, BitWidth width)
+            : _address(address), _width(width) {}
+    virtual ~exp_load() {
+        if(_address != nullptr) delete _address;
+    }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
+        return compileValue(output, scope_parent, settings, mem, ids, resID, true);
+    }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        return compileValue(output, scope_parent, settings, mem, ids, 0, false);
+    }
+    // Compiles into resID if fixed, otherwise into a new temporary or the one loaded ahead of a versioned loop
+    size_t compileValue(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID, bool fixed) const {
+        DEBUG_PRINT("Compiling Load Expression");
+        if(reuseInvariant(output, scope_parent, this, resID, fixed)) return resID;
+        if(!fixed) resID = ids.getID();
+        size_t ret_address = _address->compile(output, scope_parent, settings, mem, ids);
+        cc_move_to_register* cmd = output.emplace_back<cc_move_to_register>(0, 0, _width);
+        cc_iter it = std::prev(output.end());
+        scope_parent.addRegisterEntry(&cmd->_mem_address_register, output.size()-1, ret_address, it);
+        scope_parent.addRegisterEntry(&cmd->_target_register,      output.size()-1, resID,       it);
+        return resID;
+    }
+    virtual std::string to_string() const {
+        return "[" + _address->to_string() + "]";
+    }
+    virtual uint64_t hash() const { return hashCombine(hashCombine(HASH_LOAD, _width), abstract_expression::hash(_address)); }
+    virtual abstract_expression* clone() const { return new exp_load(_address->clone(), _width); }
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const {
+        return new exp_load(_address->fold(constants, settings), _width);
+    }
+    virtual bool hasSideEffects() const { return _address->hasSideEffects(); }
+    virtual void collectWrites(std::set<size_t> &writes) const { _address->collectWrites(writes); }
+    // Stores within the loop may change the memory, so only the address can be invariant; loops without stores to
+    // it are versioned instead
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_expression::collectInvariants(_address, writes, invariants);
+        return false;
+    }
+    virtual bool collectLoads(std::vector<const exp_load*> &loads) const {
+        if(!_address->collectLoads(loads)) return false;
+        loads.push_back(this);
+        return true;
+    }
+};
+
+
+
+struct exp_comparison : public abstract_expression {
+    const abstract_expression* _lhs;
+    const abstract_expression* _rhs;
+    const ComparisonOperator _op;
+    exp_comparison(const abstract_expression* lhs, const abstract_expression* rhs, ComparisonOperator op)
+            : _lhs(lhs), _rhs(rhs), _op(op) {}
+    virtual ~exp_comparison() {
+        if(_lhs != nullptr) delete _lhs;
+        if(_rhs != nullptr) delete _rhs;
+    }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
+        DEBUG_PRINT("Compiling Comparison Expression of Type " + std::to_string(_op));
+        return compileCondition(output, scope_parent, settings, mem, ids, resID);
+    }
+    virtual void compileBranch(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids,
+                               label_id label, bool jump_when, size_t zero_id) const {
+        DEBUG_PRINT("Compiling Comparison Branch of Type " + std::to_string(_op));
+        // Order matters; right to left, as for arithmetic
+        size_t b = _rhs->compile(output, scope_parent, settings, mem, ids);
+        size_t a = _lhs->compile(output, scope_parent, settings, mem, ids);
+
+        // Jumping when the comparison fails is jumping on the inverse one
+        ComparisonOperator op = _op;
+        if(!jump_when) {
+            switch(op) {
+                case LESS:          op = GREATER_EQUAL; break;
+                case LESS_EQUAL:    op = GREATER; break;
+                case EQUAL:         op = NOT_EQUAL; break;
+                case NOT_EQUAL:     op = EQUAL; break;
+                case GREATER:       op = LESS_EQUAL; break;
+                case GREATER_EQUAL: op = LESS; break;
+                default: throw OptimizeException::UnknownCommand();
+            }
+        }
+
+        // Greater is less with the operands swapped, and less or equal is the inverse of greater
+        switch(op) {
+            case EQUAL:     compileJump<cc_jump_equal>(output, scope_parent, settings, label, a, b); break;
+            case NOT_EQUAL: compileJump<cc_jump_not_equal>(output, scope_parent, settings, label, a, b); break;
+            case LESS:      compileJump<cc_jump_less>(output, scope_parent, settings, label, a, b); break;
+            case GREATER:   compileJump<cc_jump_less>(output, scope_parent, settings, label, b, a); break;
+            case LESS_EQUAL:
+            case GREATER_EQUAL: {
+                label_id label_skip = settings.labels.create(SWM_OPT_LABEL_CONDITION_SKIP);
+                if(op == LESS_EQUAL) compileJump<cc_jump_less>(output, scope_parent, settings, label_skip, b, a);
+                else compileJump<cc_jump_less>(output, scope_parent, settings, label_skip, a, b);
+                output.emplace_back<cc_jump>(settings.labels, label);
+                output.emplace_back<cc_label>(settings.labels, label_skip);
+            } break;
+            default: throw OptimizeException::UnknownCommand();
+        }
+    }
+    virtual bool branchesOnValue() const { return false; }
+    virtual std::string to_string() const {
+        return "(" + _lhs->to_string() + " " + std::to_string(_op) + " " + _rhs->to_string() + ")";
+    }
+    virtual uint64_t hash() const {
+        return hashCombine(hashCombine(hashCombine(HASH_COMPARISON, _op), abstract_expression::hash(_lhs)), abstract_expression::hash(_rhs));
+    }
+    virtual abstract_expression* clone() const { return new exp_comparison(_lhs->clone(), _rhs->clone(), _op); }
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const {
+        // The registers are compared after the side effects of both operands, as for arithmetic
+        std::set<size_t> writes;
+        collectWrites(writes);
+        for(size_t varID : writes) constants.erase(varID);
+
+        abstract_expression* rhs = exp_arithmetic_double::keepRead(_rhs, _rhs->fold(constants, settings), writes);
+        abstract_expression* lhs = exp_arithmetic_double::keepRead(_lhs, _lhs->fold(constants, settings), writes);
+
+        int64_t a, b;
+        if(constantValue(lhs, a) && constantValue(rhs, b)) {
+            bool holds = false;
+            switch(_op) {
+                case LESS:          holds = a < b; break;
+                case LESS_EQUAL:    holds = a <= b; break;
+                case EQUAL:         holds = a == b; break;
+                case NOT_EQUAL:     holds = a != b; break;
+                case GREATER:       holds = a > b; break;
+                case GREATER_EQUAL: holds = a >= b; break;
+                default: return new exp_comparison(lhs, rhs, _op);
+            }
+            delete lhs;
+            delete rhs;
+            return new exp_constant(holds ? 1 : 0);
+        }
+        return new exp_comparison(lhs, rhs, _op);
+    }
+    virtual bool hasSideEffects() const { return _lhs->hasSideEffects() || _rhs->hasSideEffects(); }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        _lhs->collectWrites(writes);
+        _rhs->collectWrites(writes);
+    }
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        // Both operands are compared in registers, so invariant constants are loaded ahead too
+        if(_lhs->collectInvariants(writes, invariants) && dynamic_cast<const exp_variable*>(_lhs) == nullptr) invariants.push_back(_lhs);
+        if(_rhs->collectInvariants(writes, invariants) && dynamic_cast<const exp_variable*>(_rhs) == nullptr) invariants.push_back(_rhs);
+        return false;
+    }
+    virtual bool collectLoads(std::vector<const exp_load*> &loads) const {
+        return _lhs->collectLoads(loads) && _rhs->collectLoads(loads);
+    }
+};
+
+struct exp_logical : public abstract_expression {
+    const abstract_expression* _lhs;
+    const abstract_expression* _rhs;
+    const LogicalOperator _op;
+    exp_logical(const abstract_expression* lhs, const abstract_expression* rhs, LogicalOperator op)
+            : _lhs(lhs), _rhs(rhs), _op(op) {}
+    virtual ~exp_logical() {
+        if(_lhs != nullptr) delete _lhs;
+        if(_rhs != nullptr) delete _rhs;
+    }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
+        DEBUG_PRINT("Compiling Logical Expression of Type " + std::to_string(_op));
+        return compileCondition(output, scope_parent, settings, mem, ids, resID);
+    }
+    // The right hand side only runs if the left one doesn't decide the result
+    virtual void compileBranch(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids,
+                               label_id label, bool jump_when, size_t zero_id) const {
+        DEBUG_PRINT("Compiling Logical Branch of Type " + std::to_string(_op));
+        // If the left hand side alone decides the result, it either jumps to the label or past the right hand side
+        bool decides = _op == LOGICAL_OR;
+        label_id label_skip = SWM_LABEL_NONE;
+        if(decides == jump_when) {
+            _lhs->compileBranch(output, scope_parent, settings, mem, ids, label, jump_when, zero_id);
+        } else {
+            label_skip = settings.labels.create(SWM_OPT_LABEL_CONDITION_SKIP);
+            _lhs->compileBranch(output, scope_parent, settings, mem, ids, label_skip, decides, zero_id);
+        }
+
+        scope_parent.pushValueScope();
+        _rhs->compileBranch(output, scope_parent, settings, mem, ids, label, jump_when, zero_id);
+        scope_parent.popValueScope();
+
+        if(label_skip != SWM_LABEL_NONE) output.emplace_back<cc_label>(settings.labels, label_skip);
+    }
+    virtual bool branchesOnValue() const { return _lhs->branchesOnValue() || _rhs->branchesOnValue(); }
+    virtual std::string to_string() const {
+        return "(" + _lhs->to_string() + " " + std::to_string(_op) + " " + _rhs->to_string() + ")";
+    }
+    virtual uint64_t hash() const {
+        return hashCombine(hashCombine(hashCombine(HASH_LOGICAL, _op), abstract_expression::hash(_lhs)), abstract_expression::hash(_rhs));
+    }
+    virtual abstract_expression* clone() const { return new exp_logical(_lhs->clone(), _rhs->clone(), _op); }
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const {
+        abstract_expression* lhs = _lhs->fold(constants, settings);
+        int64_t value;
+        if(constantValue(lhs, value)) {
+            delete lhs;
+            bool holds = value > 0;
+            if(holds == (_op == LOGICAL_OR)) return new exp_constant(holds ? 1 : 0);
+
+            // Otherwise the right hand side always runs and decides the result
+            abstract_expression* rhs = _rhs->fold(constants, settings);
+            if(constantValue(rhs, value)) {
+                delete rhs;
+                return new exp_constant(value > 0 ? 1 : 0);
+            }
+            return new exp_comparison(rhs, new exp_constant(0), GREATER);
+        }
+
+        // The right hand side may not run, so only what it leaves unchanged is known afterwards
+        constant_map rhs_constants = constants;
+        abstract_expression* rhs = _rhs->fold(rhs_constants, settings);
+        std::set<size_t> writes;
+        _rhs->collectWrites(writes);
+        for(size_t varID : writes) constants.erase(varID);
+        return new exp_logical(lhs, rhs, _op);
+    }
+    virtual bool hasSideEffects() const { return _lhs->hasSideEffects() || _rhs->hasSideEffects(); }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        _lhs->collectWrites(writes);
+        _rhs->collectWrites(writes);
+    }
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_expression::collectInvariants(_lhs, writes, invariants);
+        abstract_expression::collectInvariants(_rhs, writes, invariants);
+        return false;
+    }
+    // The right hand side may not run
+    virtual bool collectLoads(std::vector<const exp_load*> &loads) const {
+        std::vector<const exp_load*> skipped;
+        return _lhs->collectLoads(loads) && _rhs->collectLoads(skipped);
+    }
 };
 
+// Calls a function of stmt_function_definition and gives the value it returns
+struct exp_call : public abstract_expression {
+    const size_t _functionID;
+    const std::vector<const abstract_expression*> _args;
+    exp_call(size_t functionID, std::vector<const abstract_expression*> args)
+            : _functionID(functionID), _args(args) {}
+    virtual ~exp_call() {
+        for(const abstract_expression* arg : _args) delete arg;
+    }
+    virtual size_t compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids, size_t resID) const {
+        DEBUG_PRINT("Compiling Call Expression");
+        scope_struct::function_entry function;
+        if(!scope_parent.findFunction(_functionID, function)) throw OptimizeException::FunctionNotFound(_functionID);
+        if(function.param_count != _args.size()) throw OptimizeException::ArgumentCount(_functionID, function.param_count, _args.size());
+
+        // Order matters; left to right. The argument registers are only filled once all arguments are computed, as
+        // they may call functions themselves. Values live from the first copy through the call are kept out of the
+        // argument registers, so the copies can't clobber each other and the callee may overwrite them.
+        std::vector<size_t> values;
+        for(const abstract_expression* arg : _args) values.push_back(arg->compile(output, scope_parent, settings, mem, ids));
+        size_t span_begin = output.size();
+        for(size_t i = 0; i < values.size(); i++) {
+            cc_copy_register* cmd = output.emplace_back<cc_copy_register>(0, (vbyte)i);
+            scope_parent.addRegisterEntry(&cmd->_from_register, output.size()-1, values[i], std::prev(output.end()));
+        }
+        output.emplace_back<cc_call>(settings.labels, function.label, (vbyte)values.size(), function.argument_registers);
+        scope_parent.addCallSpan(span_begin, output.size()-1);
+        // Copied out of register 0 as a whole, so a load of resID ahead of the copy could only clobber the result
+        cc_copy_register* cmd = output.emplace_back<cc_copy_register>(0, 0);
+        scope_parent.addRegisterEntry(&cmd->_to_register, output.size()-1, resID, std::prev(output.end()), true);
+        return resID;
+    }
+    virtual std::string to_string() const {
+        std::string result = "call " + std::to_string(_functionID) + "(";
+        for(size_t i = 0; i < _args.size(); i++) result += (i > 0 ? ", " : "") + _args[i]->to_string();
+        return result + ")";
+    }
+    virtual uint64_t hash() const {
+        uint64_t result = hashCombine(hashCombine(HASH_CALL, _functionID), _args.size());
+        for(const abstract_expression* arg : _args) result = hashCombine(result, arg->hash());
+        return result;
+    }
+    virtual abstract_expression* clone() const {
+        std::vector<const abstract_expression*> args;
+        for(const abstract_expression* arg : _args) args.push_back(arg->clone());
+        return new exp_call(_functionID, args);
+    }
+    virtual abstract_expression* fold(constant_map &constants, const optimizer_settings &settings) const {
+        // The arguments are passed after the side effects of all of them, as operands are. The function only
+        // changes its own variables, so what is known about the caller's still holds after the call.
+        std::set<size_t> writes;
+        collectWrites(writes);
+        for(size_t varID : writes) constants.erase(varID);
+
+        std::vector<const abstract_expression*> args;
+        for(const abstract_expression* arg : _args)
+            args.push_back(exp_arithmetic_double::keepRead(arg, arg->fold(constants, settings), writes));
+        return new exp_call(_functionID, args);
+    }
+    virtual bool hasSideEffects() const { return true; }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        for(const abstract_expression* arg : _args) arg->collectWrites(writes);
+    }
+    // The function may change memory or return something else each time, so only the arguments can be invariant
+    virtual bool collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        for(const abstract_expression* arg : _args) abstract_expression::collectInvariants(arg, writes, invariants);
+        return false;
+    }
+    virtual bool collectLoads(std::vector<const exp_load*> &loads) const { return false; }
+};
 
 
 struct abstract_statement {
@@ -591,6 +1810,71 @@ struct abstract_statement {
             pre += "  ";
         return pre + to_string();
     }
+    // Equal for structurally equal trees
+    virtual uint64_t hash() const = 0;
+    static uint64_t hash(const abstract_statement* stmt) { return stmt != nullptr ? stmt->hash() : HASH_NONE; }
+    static uint64_t hash(const stmt_list &stmts) {
+        uint64_t result = hashCombine(HASH_NONE, stmts.size());
+        for(const abstract_statement* stmt : stmts) result = hashCombine(result, stmt->hash());
+        return result;
+    }
+    // Returns a new, identical tree; the caller owns it
+    virtual abstract_statement* clone() const = 0;
+    static abstract_statement* clone(const abstract_statement* stmt) { return stmt != nullptr ? stmt->clone() : nullptr; }
+    static stmt_list clone(const stmt_list &stmts) {
+        stmt_list result;
+        for(const abstract_statement* stmt : stmts) result.push_back(stmt->clone());
+        return result;
+    }
+    // Returns a new statement as for abstract_expression::fold, or nullptr if nothing is left of it
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const = 0;
+    static abstract_statement* fold(const abstract_statement* stmt, constant_map &constants, const optimizer_settings &settings) {
+        return stmt != nullptr ? stmt->fold(constants, settings) : nullptr;
+    }
+    static stmt_list fold(const stmt_list &stmts, constant_map &constants, const optimizer_settings &settings) {
+        stmt_list result;
+        for(const abstract_statement* stmt : stmts) {
+            abstract_statement* folded = stmt->fold(constants, settings);
+            if(folded != nullptr) result.push_back(folded);
+        }
+        return result;
+    }
+    // Adds a copy of the statement with its counted loops unrolled, as for unrollLoops
+    virtual void unroll(stmt_list &output, const optimizer_settings &settings) const { output.push_back(clone()); }
+    static stmt_list unroll(const stmt_list &stmts, const optimizer_settings &settings) {
+        stmt_list result;
+        for(const abstract_statement* stmt : stmts) stmt->unroll(result, settings);
+        return result;
+    }
+    // Statements in the tree, which unrolling weighs against its budget
+    virtual size_t statementCount() const { return 1; }
+    static size_t statementCount(const stmt_list &stmts) {
+        size_t count = 0;
+        for(const abstract_statement* stmt : stmts) count += stmt->statementCount();
+        return count;
+    }
+    // Adds the variables the statement assigns or otherwise changes
+    virtual void collectWrites(std::set<size_t> &writes) const = 0;
+    static void collectWrites(const stmt_list &stmts, std::set<size_t> &writes) {
+        for(const abstract_statement* stmt : stmts) stmt->collectWrites(writes);
+    }
+    // Adds the parts of the statement's expressions that stay the same while none of writes change
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const = 0;
+    static void collectInvariants(const stmt_list &stmts, const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) {
+        for(const abstract_statement* stmt : stmts) stmt->collectInvariants(writes, invariants);
+    }
+    // Adds the stores, and the loads made whenever the statement runs unless loads is null. Returns whether the
+    // statement changes memory only by those stores and always runs to its end.
+    virtual bool collectAccesses(std::vector<const exp_load*>* loads, std::vector<const stmt_store*> &stores) const { return false; }
+    static bool collectAccesses(const stmt_list &stmts, std::vector<const exp_load*>* loads, std::vector<const stmt_store*> &stores) {
+        for(const abstract_statement* stmt : stmts)
+            if(!stmt->collectAccesses(loads, stores)) return false;
+        return true;
+    }
+    static bool collectLoads(const abstract_expression* expr, std::vector<const exp_load*>* loads) {
+        std::vector<const exp_load*> skipped;
+        return expr == nullptr || expr->collectLoads(loads != nullptr ? *loads : skipped);
+    }
     virtual ~abstract_statement() {}
 };
 
@@ -606,6 +1890,7 @@ struct stmt_assignment : public abstract_statement {
     virtual void compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
         DEBUG_PRINT("Compiling Assignment Statement");
         if(_define && !mem.exists(_varID)) mem.create(_varID, settings.program_width);
+        scope_parent.checkVariable(_varID, mem);
         _expr->compile(output, scope_parent, settings, mem, ids, _varID);
         //cc_copy_register* cmd = new cc_copy_register(0, 0);
         //cc_iter it = output.insert(output.end(), &*cmd);
@@ -615,6 +1900,27 @@ struct stmt_assignment : public abstract_statement {
     virtual std::string to_string() const {
         return std::string(_define ? "init " : "") + "{" + std::to_string(_varID) + "} = " + _expr->to_string();
     }
+    virtual uint64_t hash() const {
+        return hashCombine(hashCombine(hashCombine(HASH_ASSIGNMENT, _varID), _define), abstract_expression::hash(_expr));
+    }
+    virtual abstract_statement* clone() const { return new stmt_assignment(_expr->clone(), _varID, _define); }
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const {
+        abstract_expression* expr = _expr->fold(constants, settings);
+        int64_t value;
+        if(abstract_expression::constantValue(expr, value)) constants[_varID] = value;
+        else constants.erase(_varID);
+        return new stmt_assignment(expr, _varID, _define);
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        writes.insert(_varID);
+        _expr->collectWrites(writes);
+    }
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_expression::collectInvariants(_expr, writes, invariants);
+    }
+    virtual bool collectAccesses(std::vector<const exp_load*>* loads, std::vector<const stmt_store*> &stores) const {
+        return collectLoads(_expr, loads);
+    }
 };
 
 struct stmt_expr : public abstract_statement {
@@ -626,11 +1932,103 @@ struct stmt_expr : public abstract_statement {
     }
     virtual void compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
         DEBUG_PRINT("Compiling Expression Statement");
-        _expr->compile(output, scope_parent, settings, mem, ids);
+        _expr->compileEffects(output, scope_parent, settings, mem, ids);
     }
     virtual std::string to_string() const {
         return _expr->to_string();
     }
+    virtual uint64_t hash() const { return hashCombine(HASH_EXPRESSION, abstract_expression::hash(_expr)); }
+    virtual abstract_statement* clone() const { return new stmt_expr(_expr->clone()); }
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const {
+        abstract_expression* expr = _expr->fold(constants, settings);
+        // Nothing is left of an expression whose value is unused and that changes nothing
+        if(!expr->hasSideEffects()) {
+            delete expr;
+            return nullptr;
+        }
+        return new stmt_expr(expr);
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const { _expr->collectWrites(writes); }
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_expression::collectInvariants(_expr, writes, invariants);
+    }
+    virtual bool collectAccesses(std::vector<const exp_load*>* loads, std::vector<const stmt_store*> &stores) const {
+        return collectLoads(_expr, loads);
+    }
+};
+
+struct stmt_store : public abstract_statement {
+    const abstract_expression* _address;
+    const abstract_expression* _expr;
+    const BitWidth _width;
+    stmt_store(const abstract_expression* address, const abstract_expression* expr, BitWidth width)
+            : _address(address), _expr(expr), _width(width) {}
+    virtual ~stmt_store() {
+        if(_address != nullptr) delete _address;
+        if(_expr != nullptr) delete _expr;
+    }
+    virtual void compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        DEBUG_PRINT("Compiling Store Statement");
+        size_t ret_expr = _expr->compile(output, scope_parent, settings, mem, ids);
+        size_t ret_address = _address->compile(output, scope_parent, settings, mem, ids);
+        cc_move_to_memory* cmd = output.emplace_back<cc_move_to_memory>(0, 0, _width);
+        cc_iter it = std::prev(output.end());
+        scope_parent.addRegisterEntry(&cmd->_target_register,      output.size()-1, ret_expr,    it);
+        scope_parent.addRegisterEntry(&cmd->_mem_address_register, output.size()-1, ret_address, it);
+    }
+    virtual std::string to_string() const {
+        return "[" + _address->to_string() + "] = " + _expr->to_string();
+    }
+    virtual uint64_t hash() const {
+        return hashCombine(hashCombine(hashCombine(HASH_STORE, _width), abstract_expression::hash(_address)), abstract_expression::hash(_expr));
+    }
+    virtual abstract_statement* clone() const { return new stmt_store(_address->clone(), _expr->clone(), _width); }
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const {
+        abstract_expression* expr = _expr->fold(constants, settings);
+        abstract_expression* address = _address->fold(constants, settings);
+        return new stmt_store(address, expr, _width);
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        _expr->collectWrites(writes);
+        _address->collectWrites(writes);
+    }
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_expression::collectInvariants(_expr, writes, invariants);
+        abstract_expression::collectInvariants(_address, writes, invariants);
+    }
+    virtual bool collectAccesses(std::vector<const exp_load*>* loads, std::vector<const stmt_store*> &stores) const {
+        if(!collectLoads(_expr, loads) || !collectLoads(_address, loads)) return false;
+        stores.push_back(this);
+        return true;
+    }
+};
+
+struct stmt_free : public abstract_statement {
+    const abstract_expression* _address;
+    stmt_free(const abstract_expression* address)
+            : _address(address) {}
+    virtual ~stmt_free() {
+        if(_address != nullptr) delete _address;
+    }
+    virtual void compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        DEBUG_PRINT("Compiling Free Statement");
+        size_t ret_address = _address->compile(output, scope_parent, settings, mem, ids);
+        cc_free* cmd = output.emplace_back<cc_free>(0);
+        cc_iter it = std::prev(output.end());
+        scope_parent.addRegisterEntry(&cmd->_address_register, output.size()-1, ret_address, it);
+    }
+    virtual std::string to_string() const {
+        return "free(" + _address->to_string() + ")";
+    }
+    virtual uint64_t hash() const { return hashCombine(HASH_FREE, abstract_expression::hash(_address)); }
+    virtual abstract_statement* clone() const { return new stmt_free(_address->clone()); }
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const {
+        return new stmt_free(_address->fold(constants, settings));
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const { _address->collectWrites(writes); }
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_expression::collectInvariants(_address, writes, invariants);
+    }
 };
 
 struct stmt_flow_control : public abstract_statement {
@@ -645,20 +2043,27 @@ struct stmt_flow_control : public abstract_statement {
         DEBUG_PRINT("Compiling Flow Control Statement");
         switch(_control) {
             case BREAK: {
-                if(scope_parent._label_break.size() < 1)
+                if(scope_parent._label_break == SWM_LABEL_NONE)
                     throw OptimizeException::ScopeControl(_control);
                 else
-                    output.insert(output.end(), new cc_jump(settings.labels, scope_parent._label_break));
+                    output.emplace_back<cc_jump>(settings.labels, scope_parent._label_break);
             } break;
             case CONTINUE: {
-                if(scope_parent._label_continue.size() < 1)
+                if(scope_parent._label_continue == SWM_LABEL_NONE)
                     throw OptimizeException::ScopeControl(_control);
                 else
-                    output.insert(output.end(), new cc_jump(settings.labels, scope_parent._label_continue));
+                    output.emplace_back<cc_jump>(settings.labels, scope_parent._label_continue);
             } break;
             case RETURN: {
-                // TODO: Fill out stmt_flow_control Return operation
-                throw OptimizeException::ScopeControl(_control);
+                if(scope_parent._label_return == SWM_LABEL_NONE)
+                    throw OptimizeException::ScopeControl(_control);
+                // The value is returned in register 0, which nothing is allocated to
+                if(_expr_ret != nullptr) {
+                    size_t value = _expr_ret->compile(output, scope_parent, settings, mem, ids);
+                    cc_copy_register* cmd = output.emplace_back<cc_copy_register>(0, 0);
+                    scope_parent.addRegisterEntry(&cmd->_from_register, output.size()-1, value, std::prev(output.end()));
+                } else output.emplace_back<cc_load_constant>(0, 0, BIT_8);
+                output.emplace_back<cc_jump>(settings.labels, scope_parent._label_return);
             } break;
             default: break;
         }
@@ -667,6 +2072,19 @@ struct stmt_flow_control : public abstract_statement {
         return std::to_string(_control) +
                 (( _control == RETURN && _expr_ret != nullptr) ? (" " + _expr_ret->to_string()) : "");
     }
+    virtual uint64_t hash() const {
+        return hashCombine(hashCombine(HASH_FLOW_CONTROL, _control), abstract_expression::hash(_expr_ret));
+    }
+    virtual abstract_statement* clone() const { return new stmt_flow_control(_control, abstract_expression::clone(_expr_ret)); }
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const {
+        return new stmt_flow_control(_control, abstract_expression::fold(_expr_ret, constants, settings));
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        if(_expr_ret != nullptr) _expr_ret->collectWrites(writes);
+    }
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_expression::collectInvariants(_expr_ret, writes, invariants);
+    }
 };
 
 struct stmt_loop : public abstract_statement {
@@ -691,67 +2109,146 @@ public:
 
     virtual void compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
 
-        scope_parent.pushLoopCache();
+        scope_parent.pushBlockCache();
 
         // Loop initialize statement
         if(_stmt_init != nullptr) _stmt_init->compile(output, scope_parent, settings, mem, ids);
 
-        // Load a '0' constant for comparisons
-        size_t zeroConstID = ids.getID();
-        cc_load_constant* cmd_lc = new cc_load_constant(0, 0, BIT_8);
-        cc_iter it = output.insert(output.end(), &*cmd_lc);
-        scope_parent.addRegisterEntry(&cmd_lc->_target_register, output.size()-1, zeroConstID, it);
+        // Values from before the loop only hold on every iteration if the loop doesn't change their operands
+        std::set<size_t> writes;
+        collectLoopWrites(writes);
+        for(size_t varID : writes) scope_parent.killValues(varID);
+
+        // Load a '0' constant if the condition tests a value rather than comparing
+        cc_iter before = std::prev(output.end());
+        size_t begin_index = output.size();
+        size_t zeroConstID = 0;
+        if(_expr_cond != nullptr && _expr_cond->branchesOnValue())
+            zeroConstID = scope_parent.loadConstant(output, ids, 0, abstract_expression::numberValues(settings));
+
+        // A copy of the loop making its loads from unchanged addresses only once runs if the loop is entered at all
+        // and none of its stores overlaps those loads; the condition held, so that copy starts with the body
+        std::vector<const exp_load*> loads;
+        std::vector<const stmt_store*> stores;
+        if(versionLoads(settings, writes, loads, stores)) {
+            DEBUG_PRINT("Versioning Loop on " << loads.size() << " Loads and " << stores.size() << " Stores");
+            label_id label_done = settings.labels.create(SWM_OPT_LABEL_LOOP_DONE);
+            label_id label_safe = stores.empty() ? SWM_LABEL_NONE : settings.labels.create(SWM_OPT_LABEL_LOOP_SAFE);
+
+            scope_parent.pushValueScope();
+            if(_expr_cond != nullptr)
+                _expr_cond->compileBranch(output, scope_parent, settings, mem, ids, label_done, false, zeroConstID);
+
+            // Any check may branch to the safe copy, so values computed by the checks only hold in the fast one
+            scope_parent.pushValueScope();
+            for(size_t i = 0; i < stores.size(); i++) {
+                if(!firstAccess(stores, i)) continue;
+                const stmt_store* store = stores[i];
+                for(size_t j = 0; j < loads.size(); j++) {
+                    if(!firstAccess(loads, j)) continue;
+                    const exp_load* load = loads[j];
+                    // The bytes overlap if each access starts before the other one ends
+                    exp_logical overlap(
+                            new exp_comparison(load->_address->clone(), new exp_arithmetic_double(
+                                    store->_address->clone(), new exp_constant((int64_t)store->_width), ADDITION), LESS),
+                            new exp_comparison(store->_address->clone(), new exp_arithmetic_double(
+                                    load->_address->clone(), new exp_constant((int64_t)load->_width), ADDITION), LESS),
+                            LOGICAL_AND);
+                    overlap.compileBranch(output, scope_parent, settings, mem, ids, label_safe, true, zeroConstID);
+                }
+            }
+            compileVersion(output, scope_parent, settings, mem, ids, writes, zeroConstID, loads, true);
+            scope_parent.popValueScope();
+            if(!stores.empty()) {
+                output.emplace_back<cc_jump>(settings.labels, label_done);
+                output.emplace_back<cc_label>(settings.labels, label_safe);
+                scope_parent.pushValueScope();
+                compileVersion(output, scope_parent, settings, mem, ids, writes, zeroConstID, {}, false);
+                scope_parent.popValueScope();
+            }
+            output.emplace_back<cc_label>(settings.labels, label_done);
+            scope_parent.popValueScope();
+        } else {
+            compileVersion(output, scope_parent, settings, mem, ids, writes, zeroConstID, {}, false);
+        }
+        cc_iter begin_it = std::next(before);
+
+        scope_parent.popBlockCache(mem, begin_index, begin_it, output.size() - 1, --output.end(), true);
+    }
 
+    // Compiles the loop after its initialization, with the loads also made once in the preheader. A loop already
+    // entered starts with the body rather than the condition.
+    void compileVersion(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids,
+                        const std::set<size_t> &writes, size_t zeroConstID, const std::vector<const exp_load*> &loads, bool entered) const {
         // Create the loop's labels
-        std::string label_begin = settings.labels.uniqueLabel(SWM_OPT_LABEL_LOOP_BEGIN);
-        std::string label_check = settings.labels.uniqueLabel(SWM_OPT_LABEL_LOOP_CHECK);
-        std::string label_end = settings.labels.uniqueLabel(SWM_OPT_LABEL_LOOP_END);
+        label_id label_begin = settings.labels.create(SWM_OPT_LABEL_LOOP_BEGIN);
+        label_id label_check = settings.labels.create(SWM_OPT_LABEL_LOOP_CHECK);
+        label_id label_end = settings.labels.create(SWM_OPT_LABEL_LOOP_END);
 
         // Cache the previous Flow Control labels
-        std::string label_old_fc_break = scope_parent._label_break;
-        std::string label_old_fc_continue = scope_parent._label_continue;
+        label_id label_old_fc_break = scope_parent._label_break;
+        label_id label_old_fc_continue = scope_parent._label_continue;
 
         // Set the Flow Control labels
         scope_parent._label_break = label_end;
         scope_parent._label_continue = label_begin;
 
+        // Preheader; invariant values are computed once and kept in their registers until the loop ends, as
+        // temporaries used within a loop are
+        std::vector<const abstract_expression*> invariants;
+        if(abstract_expression::moveInvariants(settings)) collectLoopInvariants(writes, invariants);
+        invariants.insert(invariants.end(), loads.begin(), loads.end());
+        std::vector<const abstract_expression*> hoisted;
+        for(const abstract_expression* expr : invariants) {
+            size_t held;
+            // Already computed ahead of an enclosing loop
+            if(scope_parent.findInvariant(expr, held)) continue;
+            // Or ahead of this one, for another copy of a versioned load
+            const abstract_expression* same = nullptr;
+            for(const abstract_expression* prev : hoisted)
+                if(same == nullptr && prev->hash() == expr->hash() && dynamic_cast<const exp_load*>(expr) != nullptr) same = prev;
+            if(same != nullptr && scope_parent.findInvariant(same, held)) scope_parent.addInvariant(expr, held);
+            else scope_parent.addInvariant(expr, expr->compile(output, scope_parent, settings, mem, ids));
+            hoisted.push_back(expr);
+        }
+
         // Jump to the Loop Condition Check
-        output.insert(output.end(), new cc_jump(settings.labels, label_check));
+        if(!entered) output.emplace_back<cc_jump>(settings.labels, label_check);
 
         // Create the start label
-        output.insert(output.end(), new cc_label(settings.labels, label_begin));
+        output.emplace_back<cc_label>(settings.labels, label_begin);
 
         // Evaluate loop contents
+        scope_parent.pushValueScope();
         for(abstract_statement* stmt : _stmts) {
             stmt->compile(output, scope_parent, settings, mem, ids);
         }
 
         // Loop Increment Statement
         if(_stmt_inc != nullptr) _stmt_inc->compile(output, scope_parent, settings, mem, ids);
+        scope_parent.popValueScope();
 
         // Create the check label
-        output.insert(output.end(), new cc_label(settings.labels, label_check));
+        output.emplace_back<cc_label>(settings.labels, label_check);
 
         // Jump back to the start based on Loop Check Expression
         if(_expr_cond != nullptr) {
-            size_t retID_cond = _expr_cond->compile(output, scope_parent, settings, mem, ids);
-            cc_jump_less *cmd_jmp = new cc_jump_less(settings.labels, label_begin, 0, 0);
-            it = output.insert(output.end(), &*cmd_jmp);
-            scope_parent.addRegisterEntry(&cmd_jmp->_register_a, output.size() - 1, zeroConstID, it);
-            scope_parent.addRegisterEntry(&cmd_jmp->_register_b, output.size() - 1, retID_cond, it);
+            scope_parent.pushValueScope();
+            _expr_cond->compileBranch(output, scope_parent, settings, mem, ids, label_begin, true, zeroConstID);
+            scope_parent.popValueScope();
         } else {
             // No check, always jump (infinite loop if no Flow Control exists)
-            output.insert(output.end(), new cc_jump(settings.labels, label_begin));
+            output.emplace_back<cc_jump>(settings.labels, label_begin);
         }
 
         // Create the end label
-        output.insert(output.end(), new cc_label(settings.labels, label_end));
+        output.emplace_back<cc_label>(settings.labels, label_end);
 
         // Reset the Flow Control labels
         scope_parent._label_break = label_old_fc_break;
         scope_parent._label_continue = label_old_fc_continue;
 
-        scope_parent.popLoopCache(output.size() - 1, --output.end());
+        for(const abstract_expression* expr : hoisted) scope_parent.removeInvariant(expr);
     }
     virtual std::string to_string(size_t indent) const {
         std::string ind("");
@@ -769,6 +2266,96 @@ public:
         return to_string(0);
     }
 
+    virtual uint64_t hash() const {
+        uint64_t result = hashCombine(HASH_LOOP, abstract_statement::hash(_stmts));
+        result = hashCombine(result, abstract_statement::hash(_stmt_init));
+        result = hashCombine(result, abstract_expression::hash(_expr_cond));
+        return hashCombine(result, abstract_statement::hash(_stmt_inc));
+    }
+    virtual abstract_statement* clone() const {
+        return new stmt_loop(abstract_statement::clone(_stmts), abstract_statement::clone(_stmt_init),
+                             abstract_expression::clone(_expr_cond), abstract_statement::clone(_stmt_inc));
+    }
+    virtual void unroll(stmt_list &output, const optimizer_settings &settings) const {
+        // Inner loops first, so the budget covers what they grew to
+        stmt_loop* loop = new stmt_loop(abstract_statement::unroll(_stmts, settings), abstract_statement::clone(_stmt_init),
+                                        abstract_expression::clone(_expr_cond), abstract_statement::clone(_stmt_inc));
+        if(loop->unrollCounted(output, settings)) delete loop;
+        else output.push_back(loop);
+    }
+    virtual size_t statementCount() const {
+        return 1 + abstract_statement::statementCount(_stmts)
+               + (_stmt_init != nullptr ? _stmt_init->statementCount() : 0)
+               + (_stmt_inc != nullptr ? _stmt_inc->statementCount() : 0);
+    }
+    // Whether the loop steps a variable by one towards a constant bound, and the body leaves the variable alone and
+    // always runs to its end. Inclusive bounds are turned into the exclusive bound one step further.
+    bool countedLoop(size_t &varID, bool &up, int64_t &bound, const optimizer_settings &settings) const;
+    // Adds the statements replacing a counted loop; the whole body for each iteration if the trip count is known and
+    // fits the budget, otherwise a loop over several copies of the body followed by the loop itself for the rest
+    bool unrollCounted(stmt_list &output, const optimizer_settings &settings) const;
+    static bool hasFlowControl(const stmt_list &stmts);
+    // Picks the loads a versioned copy of the loop makes once ahead of it: those from addresses the loop leaves
+    // unchanged that run on every iteration, if the loop changes memory only by stores to such addresses. The stores
+    // are added for the guard to check against the loads.
+    bool versionLoads(const optimizer_settings &settings, const std::set<size_t> &writes,
+                      std::vector<const exp_load*> &loads, std::vector<const stmt_store*> &stores) const;
+    // Copies of the same access, as unrolling leaves them, are checked once
+    template<typename T>
+    static bool firstAccess(const std::vector<const T*> &accesses, size_t index) {
+        for(size_t i = 0; i < index; i++)
+            if(accesses[i]->_address->hash() == accesses[index]->_address->hash() && accesses[i]->_width == accesses[index]->_width)
+                return false;
+        return true;
+    }
+    template<typename T>
+    static size_t countAccesses(const std::vector<const T*> &accesses) {
+        size_t count = 0;
+        for(size_t i = 0; i < accesses.size(); i++) count += firstAccess(accesses, i);
+        return count;
+    }
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const {
+        abstract_statement* init = abstract_statement::fold(_stmt_init, constants, settings);
+
+        // Only values no part of the loop changes hold on every iteration, and after the loop
+        std::set<size_t> writes;
+        collectLoopWrites(writes);
+        for(size_t varID : writes) constants.erase(varID);
+
+        constant_map cond_constants = constants;
+        constant_map body_constants = constants;
+        constant_map inc_constants = constants;
+        return new stmt_loop(abstract_statement::fold(_stmts, body_constants, settings), init,
+                             abstract_expression::fold(_expr_cond, cond_constants, settings),
+                             abstract_statement::fold(_stmt_inc, inc_constants, settings));
+    }
+    // Everything but the initialization, which only runs once
+    void collectLoopWrites(std::set<size_t> &writes) const {
+        abstract_statement::collectWrites(_stmts, writes);
+        if(_expr_cond != nullptr) _expr_cond->collectWrites(writes);
+        if(_stmt_inc != nullptr) _stmt_inc->collectWrites(writes);
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        if(_stmt_init != nullptr) _stmt_init->collectWrites(writes);
+        collectLoopWrites(writes);
+    }
+    // Everything but the initialization, as for collectLoopWrites
+    void collectLoopInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        abstract_statement::collectInvariants(_stmts, writes, invariants);
+        abstract_expression::collectInvariants(_expr_cond, writes, invariants);
+        if(_stmt_inc != nullptr) _stmt_inc->collectInvariants(writes, invariants);
+    }
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        if(_stmt_init != nullptr) _stmt_init->collectInvariants(writes, invariants);
+        collectLoopInvariants(writes, invariants);
+    }
+    // The body may not run, but the initialization and the first check always do
+    virtual bool collectAccesses(std::vector<const exp_load*>* loads, std::vector<const stmt_store*> &stores) const {
+        if(_stmt_init != nullptr && !_stmt_init->collectAccesses(loads, stores)) return false;
+        if(!collectLoads(_expr_cond, loads)) return false;
+        if(!abstract_statement::collectAccesses(_stmts, nullptr, stores)) return false;
+        return _stmt_inc == nullptr || _stmt_inc->collectAccesses(nullptr, stores);
+    }
 };
 
 struct stmt_conditional : public abstract_statement {
@@ -799,56 +2386,65 @@ struct stmt_conditional : public abstract_statement {
 
     virtual void compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
 
-        // Load a '0' constant for comparisons
-        size_t zeroConstID = ids.getID();
-        cc_load_constant* cmd_lc = new cc_load_constant(0, 0, BIT_8);
-        cc_iter it = output.insert(output.end(), &*cmd_lc);
-        scope_parent.addRegisterEntry(&cmd_lc->_target_register, output.size()-1, zeroConstID, it);
+        // Load a '0' constant if a condition tests a value rather than comparing
+        scope_parent.pushBlockCache();
+        cc_iter before = std::prev(output.end());
+        size_t begin_index = output.size();
+        size_t zeroConstID = 0;
+        bool values = false;
+        for(const conditional_block* block : _if_blocks) values |= block->expr->branchesOnValue();
+        if(values) zeroConstID = scope_parent.loadConstant(output, ids, 0, abstract_expression::numberValues(settings));
 
         // Create the conditional's labels
-        std::string label_if = settings.labels.uniqueLabel(SWM_OPT_LABEL_CONDITIONAL_IF);
-        std::string label_else = settings.labels.uniqueLabel(SWM_OPT_LABEL_CONDITIONAL_ELSE);
-        std::string label_end = settings.labels.uniqueLabel(SWM_OPT_LABEL_CONDITIONAL_END);
+        // One If label per block; they are consecutive, so block bi uses label_if + bi
+        label_id label_if = settings.labels.create(SWM_OPT_LABEL_CONDITIONAL_IF, _if_blocks.size());
+        label_id label_else = settings.labels.create(SWM_OPT_LABEL_CONDITIONAL_ELSE);
+        label_id label_end = settings.labels.create(SWM_OPT_LABEL_CONDITIONAL_END);
 
         // Check to make sure there is at least one conditional block
         if(_if_blocks.empty())
             throw OptimizeException::MissingExpression("Conditional");
 
-        // Go through If blocks in order and check conditionals
+        // Go through If blocks in order and check conditionals; later checks don't run once one holds
         size_t bi = 0;
+        scope_parent.pushValueScope();
         for(conditional_block* block : _if_blocks) {
-            size_t retID_cond = block->expr->compile(output, scope_parent, settings, mem, ids);
-            cc_jump_less *cmd_jmp = new cc_jump_less(settings.labels, label_if + std::to_string(bi), 0, 0);
-            it = output.insert(output.end(), &*cmd_jmp);
-            scope_parent.addRegisterEntry(&cmd_jmp->_register_a, output.size() - 1, zeroConstID, it);
-            scope_parent.addRegisterEntry(&cmd_jmp->_register_b, output.size() - 1, retID_cond, it);
+            block->expr->compileBranch(output, scope_parent, settings, mem, ids, label_if + bi, true, zeroConstID);
             bi++;
         }
+        scope_parent.popValueScope();
 
         // Add Else jump
-        output.insert(output.end(), new cc_jump(settings.labels, label_else));
+        output.emplace_back<cc_jump>(settings.labels, label_else);
+        cc_iter begin_it = std::next(before);
 
         // Go through If blocks in order and compile statements
         bi = 0;
         for(conditional_block* block : _if_blocks) {
-            output.insert(output.end(), new cc_label(settings.labels, label_if + std::to_string(bi)));
+            output.emplace_back<cc_label>(settings.labels, label_if + bi);
+            scope_parent.pushValueScope();
             for(abstract_statement* stmt : block->stmts) {
                 stmt->compile(output, scope_parent, settings, mem, ids);
             }
-            output.insert(output.end(), new cc_jump(settings.labels, label_end));
+            scope_parent.popValueScope();
+            output.emplace_back<cc_jump>(settings.labels, label_end);
             bi++;
         }
 
         // Create the Else label
-        output.insert(output.end(), new cc_label(settings.labels, label_else));
+        output.emplace_back<cc_label>(settings.labels, label_else);
 
         // Add Else statements
+        scope_parent.pushValueScope();
         for(abstract_statement* stmt : _else_stmts) {
             stmt->compile(output, scope_parent, settings, mem, ids);
         }
+        scope_parent.popValueScope();
 
         // Create the end label
-        output.insert(output.end(), new cc_label(settings.labels, label_end));
+        output.emplace_back<cc_label>(settings.labels, label_end);
+
+        scope_parent.popBlockCache(mem, begin_index, begin_it, output.size() - 1, --output.end(), false);
     }
     virtual std::string to_string(size_t indent) const {
         std::string ind("");
@@ -870,78 +2466,347 @@ struct stmt_conditional : public abstract_statement {
     virtual std::string to_string() const {
         return to_string(0);
     }
-};
+    virtual uint64_t hash() const {
+        uint64_t result = hashCombine(HASH_CONDITIONAL, _if_blocks.size());
+        for(const conditional_block* block : _if_blocks)
+            result = hashCombine(hashCombine(result, abstract_expression::hash(block->expr)), abstract_statement::hash(block->stmts));
+        return hashCombine(result, abstract_statement::hash(_else_stmts));
+    }
+    virtual abstract_statement* clone() const {
+        std::list<conditional_block*> if_blocks;
+        for(const conditional_block* block : _if_blocks)
+            if_blocks.push_back(new conditional_block(block->expr->clone(), abstract_statement::clone(block->stmts)));
+        return new stmt_conditional(if_blocks, abstract_statement::clone(_else_stmts));
+    }
+    virtual void unroll(stmt_list &output, const optimizer_settings &settings) const {
+        std::list<conditional_block*> if_blocks;
+        for(const conditional_block* block : _if_blocks)
+            if_blocks.push_back(new conditional_block(block->expr->clone(), abstract_statement::unroll(block->stmts, settings)));
+        output.push_back(new stmt_conditional(if_blocks, abstract_statement::unroll(_else_stmts, settings)));
+    }
+    virtual size_t statementCount() const {
+        size_t count = 1 + abstract_statement::statementCount(_else_stmts);
+        for(const conditional_block* block : _if_blocks) count += abstract_statement::statementCount(block->stmts);
+        return count;
+    }
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const {
+        // Conditions are evaluated in order until one holds, so each block sees the effects of all conditions before it
+        std::list<conditional_block*> if_blocks;
+        constant_map cond_constants = constants;
+        for(const conditional_block* block : _if_blocks) {
+            abstract_expression* expr = block->expr->fold(cond_constants, settings);
+            constant_map block_constants = cond_constants;
+            if_blocks.push_back(new conditional_block(expr, abstract_statement::fold(block->stmts, block_constants, settings)));
+        }
+        constant_map else_constants = cond_constants;
+        stmt_list else_stmts = abstract_statement::fold(_else_stmts, else_constants, settings);
 
-struct stmt_function_definition : public abstract_statement {
+        // Afterwards only values no branch or condition changes are known
+        std::set<size_t> writes;
+        collectWrites(writes);
+        for(size_t varID : writes) constants.erase(varID);
 
+        return new stmt_conditional(if_blocks, else_stmts);
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const {
+        for(const conditional_block* block : _if_blocks) {
+            block->expr->collectWrites(writes);
+            abstract_statement::collectWrites(block->stmts, writes);
+        }
+        abstract_statement::collectWrites(_else_stmts, writes);
+    }
+    // Values in any branch may be computed ahead, as invariants never fail or change anything
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {
+        for(const conditional_block* block : _if_blocks) {
+            abstract_expression::collectInvariants(block->expr, writes, invariants);
+            abstract_statement::collectInvariants(block->stmts, writes, invariants);
+        }
+        abstract_statement::collectInvariants(_else_stmts, writes, invariants);
+    }
+    // Only the first condition is checked every time
+    virtual bool collectAccesses(std::vector<const exp_load*>* loads, std::vector<const stmt_store*> &stores) const {
+        bool first = true;
+        for(const conditional_block* block : _if_blocks) {
+            if(!collectLoads(block->expr, first ? loads : nullptr)) return false;
+            if(!abstract_statement::collectAccesses(block->stmts, nullptr, stores)) return false;
+            first = false;
+        }
+        return abstract_statement::collectAccesses(_else_stmts, nullptr, stores);
+    }
 };
 
-/*
-struct stmt_function : public abstract_statement, public scope_function {
-protected:
-    std::vector<abstract_statement*> _stmts;
+inline bool stmt_loop::countedLoop(size_t &varID, bool &up, int64_t &bound, const optimizer_settings &settings) const {
+    const stmt_expr* inc = dynamic_cast<const stmt_expr*>(_stmt_inc);
+    const exp_arithmetic_single* step = inc != nullptr ? dynamic_cast<const exp_arithmetic_single*>(inc->_expr) : nullptr;
+    const exp_variable* var = step != nullptr ? dynamic_cast<const exp_variable*>(step->_expr) : nullptr;
+    if(var == nullptr || (step->_op != INCREMENT && step->_op != DECREMENT)) return false;
+    varID = var->_varID;
+    up = step->_op == INCREMENT;
+
+    // The counter alone holds while it is above zero; a comparison may have it on either side
+    ComparisonOperator op = GREATER;
+    bound = 0;
+    const exp_comparison* cond = dynamic_cast<const exp_comparison*>(_expr_cond);
+    if(cond != nullptr) {
+        const exp_variable* lhs = dynamic_cast<const exp_variable*>(cond->_lhs);
+        const exp_variable* rhs = dynamic_cast<const exp_variable*>(cond->_rhs);
+        if(lhs != nullptr && lhs->_varID == varID && abstract_expression::constantValue(cond->_rhs, bound)) {
+            op = cond->_op;
+        } else if(rhs != nullptr && rhs->_varID == varID && abstract_expression::constantValue(cond->_lhs, bound)) {
+            switch(cond->_op) {
+                case LESS:          op = GREATER; break;
+                case LESS_EQUAL:    op = GREATER_EQUAL; break;
+                case GREATER:       op = LESS; break;
+                case GREATER_EQUAL: op = LESS_EQUAL; break;
+                default: return false;
+            }
+        } else return false;
+    } else {
+        const exp_variable* cond_var = dynamic_cast<const exp_variable*>(_expr_cond);
+        if(cond_var == nullptr || cond_var->_varID != varID) return false;
+    }
 
-public:
-    const vbyte _param_count;
-    const std::string _label;
+    // Counters stepping away from the bound only stop by wrapping around, as do inclusive bounds at the very end
+    bound = abstract_expression::wrap(bound, settings);
+    if(up && op == LESS_EQUAL) {
+        int64_t next = abstract_expression::wrap((uint64_t)bound + 1, settings);
+        if(next < bound) return false;
+        bound = next;
+    } else if(!up && op == GREATER_EQUAL) {
+        int64_t next = abstract_expression::wrap((uint64_t)bound - 1, settings);
+        if(next > bound) return false;
+        bound = next;
+    } else if(op != (up ? LESS : GREATER)) return false;
+
+    std::set<size_t> writes;
+    abstract_statement::collectWrites(_stmts, writes);
+    return !writes.count(varID) && !hasFlowControl(_stmts);
+}
+
+inline bool stmt_loop::unrollCounted(stmt_list &output, const optimizer_settings &settings) const {
+    size_t varID;
+    bool up;
+    int64_t bound;
+    if(!countedLoop(varID, up, bound, settings)) return false;
+    size_t factor = settings.unroll_factor != 0 ? settings.unroll_factor : SWM_OPT_UNROLL_FACTOR;
+    size_t budget = settings.unroll_budget != 0 ? settings.unroll_budget : SWM_OPT_UNROLL_BUDGET;
+    size_t copy = abstract_statement::statementCount(_stmts) + 1;
+
+    // A constant start gives the trip count; the counter reaches the bound without wrapping
+    const stmt_assignment* init = dynamic_cast<const stmt_assignment*>(_stmt_init);
+    int64_t start;
+    if(init != nullptr && init->_varID == varID && abstract_expression::constantValue(init->_expr, start)) {
+        start = abstract_expression::wrap(start, settings);
+        uint64_t trips = 0;
+        if(up && start < bound) trips = (uint64_t)bound - (uint64_t)start;
+        else if(!up && start > bound) trips = (uint64_t)start - (uint64_t)bound;
+        if(trips <= budget / copy) {
+            DEBUG_PRINT("Unrolling Loop fully over " << trips << " Iterations");
+            output.push_back(_stmt_init->clone());
+            for(uint64_t i = 0; i < trips; i++) {
+                for(const abstract_statement* stmt : _stmts) output.push_back(stmt->clone());
+                output.push_back(_stmt_inc->clone());
+            }
+            return true;
+        }
+    }
+
+    if(factor > budget / copy) factor = budget / copy;
+    if(factor < 2) return false;
 
-    stmt_function(optimizer_settings &settings, vbyte param_count = 0)
-            : abstract_statement(settings), _param_count(param_count), _label(settings.labels.uniqueLabel(OPT_LABEL_FUNCTION)) {}
+    // The unrolled loop runs while every copy would, so its bound is moved by the copies after the first
+    int64_t limit = abstract_expression::wrap(up ? (uint64_t)bound - (factor - 1) : (uint64_t)bound + (factor - 1), settings);
+    if(up ? limit >= bound : limit <= bound) return false;
 
-    void add(abstract_statement* stmt) {
-        _stmts.push_back(stmt);
+    DEBUG_PRINT("Unrolling Loop " << factor << " times");
+    if(_stmt_init != nullptr) output.push_back(_stmt_init->clone());
+    stmt_list body;
+    for(size_t i = 0; i < factor; i++) {
+        for(const abstract_statement* stmt : _stmts) body.push_back(stmt->clone());
+        body.push_back(_stmt_inc->clone());
     }
+    output.push_back(new stmt_loop(body, nullptr, new exp_comparison(new exp_variable(varID), new exp_constant(limit), up ? LESS : GREATER), nullptr));
+    output.push_back(new stmt_loop(abstract_statement::clone(_stmts), nullptr, _expr_cond->clone(), _stmt_inc->clone()));
+    return true;
+}
 
-    virtual ~stmt_function() {
-        for(abstract_statement* stmt : _stmts) delete stmt;
+inline bool stmt_loop::versionLoads(const optimizer_settings &settings, const std::set<size_t> &writes,
+                                    std::vector<const exp_load*> &loads, std::vector<const stmt_store*> &stores) const {
+    // The guard compares addresses as signed values, which 8 bits are too few for
+    if((settings.disabled_passes & PASS_LOOP_VERSIONING) || !abstract_expression::moveInvariants(settings)
+       || settings.program_width == BIT_8) return false;
+    // The guard checks the condition once more
+    if(_expr_cond != nullptr && _expr_cond->hasSideEffects()) return false;
+
+    // Once the condition held, everything up to the first check runs
+    std::vector<const exp_load*> candidates;
+    if(!collectLoads(_expr_cond, &candidates) || !abstract_statement::collectAccesses(_stmts, &candidates, stores)) return false;
+    if(_stmt_inc != nullptr && !_stmt_inc->collectAccesses(&candidates, stores)) return false;
+
+    std::vector<const abstract_expression*> parts;
+    for(const stmt_store* store : stores)
+        if(!store->_address->collectInvariants(writes, parts)) return false;
+    for(const exp_load* load : candidates) {
+        if(!load->_address->collectInvariants(writes, parts)) continue;
+        // A store to the same address always overlaps
+        bool stored = false;
+        for(const stmt_store* store : stores) stored |= store->_address->hash() == load->_address->hash();
+        if(!stored) loads.push_back(load);
     }
+    // Every pair is checked on entry
+    return !loads.empty() && countAccesses(stores) * countAccesses(loads) <= SWM_OPT_VERSION_CHECKS;
+}
 
-    virtual void compile(std::list<compiler_command*> &output, const scope_struct &scope_parent) const {
+// Flow control would leave the copies of an unrolled body early; nested loops keep theirs to themselves
+inline bool stmt_loop::hasFlowControl(const stmt_list &stmts) {
+    for(const abstract_statement* stmt : stmts) {
+        if(dynamic_cast<const stmt_flow_control*>(stmt) != nullptr) return true;
+        const stmt_conditional* cond = dynamic_cast<const stmt_conditional*>(stmt);
+        if(cond == nullptr) continue;
+        for(const stmt_conditional::conditional_block* block : cond->_if_blocks)
+            if(hasFlowControl(block->stmts)) return true;
+        if(hasFlowControl(cond->_else_stmts)) return true;
+    }
+    return false;
+}
 
-        if(_param_count > reg_array.registerMax())
-            throw std::out_of_range("stmt_function::compile() - Paramater count higher than total register count");
+// A function exp_call can call from anywhere in the statements defining it, which must do so at the top level. The
+// body only sees its parameters and the variables it defines itself. Calls pass the arguments in the registers from 0
+// up and get the result back in register 0. Those are saved by the caller: the allocator keeps values live across a
+// call out of them. Functions save the other registers they use, so such values stay in their registers.
+struct stmt_function_definition : public abstract_statement {
+protected:
+    stmt_list _stmts;
 
-        // Add the label for jumping to this function
-        output.push_back(new cc_label(_settings.labels, _label));
+public:
+    const size_t _functionID;
+    const std::vector<size_t> _params;
 
-        // Add the return location to the stack
-        output.push_back(new cc_move_to_memory(SWM_REG_COUNTER, SWM_REG_STACK, _settings.program_width));
-        output.push_back(new cc_alu_const_add(SWM_REG_STACK, SWM_REG_STACK, 8, BIT_8));
+    stmt_function_definition(size_t functionID, std::vector<size_t> params, stmt_list stmts)
+            : _stmts(stmts), _functionID(functionID), _params(params) {}
 
-        register_array func_reg_array(reg_array.registerMax());
-        size_t func_reg_counter = 0;
+    virtual ~stmt_function_definition() {
+        for(abstract_statement* stmt : _stmts)
+            delete stmt;
+    }
 
-        // Create the temporary function commands
-        std::vector<compiler_command*> tmp;
-        for(abstract_statement* stmt : _stmts) stmt->compile(tmp, *this);
+    // Definitions at the top level are taken out and compiled by compileBody instead
+    virtual void compile(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids) const {
+        throw OptimizeException::NestedFunction(_functionID);
+    }
 
-        // Determine appropiate register IDs
-        std::set<vbyte> used_regs = func_reg_array.compile((vbyte)(_param_count+1));
-        vbyte ordered_regs[used_regs.size()];
-        vbyte i0 = 0;
+    // Compiles the body with registers of its own, up to the label returns jump to; compileOptimizeList adds the
+    // entry and the exit around it once it knows which functions may call themselves
+    void compileBody(cc_list &output, scope_struct &scope_parent, optimizer_settings &settings, mem_map &mem, id_map &ids,
+                     vbyte argument_registers) const {
+        DEBUG_PRINT("Compiling Function " << _functionID);
+        scope_function scope(scope_parent, _functionID);
+        scope._label_return = settings.labels.create(SWM_OPT_LABEL_FUNCTION_RETURN);
+
+        // The arguments are copied out of their registers first, so calls within the body can pass their own
+        for(size_t i = 0; i < _params.size(); i++) {
+            if(!mem.exists(_params[i])) mem.create(_params[i], settings.program_width);
+            cc_copy_register* cmd = output.emplace_back<cc_copy_register>((vbyte)i, 0);
+            scope.addRegisterEntry(&cmd->_to_register, output.size()-1, _params[i], std::prev(output.end()), true);
+        }
+        if(!_params.empty()) scope.addCallSpan(0, _params.size()-1);
 
-        // Add the contents of any used registers to the stack
-        for(vbyte reg : used_regs) {
-            output.push_back(new cc_move_to_memory(reg, SWM_REG_STACK, _settings.program_width));
-            output.push_back(new cc_alu_const_add(SWM_REG_STACK, SWM_REG_STACK, 8, BIT_8));
-            ordered_regs[i0++] = reg;
+        for(abstract_statement* stmt : _stmts) {
+            stmt->compile(output, scope, settings, mem, ids);
         }
 
-        // Add function contents
-        for(compiler_command* cmd : tmp) output.push_back(cmd);
+        // Running off the end returns 0
+        output.emplace_back<cc_load_constant>(0, 0, BIT_8);
+        output.emplace_back<cc_label>(settings.labels, scope._label_return);
 
-        // Retrieve the contents of any
-        for(vbyte i = (vbyte)used_regs.size(); i >= 0; i--) {
-            output.push_back(new cc_alu_const_subtract(SWM_REG_STACK, SWM_REG_STACK, 8, BIT_8));
-            output.push_back(new cc_move_to_register(ordered_regs[i], SWM_REG_STACK, _settings.program_width));
-        }
+        scope.calculateRegisters(output, settings, mem, argument_registers);
+    }
 
-        // Return to the original location
-        output.push_back(new cc_alu_const_subtract(SWM_REG_STACK, SWM_REG_STACK, 8, BIT_8));
-        output.push_back(new cc_move_to_register(SWM_REG_COUNTER, SWM_REG_STACK, _settings.program_width));
+    virtual std::string to_string(size_t indent) const {
+        std::string ind("");
+        for(size_t i = 0; i < indent; i++)
+            ind += "  ";
+        std::string result = ind + "function " + std::to_string(_functionID) + "(";
+        for(size_t i = 0; i < _params.size(); i++) result += (i > 0 ? ", {" : "{") + std::to_string(_params[i]) + "}";
+        result += ")";
+        for(abstract_statement* stmt : _stmts)
+            result += "\n" + stmt->to_string(indent+1);
+        return result;
+    }
+    virtual std::string to_string() const {
+        return to_string(0);
+    }
 
+    virtual uint64_t hash() const {
+        uint64_t result = hashCombine(hashCombine(HASH_FUNCTION, _functionID), _params.size());
+        for(size_t param : _params) result = hashCombine(result, param);
+        return hashCombine(result, abstract_statement::hash(_stmts));
+    }
+    virtual abstract_statement* clone() const {
+        return new stmt_function_definition(_functionID, _params, abstract_statement::clone(_stmts));
+    }
+    virtual void unroll(stmt_list &output, const optimizer_settings &settings) const {
+        output.push_back(new stmt_function_definition(_functionID, _params, abstract_statement::unroll(_stmts, settings)));
     }
+    virtual size_t statementCount() const {
+        return 1 + abstract_statement::statementCount(_stmts);
+    }
+    // Nothing is known about the arguments, and defining the function changes nothing for the statements around it
+    virtual abstract_statement* fold(constant_map &constants, const optimizer_settings &settings) const {
+        constant_map body_constants;
+        return new stmt_function_definition(_functionID, _params, abstract_statement::fold(_stmts, body_constants, settings));
+    }
+    virtual void collectWrites(std::set<size_t> &writes) const {}
+    virtual void collectInvariants(const std::set<size_t> &writes, std::vector<const abstract_expression*> &invariants) const {}
 };
-*/
 
-cc_list compileOptimizeList(const std::list<abstract_statement*> &stmts, optimizer_settings &settings, id_map &ids, size_t* req_mem_size);
\ No newline at end of file
+// Folds constants and propagates known variable values through a copy of the statements; the caller owns the result
+stmt_list foldConstants(const stmt_list &stmts, const optimizer_settings &settings);
+
+// Unrolls the counted loops in a copy of the statements, within the factor and budget of the settings; the caller owns
+// the result
+stmt_list unrollLoops(const stmt_list &stmts, const optimizer_settings &settings);
+
+// Drops the loads and stores around allocated registers that don't change what the program computes: reloads of a
+// slot a register still holds, loads into registers the block overwrites before reading them, stores of a value the
+// slot already holds and stores overwritten before any load, barrier or the end of the commands can observe them.
+// Returns the number of commands removed.
+size_t removeMemoryTraffic(cc_list &cmds, BitWidth register_width);
+
+// Lowers the statements into allocated commands. Top-level function definitions are emitted after a jump over them,
+// keeping only the ones the other statements reach. A function body only names its parameters and the variables it
+// defines, which get heap slots of their own behind the top level's. Values live across a call are kept out of the
+// registers passing arguments, so a program with functions needs SWM_OPT_CALL_REGISTERS more than the most parameters.
+cc_list compileOptimizeList(const std::list<abstract_statement*> &stmts, optimizer_settings &settings, id_map &ids, size_t* req_mem_size);
+
+// Compiles independent top-level units on up to thread_count threads (0 for one per core) and links them in order.
+// Each unit gets its own commands, scope, heap and labels, and a copy of ids for its temporaries, so units must not
+// share variables or functions; only program_width, max_register_count, allocator, disabled_passes and the unrolling settings are
+// taken from settings.
+ve_program compileUnitsParallel(const std::vector<stmt_list> &units, const optimizer_settings &settings, const id_map &ids, size_t thread_count = 0);
+
+// Compiles one top-level unit into a relocatable module, as done for each unit by compileUnitsParallel
+ve_module compileUnit(const stmt_list &unit, const optimizer_settings &settings, const id_map &ids);
+
+// Keeps the compiled module of every unit keyed by its structural hash, so recompiling a program only compiles the
+// units that changed since the last call and relinks the rest. The same rules as for compileUnitsParallel apply.
+class incremental_compiler {
+protected:
+    optimizer_settings _settings;
+    std::unordered_map<uint64_t, ve_module> _cache;
+    size_t _hits = 0;
+    size_t _misses = 0;
+
+public:
+    // Every unit is compiled with the settings given here; each gets its own labels
+    incremental_compiler(const optimizer_settings &settings) : _settings(settings) {}
+
+    // Modules of units that no longer appear in the program are dropped
+    ve_program compile(const std::vector<stmt_list> &units, const id_map &ids);
+
+    void clear() { _cache.clear(); }
+
+    size_t hits() const { return _hits; }
+    size_t misses() const { return _misses; }
+    size_t cached() const { return _cache.size(); }
+};
@@ -0,0 +1,154 @@
+#include "peephole.h"
+
+#include <iomanip>
+#include <unordered_map>
+
+peephole_optimizer::peephole_optimizer() {
+    addRule("SelfCopy",        peepholeSelfCopy);
+    addRule("StoreLoad",       peepholeStoreLoad);
+    addRule("ConstantReload",  peepholeConstantReload);
+    addRule("JumpToNext",      peepholeJumpToNext);
+}
+
+peephole_rule* peephole_optimizer::find(const std::string &name) {
+    for(peephole_rule &rule : _rules)
+        if(rule.name == name) return &rule;
+    return nullptr;
+}
+
+void peephole_optimizer::addRule(const std::string &name, peephole_pass pass, bool enabled) {
+    peephole_rule* rule = find(name);
+    if(rule != nullptr) *rule = { name, pass, enabled, 0 };
+    else _rules.push_back({ name, pass, enabled, 0 });
+}
+
+bool peephole_optimizer::setEnabled(const std::string &name, bool enabled) {
+    peephole_rule* rule = find(name);
+    if(rule == nullptr) return false;
+    rule->enabled = enabled;
+    return true;
+}
+
+size_t peephole_optimizer::run(cc_list &cmds) {
+    size_t total = 0;
+    size_t removed;
+    do {
+        removed = 0;
+        for(peephole_rule &rule : _rules) {
+            if(!rule.enabled) continue;
+            size_t n = rule.pass(cmds);
+            rule.removed += n;
+            removed += n;
+        }
+        total += removed;
+        _iterations++;
+    } while(removed > 0);
+    return total;
+}
+
+size_t peephole_optimizer::removed(const std::string &name) const {
+    for(const peephole_rule &rule : _rules)
+        if(rule.name == name) return rule.removed;
+    return 0;
+}
+
+void peephole_optimizer::printStats() const {
+    std::cout << "Peephole (" << _iterations << " Iterations):" << std::endl;
+    for(const peephole_rule &rule : _rules)
+        std::cout << "  " << std::left << std::setw(16) << rule.name << std::right
+                  << (rule.enabled ? std::to_string(rule.removed) : "Disabled") << std::endl;
+}
+
+size_t peepholeSelfCopy(cc_list &cmds) {
+    size_t removed = 0;
+    cc_iter it = cmds.begin();
+    while(it != cmds.end()) {
+        cc_copy_register* cmd = dynamic_cast<cc_copy_register*>(*it);
+        if(cmd != nullptr && cmd->_from_register == cmd->_to_register) {
+            it = cmds.erase(it);
+            removed++;
+        } else it++;
+    }
+    return removed;
+}
+
+size_t peepholeStoreLoad(cc_list &cmds) {
+    size_t removed = 0;
+    if(cmds.empty()) return removed;
+    cc_iter prev = cmds.begin();
+    cc_iter it = std::next(prev);
+    while(it != cmds.end()) {
+        cc_move_to_memory_constant* store = dynamic_cast<cc_move_to_memory_constant*>(*prev);
+        cc_move_to_register_constant* load = dynamic_cast<cc_move_to_register_constant*>(*it);
+        if(store != nullptr && load != nullptr
+           && store->_target_register == load->_target_register
+           && store->_width == load->_width
+           && store->_mem_address.getu() == load->_mem_address.getu()) {
+            it = cmds.erase(it);
+            removed++;
+        } else {
+            prev = it;
+            it++;
+        }
+    }
+    return removed;
+}
+
+size_t peepholeConstantReload(cc_list &cmds) {
+    size_t removed = 0;
+
+    // Constants known to be held by registers; only valid until the next label, which may be jumped to
+    std::unordered_map<vbyte, VariableValue> known;
+
+    cc_iter it = cmds.begin();
+    while(it != cmds.end()) {
+        compiler_command* cmd = *it;
+        if(dynamic_cast<cc_label*>(cmd) != nullptr) {
+            known.clear();
+        } else if(cc_load_constant* load = dynamic_cast<cc_load_constant*>(cmd)) {
+            std::unordered_map<vbyte, VariableValue>::iterator k = known.find(load->_target_register);
+            if(k != known.end() && k->second._width == load->_value._width && k->second.get() == load->_value.get()) {
+                it = cmds.erase(it);
+                removed++;
+                continue;
+            }
+            known.erase(load->_target_register);
+            known.insert({ load->_target_register, load->_value });
+        } else {
+            std::unordered_map<vbyte, VariableValue>::iterator k = known.begin();
+            while(k != known.end()) {
+                if(cmd->writes(k->first)) k = known.erase(k);
+                else k++;
+            }
+        }
+        it++;
+    }
+    return removed;
+}
+
+size_t peepholeJumpToNext(cc_list &cmds) {
+    size_t removed = 0;
+    cc_iter it = cmds.begin();
+    while(it != cmds.end()) {
+        cc_jump_operation* jump = dynamic_cast<cc_jump_operation*>(*it);
+        bool redundant = false;
+        if(jump != nullptr) {
+            // Look through the run of labels directly after the jump
+            cc_iter next = std::next(it);
+            while(next != cmds.end()) {
+                cc_label* label = dynamic_cast<cc_label*>(*next);
+                if(label == nullptr) break;
+                if(label->labels() == jump->labels() && label->_label == jump->_label) {
+                    redundant = true;
+                    break;
+                }
+                next++;
+            }
+        }
+        if(redundant) {
+            it = cmds.erase(it);
+            removed++;
+        } else it++;
+    }
+    return removed;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "compiler.h"
+
+#include <string>
+#include <vector>
+
+// A rule makes one pass over the command list and returns how many commands it removed
+typedef size_t (*peephole_pass)(cc_list &cmds);
+
+struct peephole_rule {
+    std::string name;
+    peephole_pass pass;
+    bool enabled;
+    size_t removed;
+};
+
+// Runs over a register-allocated command list, applying its rules until none of them removes anything
+class peephole_optimizer {
+protected:
+    std::vector<peephole_rule> _rules;
+    size_t _iterations = 0;
+
+    peephole_rule* find(const std::string &name);
+
+public:
+    peephole_optimizer();
+
+    void addRule(const std::string &name, peephole_pass pass, bool enabled = true);
+    bool setEnabled(const std::string &name, bool enabled);
+
+    // Returns the total number of commands removed
+    size_t run(cc_list &cmds);
+
+    size_t removed(const std::string &name) const;
+    size_t iterations() const { return _iterations; }
+    const std::vector<peephole_rule> &rules() const { return _rules; }
+
+    void printStats() const;
+};
+
+// CPREG with the same source and target register
+size_t peepholeSelfCopy(cc_list &cmds);
+
+// MVTOREG_CONST of the slot the same register was just stored to with MVTOMEM_CONST
+size_t peepholeStoreLoad(cc_list &cmds);
+
+// LDCONST of a value the register is already known to hold within the same block
+size_t peepholeConstantReload(cc_list &cmds);
+
+// Jumps to a label that directly follows them
+size_t peepholeJumpToNext(cc_list &cmds);
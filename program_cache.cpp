@@ -0,0 +1,182 @@
+#include "program_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+
+namespace {
+
+    const char CACHE_MAGIC[4] = { 'S', 'W', 'M', 'C' };
+
+    // Magic, compiler version, key, required memory size, code size
+    const size_t CACHE_HEADER_SIZE = 4 + 4 + 8 + 8 + 8;
+
+    // Entries are stored little endian, independent of the host
+    void putValue(std::vector<vbyte> &out, uint64_t value, size_t bytes) {
+        for(size_t i = 0; i < bytes; i++)
+            out.push_back((vbyte)(value >> (i * 8)));
+    }
+
+    uint64_t getValue(const vbyte* in, size_t bytes) {
+        uint64_t value = 0;
+        for(size_t i = 0; i < bytes; i++)
+            value |= (uint64_t)in[i] << (i * 8);
+        return value;
+    }
+
+    bool writeAll(int fd, const vbyte* data, size_t size) {
+        while(size > 0) {
+            ssize_t written = write(fd, data, size);
+            if(written < 0) return false;
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    struct cache_entry {
+        std::string path;
+        size_t size;
+        time_t mtime;
+    };
+
+}
+
+program_cache::program_cache(const std::string &directory, size_t max_size)
+        : _directory(directory), _max_size(max_size) {
+    mkdir(_directory.c_str(), 0755);
+}
+
+std::string program_cache::path(uint64_t key) const {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    return _directory + "/" + name + SWM_CACHE_FILE_EXTENSION;
+}
+
+uint64_t program_cache::key(const stmt_list &stmts, const optimizer_settings &settings) {
+    uint64_t result = hashCombine(SWM_COMPILER_VERSION, abstract_statement::hash(stmts));
+    result = hashCombine(result, settings.program_width);
+    result = hashCombine(result, settings.max_register_count);
+    result = hashCombine(result, settings.relocatable);
+    result = hashCombine(result, settings.allocator);
+    result = hashCombine(result, settings.disabled_passes);
+    result = hashCombine(result, settings.unroll_factor);
+    return hashCombine(result, settings.unroll_budget);
+}
+
+bool program_cache::load(uint64_t key, ve_program &program) {
+    std::string file = path(key);
+    int fd = open(file.c_str(), O_RDONLY);
+    if(fd < 0) {
+        _misses++;
+        return false;
+    }
+
+    struct stat st;
+    bool valid = fstat(fd, &st) == 0 && (size_t)st.st_size >= CACHE_HEADER_SIZE;
+    void* map = valid ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if(map != MAP_FAILED) {
+        const vbyte* data = (const vbyte*)map;
+        size_t code_size = getValue(data + 24, 8);
+        valid = memcmp(data, CACHE_MAGIC, 4) == 0
+                && getValue(data + 4, 4) == SWM_COMPILER_VERSION
+                && getValue(data + 8, 8) == key
+                && code_size == (size_t)st.st_size - CACHE_HEADER_SIZE;
+        if(valid) {
+            std::vector<vbyte> code(data + CACHE_HEADER_SIZE, data + CACHE_HEADER_SIZE + code_size);
+            program = ve_program(std::move(code), getValue(data + 16, 8));
+        }
+        munmap(map, st.st_size);
+    } else valid = false;
+
+    if(!valid) {
+        DEBUG_PRINT("Discarding invalid Cache Entry " << file);
+        unlink(file.c_str());
+        _misses++;
+        return false;
+    }
+
+    // The modification time doubles as the last use for eviction
+    utime(file.c_str(), nullptr);
+    _hits++;
+    return true;
+}
+
+bool program_cache::store(uint64_t key, const ve_program &program) {
+    static std::atomic<size_t> temp_counter(0);
+
+    std::vector<vbyte> data;
+    data.reserve(CACHE_HEADER_SIZE + program._exec.size());
+    data.insert(data.end(), CACHE_MAGIC, CACHE_MAGIC + 4);
+    putValue(data, SWM_COMPILER_VERSION, 4);
+    putValue(data, key, 8);
+    putValue(data, program._required_memory_size, 8);
+    putValue(data, program._exec.size(), 8);
+    data.insert(data.end(), program._exec.begin(), program._exec.end());
+
+    // Unique per process and thread, so concurrent writers of the same key don't interfere
+    std::string file = path(key);
+    std::string temp = file + ".tmp." + std::to_string(getpid()) + "." + std::to_string(temp_counter++);
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(fd < 0) return false;
+    bool written = writeAll(fd, data.data(), data.size());
+    written = close(fd) == 0 && written;
+    if(!written || rename(temp.c_str(), file.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    evict();
+    return true;
+}
+
+void program_cache::evict() {
+    DIR* dir = opendir(_directory.c_str());
+    if(dir == nullptr) return;
+
+    std::vector<cache_entry> entries;
+    size_t total = 0;
+    const size_t ext_length = strlen(SWM_CACHE_FILE_EXTENSION);
+    while(dirent* ent = readdir(dir)) {
+        size_t length = strlen(ent->d_name);
+        if(length <= ext_length || strcmp(ent->d_name + length - ext_length, SWM_CACHE_FILE_EXTENSION) != 0) continue;
+        std::string file = _directory + "/" + ent->d_name;
+        struct stat st;
+        if(stat(file.c_str(), &st) != 0) continue;
+        entries.push_back({ file, (size_t)st.st_size, st.st_mtime });
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    if(total <= _max_size) return;
+
+    std::sort(entries.begin(), entries.end(), [](const cache_entry &a, const cache_entry &b) {
+        return a.mtime < b.mtime;
+    });
+    for(const cache_entry &entry : entries) {
+        if(total <= _max_size) break;
+        DEBUG_PRINT("Evicting Cache Entry " << entry.path);
+        if(unlink(entry.path.c_str()) == 0) total -= entry.size;
+    }
+}
+
+ve_program program_cache::compile(const stmt_list &stmts, optimizer_settings &settings, id_map &ids) {
+    uint64_t cache_key = key(stmts, settings);
+    ve_program program;
+    if(load(cache_key, program)) return program;
+
+    size_t req_mem_size;
+    cc_list cmds = compileOptimizeList(stmts, settings, ids, &req_mem_size);
+    program = compileCommandList(cmds, req_mem_size);
+    store(cache_key, program);
+    return program;
+}
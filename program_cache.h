@@ -0,0 +1,40 @@
+#pragma once
+
+#include "optimizer.h"
+
+#include <string>
+
+#define SWM_CACHE_FILE_EXTENSION ".swmc"
+
+// Compiled programs stored in a directory shared between processes, one file per key. Files are written to a
+// temporary name and renamed into place, so readers only ever see complete entries; the least recently used
+// entries are removed once the directory grows past max_size bytes.
+class program_cache {
+protected:
+    std::string _directory;
+    size_t _max_size;
+    size_t _hits = 0;
+    size_t _misses = 0;
+
+    std::string path(uint64_t key) const;
+
+public:
+    program_cache(const std::string &directory, size_t max_size);
+
+    // Covers the AST, the settings that affect the bytecode and the compiler version
+    static uint64_t key(const stmt_list &stmts, const optimizer_settings &settings);
+
+    // Returns false if there is no valid entry for the key
+    bool load(uint64_t key, ve_program &program);
+    // Returns false if the entry couldn't be written; the cache is left as it was
+    bool store(uint64_t key, const ve_program &program);
+
+    // Removes the least recently used entries until the cache fits into max_size
+    void evict();
+
+    // Loads the program from the cache, running the optimizer and storing the result on a miss
+    ve_program compile(const stmt_list &stmts, optimizer_settings &settings, id_map &ids);
+
+    size_t hits() const { return _hits; }
+    size_t misses() const { return _misses; }
+};
@@ -22,9 +22,7 @@ typedef uint8_t     vbyte;
 typedef int64_t     retcode;
 
 struct compiler_command;
-typedef std::list<compiler_command*> cc_list;
-typedef std::list<compiler_command*>::iterator cc_iter;
-typedef std::list<compiler_command*>::const_iterator cc_const_iter;
+class cc_list; // Defined in compiler.h along with cc_iter and cc_const_iter
 
 struct abstract_statement;
 typedef std::list<abstract_statement*> stmt_list;
@@ -172,6 +170,22 @@ struct VariableValue {
             default: return 0;
         }
     }
+
+    // Smallest width that gives back the value with get(); used for constant values
+    static BitWidth minimalWidth(int64_t value) {
+        if(value >= INT8_MIN  && value <= INT8_MAX)  return BIT_8;
+        if(value >= INT16_MIN && value <= INT16_MAX) return BIT_16;
+        if(value >= INT32_MIN && value <= INT32_MAX) return BIT_32;
+        return BIT_64;
+    }
+
+    // Smallest width that gives back the value with getu(); used for constant addresses
+    static BitWidth minimalWidthUnsigned(uint64_t value) {
+        if(value <= UINT8_MAX)  return BIT_8;
+        if(value <= UINT16_MAX) return BIT_16;
+        if(value <= UINT32_MAX) return BIT_32;
+        return BIT_64;
+    }
 };
 
 struct vvariable {
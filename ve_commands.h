@@ -23,6 +23,10 @@
 #define SWM_RET_UNEXPECTED_END      -8
 #define SWM_RET_UNKNOWN_COMMAND     -2
 #define SWM_RET_JUMP_OUT_OF_RANGE   -16
+#define SWM_RET_OUT_OF_MEMORY       -32
+#define SWM_RET_INVALID_FREE        -64
+#define SWM_RET_STACK_OVERFLOW      -128
+#define SWM_RET_STACK_UNDERFLOW     -256
 
 
 // COMMAND : No Operation [NOP] : 00000000
@@ -39,11 +43,58 @@
 #define CMD_HALT                0b10000001
 
 
+// COMMAND : Allocate [ALLOC] : 10000100
+/* DESCRIPTION:
+ *   Allocates a chunk of memory from the environment's memory for the running program.
+ *   Register holding the size in bytes of the chunk is specified by the next byte in sequence.
+ *   Register to put the address of the chunk in is specified by the second byte in sequence.
+ *   The address can be used by any of the memory commands, and lies past the program's fixed heap. The chunk starts
+ *   out zeroed. If no memory is left, the program stops with SWM_RET_OUT_OF_MEMORY. Chunks not freed by the program
+ *   are freed when it ends.
+ */
+#define CMD_ALLOC               0b10000100
+
+
+// COMMAND : Free [FREE] : 10000101
+/* DESCRIPTION:
+ *   Frees a chunk of memory previously allocated with ALLOC.
+ *   Register holding the address of the chunk is specified by the next byte in sequence.
+ *   If the address is not the start of a chunk owned by the program, it stops with SWM_RET_INVALID_FREE.
+ */
+#define CMD_FREE                0b10000101
+
+
+// COMMAND : Call [CALL] : 10010abb
+/* DESCRIPTION:
+ *   Pushes the location of the next command onto the stack as 8 bytes, advancing the stack register past it, and
+ *   modifies the program counter according to a jump distance as JMP does. Counterpart to RET.
+ *   If the stack has no room left, the program stops with SWM_RET_STACK_OVERFLOW.
+ *   [a] Relative flag. If this flag is set, the jump distance is relative to the current counter location, and can
+ *     be negative. If it is not set, the jump distance is treated as unsigned.
+ *   [bb] Represents the byte width of the jump distance:
+ *     00: 1 byte
+ *     01: 2 byte
+ *     10: 4 byte
+ *     11: 8 byte
+ */
+#define CMD_CALL                0b10010000
+
+
+// COMMAND : Return [RET] : 10000010
+/* DESCRIPTION:
+ *   Pops the location pushed by the matching CALL off the stack and continues from there. Counterpart to CALL.
+ *   If the stack holds less than a location, the program stops with SWM_RET_STACK_UNDERFLOW.
+ */
+#define CMD_RET                 0b10000010
+
+
 // COMMAND : Move to Register [MVTOREG] : 110000aa
 /* DESCRIPTION:
  *   Moves data from memory to a register. Counterpart to MVTOMEM.
  *   Register to move to is specified by next byte in sequence.
  *   Address in memory to move from is specified another register, which is specified by the second byte in sequence.
+ *   If that is the stack register and the data doesn't fit within the stack, the program stops with
+ *   SWM_RET_STACK_OVERFLOW.
  *   [aa] represents the byte width of the data to move:
  *     00: 1 byte
  *     01: 2 byte
@@ -73,6 +124,8 @@
  *   Moves data from a register to memory. Counterpart to MVTOREG.
  *   Register to move from is specified by next byte in sequence.
  *   Address in memory to move to is specified another register, which is specified by the second byte in sequence.
+ *   If that is the stack register and the data doesn't fit within the stack, the program stops with
+ *   SWM_RET_STACK_OVERFLOW.
  *   [aa] represents the byte width of the data to move:
  *     00: 1 byte
  *     01: 2 byte
@@ -325,6 +378,157 @@
  */
 #define CMD_ALU_DEC_MV          0b01010111
 
+// COMMAND : ALU Bitwise And [ALU_AND] : 01001000
+/* DESCRIPTION:
+ *   Performs a bitwise and on two registers, and puts the output in a third.
+ *   Registers to combine are specified by the next two bytes, and register to output to is specified by the third.
+ */
+#define CMD_ALU_AND             0b01001000
+
+
+// COMMAND : ALU Bitwise Or [ALU_OR] : 01001001
+/* DESCRIPTION:
+ *   Performs a bitwise or on two registers, and puts the output in a third.
+ *   Registers to combine are specified by the next two bytes, and register to output to is specified by the third.
+ */
+#define CMD_ALU_OR              0b01001001
+
+
+// COMMAND : ALU Bitwise Exclusive Or [ALU_XOR] : 01001010
+/* DESCRIPTION:
+ *   Performs a bitwise exclusive or on two registers, and puts the output in a third.
+ *   Registers to combine are specified by the next two bytes, and register to output to is specified by the third.
+ */
+#define CMD_ALU_XOR             0b01001010
+
+
+// COMMAND : ALU Shift Left [ALU_SHL] : 01001011
+/* DESCRIPTION:
+ *   Shifts the first register left by the amount in the second, and puts the output in a third.
+ *   Registers to shift are specified by the next two bytes, and register to output to is specified by the third.
+ *   The amount is treated as unsigned. Shifting by 64 or more clears the register.
+ */
+#define CMD_ALU_SHL             0b01001011
+
+
+// COMMAND : ALU Logical Shift Right [ALU_SHR] : 01001100
+/* DESCRIPTION:
+ *   Shifts the first register right by the amount in the second, filling with zeros, and puts the output in a third.
+ *   Registers to shift are specified by the next two bytes, and register to output to is specified by the third.
+ *   The value is treated as unsigned at the width of the register. Shifting by 64 or more clears the register.
+ */
+#define CMD_ALU_SHR             0b01001100
+
+
+// COMMAND : ALU Arithmetic Shift Right [ALU_SAR] : 01001101
+/* DESCRIPTION:
+ *   Shifts the first register right by the amount in the second, filling with the sign bit, and puts the output in a
+ *   third.
+ *   Registers to shift are specified by the next two bytes, and register to output to is specified by the third.
+ *   The amount is treated as unsigned. Shifting by 64 or more fills the register with the sign bit.
+ */
+#define CMD_ALU_SAR             0b01001101
+
+
+// COMMAND : ALU Bitwise Not [ALU_NOT] : 01001110
+/* DESCRIPTION:
+ *   Flips every bit of a register. Operation happens in place.
+ *   Register to flip is specified by the next byte in sequence.
+ */
+#define CMD_ALU_NOT             0b01001110
+
+
+// COMMAND : ALU Move Bitwise Not [ALU_NOT_MV] : 01011110
+/* DESCRIPTION:
+ *   Flips every bit of a register, and outputs to another register.
+ *   Register to flip and register to output to are specified by the next two bytes in sequence.
+ */
+#define CMD_ALU_NOT_MV          0b01011110
+
+
+// COMMAND : ALU Constant Bitwise And [ALU_AND_CONST] : 101000aa
+/* DESCRIPTION:
+ *   Performs a bitwise and on a register and a constant, and outputs to another register.
+ *   Register to combine and register to output to are specified by the next two bytes.
+ *   Constant number is specified by the following 1-8 bytes in sequence after the first two.
+ *   [aa] represents the byte width of the constant:
+ *     00: 1 byte
+ *     01: 2 byte
+ *     10: 4 byte
+ *     11: 8 byte
+ */
+#define CMD_ALU_AND_CONST       0b10100000
+
+
+// COMMAND : ALU Constant Bitwise Or [ALU_OR_CONST] : 101001aa
+/* DESCRIPTION:
+ *   Performs a bitwise or on a register and a constant, and outputs to another register.
+ *   Register to combine and register to output to are specified by the next two bytes.
+ *   Constant number is specified by the following 1-8 bytes in sequence after the first two.
+ *   [aa] represents the byte width of the constant:
+ *     00: 1 byte
+ *     01: 2 byte
+ *     10: 4 byte
+ *     11: 8 byte
+ */
+#define CMD_ALU_OR_CONST        0b10100100
+
+
+// COMMAND : ALU Constant Bitwise Exclusive Or [ALU_XOR_CONST] : 101010aa
+/* DESCRIPTION:
+ *   Performs a bitwise exclusive or on a register and a constant, and outputs to another register.
+ *   Register to combine and register to output to are specified by the next two bytes.
+ *   Constant number is specified by the following 1-8 bytes in sequence after the first two.
+ *   [aa] represents the byte width of the constant:
+ *     00: 1 byte
+ *     01: 2 byte
+ *     10: 4 byte
+ *     11: 8 byte
+ */
+#define CMD_ALU_XOR_CONST       0b10101000
+
+
+// COMMAND : ALU Constant Shift Left [ALU_SHL_CONST] : 101011aa
+/* DESCRIPTION:
+ *   Shifts a register left by a constant amount, and outputs to another register.
+ *   Register to shift and register to output to are specified by the next two bytes.
+ *   Constant amount is specified by the following 1-8 bytes in sequence after the first two.
+ *   [aa] represents the byte width of the constant:
+ *     00: 1 byte
+ *     01: 2 byte
+ *     10: 4 byte
+ *     11: 8 byte
+ */
+#define CMD_ALU_SHL_CONST       0b10101100
+
+
+// COMMAND : ALU Constant Logical Shift Right [ALU_SHR_CONST] : 101100aa
+/* DESCRIPTION:
+ *   Shifts a register right by a constant amount, filling with zeros, and outputs to another register.
+ *   Register to shift and register to output to are specified by the next two bytes.
+ *   Constant amount is specified by the following 1-8 bytes in sequence after the first two.
+ *   [aa] represents the byte width of the constant:
+ *     00: 1 byte
+ *     01: 2 byte
+ *     10: 4 byte
+ *     11: 8 byte
+ */
+#define CMD_ALU_SHR_CONST       0b10110000
+
+
+// COMMAND : ALU Constant Arithmetic Shift Right [ALU_SAR_CONST] : 101101aa
+/* DESCRIPTION:
+ *   Shifts a register right by a constant amount, filling with the sign bit, and outputs to another register.
+ *   Register to shift and register to output to are specified by the next two bytes.
+ *   Constant amount is specified by the following 1-8 bytes in sequence after the first two.
+ *   [aa] represents the byte width of the constant:
+ *     00: 1 byte
+ *     01: 2 byte
+ *     10: 4 byte
+ *     11: 8 byte
+ */
+#define CMD_ALU_SAR_CONST       0b10110100
+
 
 // COMMAND : Jump Always [JMP] : 00100abb
 /* DESCRIPTION:
@@ -2,6 +2,83 @@
 
 #include "ve_commands.h"
 
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+    // Shifting the host by 64 or more is undefined, so the amount saturates
+    int64_t shiftLeft(int64_t value, uint64_t amount) {
+        return amount >= 64 ? 0 : (int64_t)((uint64_t)value << amount);
+    }
+
+    int64_t shiftRight(uint64_t value, uint64_t amount) {
+        return amount >= 64 ? 0 : (int64_t)(value >> amount);
+    }
+
+    int64_t shiftArithmetic(int64_t value, uint64_t amount) {
+        return value >> (amount >= 64 ? 63 : amount);
+    }
+
+    // Return locations are kept on the stack at 8 bytes, so the whole counter fits; most significant byte first
+    const size_t CALL_LOCATION_SIZE = 8;
+
+    void putLocation(vbyte* mem, uint64_t location) {
+        for(size_t i = 0; i < CALL_LOCATION_SIZE; i++)
+            mem[i] = (vbyte)(location >> ((CALL_LOCATION_SIZE - 1 - i) * 8));
+    }
+
+    uint64_t getLocation(const vbyte* mem) {
+        uint64_t location = 0;
+        for(size_t i = 0; i < CALL_LOCATION_SIZE; i++)
+            location = (location << 8) | mem[i];
+        return location;
+    }
+
+}
+
+size_t ve_memory::pageSize() {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (size_t)info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+vbyte* ve_memory::reserveRegion(size_t size) {
+#if defined(_WIN32)
+    return (vbyte*)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void* region = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return region == MAP_FAILED ? nullptr : (vbyte*)region;
+#endif
+}
+
+// Committed pages read as zero and only become resident once touched
+bool ve_memory::commitRegion(vbyte* begin, size_t size) {
+#if defined(_WIN32)
+    return VirtualAlloc(begin, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(begin, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+void ve_memory::releaseRegion(vbyte* region, size_t size) {
+#if defined(_WIN32)
+    VirtualFree(region, 0, MEM_RELEASE);
+#else
+    munmap(region, size);
+#endif
+}
+
 retcode virtual_environment::run() {
     retcode rc = _program.run(*this);
     return rc;
@@ -16,20 +93,53 @@ ve_register &ve_program::getRegister(virtual_environment &ve, vbyte id) {
 }
 
 retcode ve_program::run(virtual_environment &ve) {
-    size_t stack_begin, stack_end;
-    vbyte* stack_mem = ve.getMemory().allocMemChunk( ve.getStackSizeInBytes(), &stack_begin, &stack_end );
-    size_t heap_begin, heap_end;
-    vbyte* heap_mem = ve.getMemory().allocMemChunk( _required_memory_size, &heap_begin, &heap_end );
+    size_t stack_begin = 0, stack_end = 0;
+    vbyte* stack_mem = nullptr;
+    if(ve.getStackSizeInBytes() > 0) {
+        stack_mem = ve.getMemory().allocMemChunk( ve.getStackSizeInBytes(), &stack_begin, &stack_end );
+        if(stack_mem == nullptr) return SWM_RET_OUT_OF_MEMORY;
+    }
+    size_t heap_begin = 0, heap_end = 0;
+    vbyte* heap_mem = nullptr;
+    if(_required_memory_size > 0) {
+        heap_mem = ve.getMemory().allocMemChunk( _required_memory_size, &heap_begin, &heap_end );
+        if(heap_mem == nullptr) {
+            if(stack_mem != nullptr) ve.getMemory().freeMemChunk(stack_begin, stack_end);
+            return SWM_RET_OUT_OF_MEMORY;
+        }
+    }
     retcode rc = run( ve, stack_mem, heap_mem, ve.getStackSizeInBytes() );
-    ve.getMemory().freeMemChunk(stack_begin, stack_end);
-    ve.getMemory().freeMemChunk(heap_begin, heap_end);
+    freeDynamicChunks(ve);
+    if(stack_mem != nullptr) ve.getMemory().freeMemChunk(stack_begin, stack_end);
+    if(heap_mem != nullptr) ve.getMemory().freeMemChunk(heap_begin, heap_end);
     return rc;
 }
 
+void ve_program::resolveDynamicAddress(virtual_environment &ve, vbyte* &mem, size_t &mem_pos, size_t &max_size) {
+    size_t abs_pos = mem_pos - _required_memory_size;
+    std::map<size_t, size_t>::iterator it = _dynamic_chunks.upper_bound(abs_pos);
+    if(it == _dynamic_chunks.begin() || (--it)->second < abs_pos) {
+        // Not owned by this program; reads give 0 and writes are dropped, as with any other out of range address
+        mem = nullptr;
+        max_size = 0;
+        return;
+    }
+    mem = &ve.getMemory()._data[it->first];
+    mem_pos = abs_pos - it->first;
+    max_size = it->second - it->first + 1;
+}
+
+void ve_program::freeDynamicChunks(virtual_environment &ve) {
+    for(std::pair<const size_t, size_t> &chunk : _dynamic_chunks)
+        ve.getMemory().freeMemChunk(chunk.first, chunk.second);
+    _dynamic_chunks.clear();
+}
+
 retcode ve_program::run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_mem, size_t stack_size) {
-    if(_exec == nullptr) return SWM_RET_UNEXPECTED_END;
+    if(_exec.empty()) return SWM_RET_UNEXPECTED_END;
 
-    _counter._data = 0;
+    // The counter must be able to address the whole program, whatever the environment's width
+    _counter = ve_register(BIT_64);
     _stack = ve_register(ve.getMaxByteWidth());
 
     DEBUG_PRINT("Running");
@@ -48,6 +158,149 @@ retcode ve_program::run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_m
         // [HALT]
         if(cmd == CMD_HALT) return SWM_RET_HALTED;
 
+        // Bitwise Constant Commands
+        if((cmd & 0b11100000) == 0b10100000) {
+            // Get Width of Constant from the command
+            BitWidth width;
+            switch(cmd & 0b00000011) {
+                default:
+                case 0b00: width = BIT_8; break;
+                case 0b01: width = BIT_16; break;
+                case 0b10: width = BIT_32; break;
+                case 0b11: width = BIT_64; break;
+            }
+
+            // Check for EOF
+            if (_size - _counter < (2+width)) return SWM_RET_UNEXPECTED_END;
+
+            // Get Registers
+            ve_register &reg_in  = getRegister(ve, _exec[++_counter]);
+            ve_register &reg_out = getRegister(ve, _exec[++_counter]);
+
+            // Get Constant Value
+            vbyte byte_in[width];
+            for(vbyte i = 0; i < width; i++) byte_in[i] = _exec[++_counter];
+            VariableValue const_val(byte_in, width);
+
+            DEBUG_PRINT("A=" << reg_in._data.get() << ", B=" << const_val.get());
+
+            // Perform Operation
+            switch(cmd & 0b00011100) {
+                case 0b00000: // [AND_CONST]
+                    DEBUG_PRINT("ALU_AND_CONST");
+                    reg_out._data = reg_in._data.get() & const_val.get();
+                    break;
+                case 0b00100: // [OR_CONST]
+                    DEBUG_PRINT("ALU_OR_CONST");
+                    reg_out._data = reg_in._data.get() | const_val.get();
+                    break;
+                case 0b01000: // [XOR_CONST]
+                    DEBUG_PRINT("ALU_XOR_CONST");
+                    reg_out._data = reg_in._data.get() ^ const_val.get();
+                    break;
+                case 0b01100: // [SHL_CONST]
+                    DEBUG_PRINT("ALU_SHL_CONST");
+                    reg_out._data = shiftLeft(reg_in._data.get(), const_val.getu());
+                    break;
+                case 0b10000: // [SHR_CONST]
+                    DEBUG_PRINT("ALU_SHR_CONST");
+                    reg_out._data = shiftRight(reg_in._data.getu(), const_val.getu());
+                    break;
+                case 0b10100: // [SAR_CONST]
+                    DEBUG_PRINT("ALU_SAR_CONST");
+                    reg_out._data = shiftArithmetic(reg_in._data.get(), const_val.getu());
+                    break;
+                default: return SWM_RET_UNKNOWN_COMMAND;
+            }
+
+            DEBUG_PRINT("Result=" << reg_out._data.get());
+            _counter++;
+            continue;
+        }
+
+        // [CALL]
+        if((cmd & 0b11111000) == CMD_CALL) {
+            BitWidth width;
+            switch(cmd & 0b00000011) {
+                default:
+                case 0b00: width = BIT_8; break;
+                case 0b01: width = BIT_16; break;
+                case 0b10: width = BIT_32; break;
+                case 0b11: width = BIT_64; break;
+            }
+
+            DEBUG_PRINT("CALL");
+            if (_size - _counter < width) return SWM_RET_UNEXPECTED_END;
+            vbyte loc_data[width];
+            for(vbyte i = 0; i < width; i++) loc_data[i] = _exec[++_counter];
+            VariableValue loc_val(loc_data, width);
+            uint64_t location;
+            if(cmd & CMD_JUMP_RELATIVE) {
+                int64_t relative = loc_val.get();
+                if(_counter + relative < 0) return SWM_RET_JUMP_OUT_OF_RANGE;
+                location = _counter + relative;
+            } else location = loc_val.getu();
+            DEBUG_PRINT("Call Address: " << location);
+            if(location >= _size) return SWM_RET_JUMP_OUT_OF_RANGE;
+
+            size_t stack_pos = _stack._data.getu();
+            if(stack_mem == nullptr || stack_pos > stack_size || stack_size - stack_pos < CALL_LOCATION_SIZE)
+                return SWM_RET_STACK_OVERFLOW;
+            putLocation(&stack_mem[stack_pos], _counter + 1);
+            _stack._data = (int64_t)(stack_pos + CALL_LOCATION_SIZE);
+            _counter = location;
+            continue;
+        }
+
+        // System Commands
+        if((cmd & 0b11000000) == 0b10000000) {
+            switch(cmd) {
+                case CMD_RET: {
+                    DEBUG_PRINT("RET");
+                    size_t stack_pos = _stack._data.getu();
+                    if(stack_mem == nullptr || stack_pos > stack_size || stack_pos < CALL_LOCATION_SIZE)
+                        return SWM_RET_STACK_UNDERFLOW;
+                    stack_pos -= CALL_LOCATION_SIZE;
+                    uint64_t location = getLocation(&stack_mem[stack_pos]);
+                    _stack._data = (int64_t)stack_pos;
+                    DEBUG_PRINT("Return Address: " << location);
+                    // Returning past the last command ends the program, as running off its end does
+                    if(location > _size) return SWM_RET_JUMP_OUT_OF_RANGE;
+                    _counter = location;
+                } continue;
+                case CMD_ALLOC: {
+                    DEBUG_PRINT("ALLOC");
+                    if (_size - _counter < 3) return SWM_RET_UNEXPECTED_END;
+                    ve_register &reg_size = getRegister(ve, _exec[++_counter]);
+                    ve_register &reg_out  = getRegister(ve, _exec[++_counter]);
+                    size_t size = reg_size._data.getu();
+                    if(size == 0) size = 1;
+                    size_t begin, end;
+                    vbyte* chunk = ve.getMemory().allocMemChunk(size, &begin, &end);
+                    if(chunk == nullptr) return SWM_RET_OUT_OF_MEMORY;
+                    // Freed chunks keep their contents, which may come from another program sharing the memory
+                    std::fill(chunk, chunk + (end - begin + 1), (vbyte)0);
+                    _dynamic_chunks[begin] = end;
+                    reg_out._data = (int64_t)(_required_memory_size + begin);
+                    DEBUG_PRINT("Size=" << size << ", Address=" << reg_out._data.getu());
+                } break;
+                case CMD_FREE: {
+                    DEBUG_PRINT("FREE");
+                    if (_size - _counter < 2) return SWM_RET_UNEXPECTED_END;
+                    ve_register &reg_addr = getRegister(ve, _exec[++_counter]);
+                    size_t address = reg_addr._data.getu();
+                    if(address < _required_memory_size) return SWM_RET_INVALID_FREE;
+                    std::map<size_t, size_t>::iterator it = _dynamic_chunks.find(address - _required_memory_size);
+                    if(it == _dynamic_chunks.end()) return SWM_RET_INVALID_FREE;
+                    ve.getMemory().freeMemChunk(it->first, it->second);
+                    _dynamic_chunks.erase(it);
+                } break;
+                default: return SWM_RET_UNKNOWN_COMMAND;
+            }
+            _counter++;
+            continue;
+        }
+
         // Register Commands
         if((cmd & 0b11000000) == 0b11000000) {
             switch(cmd & 0b00110000) {
@@ -134,9 +387,9 @@ retcode ve_program::run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_m
                     vbyte* mem;
                     size_t max_size;
                     if(flag_const) {
-                        vbyte byte_in[width];
+                        vbyte byte_in[width_const];
                         for(vbyte i = 0; i < width_const; i++) byte_in[i] = _exec[++_counter];
-                        mem_pos = VariableValue(byte_in, width).getu();
+                        mem_pos = VariableValue(byte_in, width_const).getu();
                         mem = heap_mem;
                         max_size = _required_memory_size;
                         //mem = ve.getMemory()._data;
@@ -145,8 +398,13 @@ retcode ve_program::run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_m
                         ve_register &reg_pos = getRegister(ve, _exec[++_counter]);
                         mem_pos = reg_pos._data.getu();
                         if(&reg_pos == &_stack) {
+                            // Saved registers would be lost silently, so leaving the stack ends the program
+                            if(stack_mem == nullptr || mem_pos > stack_size || stack_size - mem_pos < width)
+                                return SWM_RET_STACK_OVERFLOW;
                             mem = stack_mem;
                             max_size = stack_size;
+                        } else if(mem_pos >= _required_memory_size && !_dynamic_chunks.empty()) {
+                            resolveDynamicAddress(ve, mem, mem_pos, max_size);
                         } else {
                             mem = heap_mem;
                             max_size = _required_memory_size;
@@ -200,9 +458,9 @@ retcode ve_program::run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_m
                     vbyte* mem;
                     size_t max_size;
                     if(flag_const) {
-                        vbyte byte_in[width];
+                        vbyte byte_in[width_const];
                         for(vbyte i = 0; i < width_const; i++) byte_in[i] = _exec[++_counter];
-                        mem_pos = VariableValue(byte_in, width).getu();
+                        mem_pos = VariableValue(byte_in, width_const).getu();
                         mem = heap_mem;
                         max_size = _required_memory_size;
                         //mem = ve.getMemory()._data;
@@ -211,8 +469,13 @@ retcode ve_program::run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_m
                         ve_register &reg_pos = getRegister(ve, _exec[++_counter]);
                         mem_pos = reg_pos._data.getu();
                         if(&reg_pos == &_stack) {
+                            // Saved registers would be lost silently, so leaving the stack ends the program
+                            if(stack_mem == nullptr || mem_pos > stack_size || stack_size - mem_pos < width)
+                                return SWM_RET_STACK_OVERFLOW;
                             mem = stack_mem;
                             max_size = stack_size;
+                        } else if(mem_pos >= _required_memory_size && !_dynamic_chunks.empty()) {
+                            resolveDynamicAddress(ve, mem, mem_pos, max_size);
                         } else {
                             mem = heap_mem;
                             max_size = _required_memory_size;
@@ -328,6 +591,73 @@ retcode ve_program::run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_m
                             reg._data = reg._data.get() - 1;
                             DEBUG_PRINT("Result=" << reg._data.get());
                         } break;
+                        case 0b1000: { // [AND]
+                            DEBUG_PRINT("ALU_AND");
+                            if (_size - _counter < 3) return SWM_RET_UNEXPECTED_END;
+                            ve_register &reg_in_1 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_in_2 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_out  = getRegister(ve, _exec[++_counter]);
+                            DEBUG_PRINT("A=" << reg_in_1._data.get() << ", B=" << reg_in_2._data.get());
+                            reg_out._data = reg_in_1._data.get() & reg_in_2._data.get();
+                            DEBUG_PRINT("C=" << reg_out._data.get());
+                        } break;
+                        case 0b1001: { // [OR]
+                            DEBUG_PRINT("ALU_OR");
+                            if (_size - _counter < 3) return SWM_RET_UNEXPECTED_END;
+                            ve_register &reg_in_1 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_in_2 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_out  = getRegister(ve, _exec[++_counter]);
+                            DEBUG_PRINT("A=" << reg_in_1._data.get() << ", B=" << reg_in_2._data.get());
+                            reg_out._data = reg_in_1._data.get() | reg_in_2._data.get();
+                            DEBUG_PRINT("C=" << reg_out._data.get());
+                        } break;
+                        case 0b1010: { // [XOR]
+                            DEBUG_PRINT("ALU_XOR");
+                            if (_size - _counter < 3) return SWM_RET_UNEXPECTED_END;
+                            ve_register &reg_in_1 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_in_2 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_out  = getRegister(ve, _exec[++_counter]);
+                            DEBUG_PRINT("A=" << reg_in_1._data.get() << ", B=" << reg_in_2._data.get());
+                            reg_out._data = reg_in_1._data.get() ^ reg_in_2._data.get();
+                            DEBUG_PRINT("C=" << reg_out._data.get());
+                        } break;
+                        case 0b1011: { // [SHL]
+                            DEBUG_PRINT("ALU_SHL");
+                            if (_size - _counter < 3) return SWM_RET_UNEXPECTED_END;
+                            ve_register &reg_in_1 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_in_2 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_out  = getRegister(ve, _exec[++_counter]);
+                            DEBUG_PRINT("A=" << reg_in_1._data.get() << ", B=" << reg_in_2._data.get());
+                            reg_out._data = shiftLeft(reg_in_1._data.get(), reg_in_2._data.getu());
+                            DEBUG_PRINT("C=" << reg_out._data.get());
+                        } break;
+                        case 0b1100: { // [SHR]
+                            DEBUG_PRINT("ALU_SHR");
+                            if (_size - _counter < 3) return SWM_RET_UNEXPECTED_END;
+                            ve_register &reg_in_1 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_in_2 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_out  = getRegister(ve, _exec[++_counter]);
+                            DEBUG_PRINT("A=" << reg_in_1._data.get() << ", B=" << reg_in_2._data.get());
+                            reg_out._data = shiftRight(reg_in_1._data.getu(), reg_in_2._data.getu());
+                            DEBUG_PRINT("C=" << reg_out._data.get());
+                        } break;
+                        case 0b1101: { // [SAR]
+                            DEBUG_PRINT("ALU_SAR");
+                            if (_size - _counter < 3) return SWM_RET_UNEXPECTED_END;
+                            ve_register &reg_in_1 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_in_2 = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_out  = getRegister(ve, _exec[++_counter]);
+                            DEBUG_PRINT("A=" << reg_in_1._data.get() << ", B=" << reg_in_2._data.get());
+                            reg_out._data = shiftArithmetic(reg_in_1._data.get(), reg_in_2._data.getu());
+                            DEBUG_PRINT("C=" << reg_out._data.get());
+                        } break;
+                        case 0b1110: { // [NOT]
+                            DEBUG_PRINT("ALU_NOT");
+                            if (_size - _counter < 1) return SWM_RET_UNEXPECTED_END;
+                            ve_register &reg = getRegister(ve, _exec[++_counter]);
+                            reg._data = ~reg._data.get();
+                            DEBUG_PRINT("Result=" << reg._data.get());
+                        } break;
                         default: return SWM_RET_UNKNOWN_COMMAND;
                     }
                 } break;
@@ -357,6 +687,14 @@ retcode ve_program::run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_m
                             reg_out._data = reg_in._data.get() - 1;
                             DEBUG_PRINT("Result=" << reg_out._data.get());
                         } break;
+                        case 0b1110: { // [NOT_MV]
+                            DEBUG_PRINT("ALU_NOT_MV");
+                            if (_size - _counter < 2) return SWM_RET_UNEXPECTED_END;
+                            ve_register &reg_in  = getRegister(ve, _exec[++_counter]);
+                            ve_register &reg_out = getRegister(ve, _exec[++_counter]);
+                            reg_out._data = ~reg_in._data.get();
+                            DEBUG_PRINT("Result=" << reg_out._data.get());
+                        } break;
                         default: return SWM_RET_UNKNOWN_COMMAND;
                     }
                 } break;
@@ -567,9 +905,10 @@ void virtual_environment::printRegisters() {
 
 void virtual_environment::printMemory() {
     std::cout << "Memory:" << std::endl;
-    for(size_t i = 0; i < _memory._size_in_bytes;) {
+    ve_memory &memory = getMemory();
+    for(size_t i = 0; i < memory._size_in_bytes;) {
         for(int j = 0; j < 8; j++)
-            if(i < _memory._size_in_bytes) std::cout << std::bitset<8>(_memory._data[i++]).to_string() << "   ";
+            if(i < memory._size_in_bytes) std::cout << std::bitset<8>(memory._data[i++]).to_string() << "   ";
         std::cout << std::endl;
     }
 }
\ No newline at end of file
@@ -2,17 +2,25 @@
 
 #include "types.h"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
 #include <math.h>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 
 class EnvironmentException : public std::runtime_error {
 public:
     enum Type {
         SIZE_INVALID,
-        OUT_OF_RANGE
+        OUT_OF_RANGE,
+        OUT_OF_MEMORY
     };
 
     Type type() { return _type; }
@@ -27,6 +35,10 @@ public:
                                     + std::to_string(begin) + "-" + std::to_string(end)
                                     + "] for Memory of size " + std::to_string(size_in_bytes));
     }
+    static EnvironmentException MemoryReserveFailed(size_t size_in_bytes) {
+        return EnvironmentException(OUT_OF_MEMORY,
+                                    "Could not reserve or commit " + std::to_string(size_in_bytes) + " bytes of Memory");
+    }
 
 protected:
     EnvironmentException(Type type, const std::string &msg) : _type(type), runtime_error(msg) {}
@@ -34,8 +46,79 @@ protected:
 };
 
 
+// Every field is atomic so the stats can be read at any time without taking the memory's locks
+struct ve_memory_stats {
+    static const size_t HISTOGRAM_BUCKETS = 16;
+
+    std::atomic<size_t> bytes_committed;
+    std::atomic<size_t> bytes_in_use;
+    std::atomic<size_t> bytes_free;
+    std::atomic<size_t> bytes_cached; // Freed, but held in a thread cache; counted as in use
+    std::atomic<size_t> largest_free_block;
+    std::atomic<size_t> hole_count;
+    std::atomic<size_t> alloc_count;
+    std::atomic<size_t> free_count;
+    std::atomic<size_t> failed_alloc_count;
+
+    // Bucket N counts requests of size [2^N, 2^(N+1)); the last bucket also holds everything larger
+    std::atomic<size_t> request_histogram[HISTOGRAM_BUCKETS];
+
+    ve_memory_stats() {
+        bytes_committed = 0;
+        bytes_in_use = 0;
+        bytes_free = 0;
+        bytes_cached = 0;
+        largest_free_block = 0;
+        hole_count = 0;
+        alloc_count = 0;
+        free_count = 0;
+        failed_alloc_count = 0;
+        for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++) request_histogram[i] = 0;
+    }
+
+    ve_memory_stats(const ve_memory_stats &rhs) {
+        *this = rhs;
+    }
+
+    // Takes a snapshot; fields are loaded one at a time, so a snapshot taken mid-update may be slightly skewed
+    ve_memory_stats &operator=(const ve_memory_stats &rhs) {
+        bytes_committed = rhs.bytes_committed.load();
+        bytes_in_use = rhs.bytes_in_use.load();
+        bytes_free = rhs.bytes_free.load();
+        bytes_cached = rhs.bytes_cached.load();
+        largest_free_block = rhs.largest_free_block.load();
+        hole_count = rhs.hole_count.load();
+        alloc_count = rhs.alloc_count.load();
+        free_count = rhs.free_count.load();
+        failed_alloc_count = rhs.failed_alloc_count.load();
+        for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++) request_histogram[i] = rhs.request_histogram[i].load();
+        return *this;
+    }
+
+    // 0 when all free space is one contiguous block, approaching 1 as free space splinters into small holes
+    double fragmentation() const {
+        size_t free = bytes_free;
+        if(free == 0) return 0.0;
+        return 1.0 - (double)largest_free_block / (double)free;
+    }
+
+    static size_t histogramBucket(size_t size) {
+        size_t bucket = 0;
+        while(size > 1 && bucket < HISTOGRAM_BUCKETS-1) {
+            size >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+};
+
 struct ve_memory {
 
+public:
+    static const size_t CONCURRENT_ARENAS = 16;
+    static const size_t THREAD_CACHE_LIMIT = 8;
+    static const size_t GROWTH_MINIMUM = 64 * MEM_KB;
+
 protected:
     struct free_section {
         const size_t begin = 0; // Inclusive
@@ -51,58 +134,289 @@ protected:
     };
 
     typedef std::multiset<free_section*,free_comp> FreeSet;
-    FreeSet _free_set;
+
+    // The free sections within one address range, in physical order and by size. Sections only coalesce with their
+    // neighbours in the same arena, so each arena is guarded by a lock of its own in concurrent mode.
+    struct free_arena {
+        std::mutex lock;
+        FreeSet free_set;
+        free_section* start = nullptr;
+        free_section* end = nullptr;
+        size_t begin = 0; // First address, inclusive
+        size_t limit = 0; // Exclusive
+        std::atomic<size_t> largest; // Size of the largest section; read without the lock to skip arenas
+        free_arena() { largest = 0; }
+    };
+
+    // A single arena spans all memory, unless concurrent mode splits it into CONCURRENT_ARENAS equal address ranges
+    std::vector<free_arena> _arenas;
+    size_t _arena_size = 0;
+
+    ve_memory_stats _stats;
+
+    // Concurrent Mode
+    // Freed chunks are parked in a cache of the freeing thread, and handed straight back to allocations of the same
+    // size from that thread. Cache misses search the arenas one at a time, starting with the thread's own, and full
+    // caches are returned in batches, taking each arena's lock once. Only requests no single arena can serve, which
+    // need free sections running across arena boundaries or growth, take every arena's lock at once.
+    struct cached_chunk {
+        size_t begin; // Inclusive
+        size_t end; // Inclusive
+    };
+    struct thread_cache {
+        std::mutex lock; // Only contended while another thread flushes the caches
+        std::vector<cached_chunk> chunks;
+        const ve_memory* memory;
+        size_t arena; // Where the thread's allocations look first
+        std::atomic<bool> retired; // Its memory left concurrent mode or is gone; never looked up again
+    };
+
+    bool _concurrent = false;
+    std::mutex _cache_list_lock; // Guards the list, which grows as threads first use the memory
+    std::vector<std::shared_ptr<thread_cache>> _thread_caches;
+
+    // Each thread keeps its caches of the memories it uses, shared with those, dropping the retired ones as it goes
+    thread_cache &localCache() {
+        static thread_local std::vector<std::shared_ptr<thread_cache>> caches;
+        for(size_t i = caches.size(); i-- > 0;) {
+            if(caches[i]->retired) caches.erase(caches.begin() + i);
+            else if(caches[i]->memory == this) return *caches[i];
+        }
+        std::shared_ptr<thread_cache> cache(new thread_cache());
+        cache->memory = this;
+        cache->retired = false;
+        {
+            std::lock_guard<std::mutex> guard(_cache_list_lock);
+            cache->arena = _thread_caches.size() % _arenas.size();
+            _thread_caches.push_back(cache);
+        }
+        caches.push_back(cache);
+        return *cache;
+    }
+
+    bool allocFromCache(thread_cache &cache, size_t size, size_t *begin, size_t *end) {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        for(size_t i = cache.chunks.size(); i-- > 0;) {
+            cached_chunk chunk = cache.chunks[i];
+            if(chunk.end - chunk.begin + 1 != size) continue;
+            cache.chunks.erase(cache.chunks.begin() + i);
+            _stats.bytes_cached -= size;
+            *begin = chunk.begin;
+            *end = chunk.end;
+            return true;
+        }
+        return false;
+    }
+
+    // Returns the cached chunks in address order, so the ones of an arena go back under a single lock
+    void flushCache(thread_cache &cache) {
+        std::vector<cached_chunk> batch;
+        {
+            std::lock_guard<std::mutex> guard(cache.lock);
+            batch.swap(cache.chunks);
+            for(const cached_chunk &chunk : batch) _stats.bytes_cached -= chunk.end - chunk.begin + 1;
+        }
+        std::sort(batch.begin(), batch.end(), [](const cached_chunk &lhs, const cached_chunk &rhs) { return lhs.begin < rhs.begin; });
+        size_t i = 0;
+        while(i < batch.size()) {
+            free_arena &arena = _arenas[arenaIndex(batch[i].begin)];
+            if(batch[i].end >= arena.limit) {
+                freeRange(batch[i].begin, batch[i].end + 1, true);
+                i++;
+                continue;
+            }
+            std::lock_guard<std::mutex> guard(arena.lock);
+            for(; i < batch.size() && batch[i].end < arena.limit; i++)
+                internFreeMemChunk(arena, batch[i].begin, batch[i].end + 1);
+        }
+    }
+
+    size_t arenaIndex(size_t address) const {
+        if(_arenas.size() == 1) return 0;
+        return std::min(address / _arena_size, _arenas.size() - 1);
+    }
+
+    // Splits the memory into the given number of arenas, moving the free sections over; merging them back into one
+    // coalesces the sections meeting at the old boundaries. Must not run while other threads use the memory.
+    void setArenas(size_t count) {
+        std::vector<std::pair<size_t, size_t>> sections;
+        for(free_arena &arena : _arenas) {
+            for(free_section* sect = arena.start; sect != nullptr; sect = sect->next)
+                sections.push_back({ sect->begin, sect->end });
+            while(!arena.free_set.empty()) eraseFromFreeSet(arena, arena.free_set.begin());
+        }
+
+        _arena_size = (_reserved_in_bytes + count - 1) / count;
+        if(_arena_size == 0) count = 1;
+        std::vector<free_arena> arenas(count);
+        for(size_t i = 0; i < count; i++) {
+            arenas[i].begin = i * _arena_size;
+            arenas[i].limit = i + 1 < count ? (i + 1) * _arena_size : SIZE_MAX;
+        }
+        _arenas.swap(arenas);
+
+        for(const std::pair<size_t, size_t> &sect : sections) freeRange(sect.first, sect.second, false);
+        updateStats();
+    }
+
+    // DOES NOT UPDATE REFERENCES
+    void insertIntoFreeSet(free_arena &arena, free_section* sect) {
+        arena.free_set.insert(sect);
+        _stats.bytes_free += sect->end - sect->begin;
+        _stats.hole_count++;
+    }
+
+    // DOES NOT UPDATE REFERENCES
+    void eraseFromFreeSet(free_arena &arena, FreeSet::iterator it) {
+        free_section* sect = *it;
+        _stats.bytes_free -= sect->end - sect->begin;
+        _stats.hole_count--;
+        arena.free_set.erase(it);
+        delete sect;
+    }
 
     // DOES NOT UPDATE REFERENCES
-    void removeFromFreeSet(free_section* sect) {
+    void removeFromFreeSet(free_arena &arena, free_section* sect) {
         if(sect == nullptr) return;
-        std::pair<FreeSet::iterator, FreeSet::iterator> range = _free_set.equal_range(sect);
+        std::pair<FreeSet::iterator, FreeSet::iterator> range = arena.free_set.equal_range(sect);
         FreeSet::iterator it = range.first;
         while(it != range.second) {
             if(*it == sect) {
-                _free_set.erase(it);
-                break;
+                eraseFromFreeSet(arena, it);
+                return;
             }
             it++;
         }
         delete sect;
     }
 
+    // Closes the reference gap the section leaves and drops it
+    void unlinkSection(free_arena &arena, free_section* sect) {
+        if(sect->prev != nullptr) sect->prev->next = sect->next;
+        else arena.start = sect->next;
+        if(sect->next != nullptr) sect->next->prev = sect->prev;
+        else arena.end = sect->prev;
+        removeFromFreeSet(arena, sect);
+    }
+
+    // Reserve-and-Commit
+    // The whole quota is reserved as address space up front, so _data never moves, but only the pages backing
+    // [0, _size_in_bytes) are committed. Growing commits more pages and frees them onto the end of the free list.
+    size_t _quota_in_bytes = 0;
+    size_t _reserved_in_bytes = 0; // _quota_in_bytes rounded up to whole pages
+    size_t _committed_in_bytes = 0; // _size_in_bytes rounded up to whole pages
+
+    static size_t pageSize();
+    static vbyte* reserveRegion(size_t size);
+    static bool commitRegion(vbyte* begin, size_t size);
+    static void releaseRegion(vbyte* region, size_t size);
+
+    void reserve(size_t size, size_t quota) {
+        if(quota < size) quota = size;
+        size_t page = pageSize();
+        _quota_in_bytes = quota;
+        _reserved_in_bytes = (quota + page - 1) / page * page;
+        if(_reserved_in_bytes == 0) return;
+        _data = reserveRegion(_reserved_in_bytes);
+        if(_data == nullptr) throw EnvironmentException::MemoryReserveFailed(_reserved_in_bytes);
+        if(!commit(size)) {
+            // A throwing constructor never reaches the destructor that would release the region
+            releaseRegion(_data, _reserved_in_bytes);
+            _data = nullptr;
+            _quota_in_bytes = _reserved_in_bytes = 0;
+            throw EnvironmentException::MemoryReserveFailed(size);
+        }
+    }
+
+    bool commit(size_t size) {
+        if(size > _quota_in_bytes) return false;
+        size_t page = pageSize();
+        size_t committed = (size + page - 1) / page * page;
+        if(committed > _reserved_in_bytes) committed = _reserved_in_bytes;
+        if(committed > _committed_in_bytes) {
+            if(!commitRegion(_data + _committed_in_bytes, committed - _committed_in_bytes)) return false;
+            _committed_in_bytes = committed;
+        }
+        _size_in_bytes = size;
+        return true;
+    }
+
+    // Commit enough to fit an allocation of the given size at the end of memory; must hold every arena's lock
+    bool grow(size_t size) {
+        size_t old_size = _size_in_bytes;
+        if(old_size >= _quota_in_bytes) return false;
+
+        // Trailing free sections already cover part of the request
+        size_t tail = 0;
+        for(size_t i = old_size > 0 ? arenaIndex(old_size - 1) + 1 : 0; i-- > 0;) {
+            free_section* last = _arenas[i].end;
+            if(last == nullptr || last->end != old_size - tail) break;
+            tail += last->end - last->begin;
+            if(last->begin != _arenas[i].begin) break;
+        }
+        size_t needed = size - tail;
+        if(needed < GROWTH_MINIMUM) needed = GROWTH_MINIMUM;
+        size_t new_size = old_size + needed;
+        if(new_size > _quota_in_bytes || new_size < old_size) new_size = _quota_in_bytes;
+        if(new_size - old_size + tail < size) return false;
+
+        if(!commit(new_size)) return false;
+        freeRange(old_size, new_size, false);
+        return true;
+    }
+
+    // Refresh the stats that are derived from the shape of the free sections, after a change to the given arena
+    void updateStats(free_arena &arena) {
+        arena.largest = arena.free_set.empty() ? 0 : (*arena.free_set.rbegin())->end - (*arena.free_set.rbegin())->begin;
+        updateStats();
+    }
+
+    void updateStats() {
+        _stats.bytes_committed = _committed_in_bytes;
+        _stats.bytes_in_use = _size_in_bytes - _stats.bytes_free;
+        size_t largest = 0;
+        for(const free_arena &arena : _arenas) largest = std::max<size_t>(largest, arena.largest);
+        _stats.largest_free_block = largest;
+    }
+
 public:
     vbyte* _data = nullptr;
-    size_t _size_in_bytes = 0;
-    free_section* _free_start;
-    free_section* _free_end;
+    std::atomic<size_t> _size_in_bytes; // Usable (committed) size; only grows, under every arena's lock
 
-    ve_memory() {
-        _data = nullptr;
+    ve_memory() : _arenas(1) {
         _size_in_bytes = 0;
-        _free_start = nullptr;
-        _free_end = nullptr;
+        _arenas[0].limit = SIZE_MAX;
     }
 
-    ve_memory(size_t mem_size, MemoryPrefix prefix = MEM_BYTE) {
-        _size_in_bytes = mem_size * prefix;
-        _data = new vbyte[_size_in_bytes];
-        for(size_t i = 0; i < _size_in_bytes; i++) _data[i] = 0;
-        _free_start = _free_end = new free_section( 0, _size_in_bytes, nullptr, nullptr );
-        _free_set.insert(_free_start);
+    ve_memory(size_t mem_size, MemoryPrefix prefix = MEM_BYTE) : ve_memory(mem_size, prefix, 0, MEM_BYTE) {}
+
+    // Starts with mem_size usable bytes, and grows on demand up to the quota
+    ve_memory(size_t mem_size, MemoryPrefix prefix, size_t quota_size, MemoryPrefix quota_prefix) : ve_memory() {
+        reserve(mem_size * prefix, quota_size * quota_prefix);
+        if(_size_in_bytes > 0) internFreeMemChunk(_arenas[0], 0, _size_in_bytes);
+        updateStats();
     }
 
-    ve_memory(const ve_memory &rhs) {
+    ve_memory(const ve_memory &rhs) : ve_memory() {
         *this = rhs;
     }
 
     ~ve_memory() {
-        if(_data != nullptr) delete [] _data;
-        for(free_section* sect : _free_set) delete sect;
+        for(std::shared_ptr<thread_cache> &cache : _thread_caches) cache->retired = true;
+        if(_data != nullptr) releaseRegion(_data, _reserved_in_bytes);
+        for(free_arena &arena : _arenas)
+            for(free_section* sect : arena.free_set) delete sect;
     }
 
-    vbyte* allocMemChunk(size_t size, size_t *begin, size_t *end) {
+    size_t getQuotaInBytes() const { return _quota_in_bytes; }
+
+protected:
+    // Best fit within one arena; must hold its lock in concurrent mode
+    vbyte* internAllocMemChunk(free_arena &arena, size_t size, size_t *begin, size_t *end) {
 
         // Start with the smallest and iterate bigger
-        FreeSet::iterator it = _free_set.begin();
-        while(it != _free_set.end()) {
+        FreeSet::iterator it = arena.free_set.begin();
+        while(it != arena.free_set.end()) {
             free_section* sect = (*it);
 
             // Select the first free region that can fit the requested size
@@ -119,18 +433,18 @@ public:
                     free_section* newSect = new free_section(newBegin, sect->end, sect->prev, sect->next);
                     if(sect->prev != nullptr) sect->prev->next = newSect;
                     if(sect->next != nullptr) sect->next->prev = newSect;
-                    if(_free_start == sect) _free_start = newSect;
-                    if(_free_end == sect) _free_end = newSect;
-                    _free_set.insert(newSect);
+                    if(arena.start == sect) arena.start = newSect;
+                    if(arena.end == sect) arena.end = newSect;
+                    insertIntoFreeSet(arena, newSect);
                 } else { // Close the reference gap between the prev/next of this removed section
                     if(sect->prev != nullptr) sect->prev->next = sect->next;
                     if(sect->next != nullptr) sect->next->prev = sect->prev;
-                    if(_free_start == sect) _free_start = sect->next;
-                    if(_free_end == sect) _free_end = sect->prev;
+                    if(arena.start == sect) arena.start = sect->next;
+                    if(arena.end == sect) arena.end = sect->prev;
                 }
 
-                _free_set.erase(it);
-                delete sect;
+                eraseFromFreeSet(arena, it);
+                updateStats(arena);
 
                 // Return a pointer to the beginning of the allocated region
                 return resultByte;
@@ -138,28 +452,55 @@ public:
             it++;
         }
 
-        // TODO: Throw Out of Memory Exception when there is no free mem for allocation
         return nullptr;
     }
 
-    vbyte* allocMemChunk(size_t size) { return allocMemChunk(size, nullptr, nullptr); }
-
-    void freeMemChunk(size_t begin, size_t end) {
+    // First fit over all arenas in physical order, following free sections across arena boundaries; must hold every
+    // arena's lock
+    vbyte* internAllocAcrossArenas(size_t size, size_t *begin, size_t *end) {
+        size_t run_begin = 0;
+        size_t run_length = 0;
+        for(free_arena &arena : _arenas)
+            for(free_section* sect = arena.start; sect != nullptr; sect = sect->next) {
+                if(sect->begin != run_begin + run_length) {
+                    run_begin = sect->begin;
+                    run_length = 0;
+                }
+                run_length += sect->end - sect->begin;
+                if(run_length < size) continue;
+
+                for(size_t i = arenaIndex(run_begin); i < _arenas.size() && _arenas[i].begin < run_begin + size; i++)
+                    internTakeRange(_arenas[i], run_begin, run_begin + size);
+                if(begin != nullptr) *begin = run_begin;
+                if(end != nullptr)   *end   = run_begin+size-1;
+                return &_data[run_begin];
+            }
+        return nullptr;
+    }
 
-        // Swap indices if they are out of order
-        if(begin > end) {
-            size_t t = end;
-            end = begin;
-            begin = t;
+    // Cuts [begin, end) out of the arena's free sections. End index is exclusive
+    void internTakeRange(free_arena &arena, size_t begin, size_t end) {
+        free_section* sect = arena.start;
+        while(sect != nullptr) {
+            free_section* next = sect->next;
+            if(sect->begin < end && sect->end > begin) {
+                size_t head = sect->begin;
+                size_t tail = sect->end;
+                unlinkSection(arena, sect);
+                if(head < begin) internFreeMemChunk(arena, head, begin);
+                if(tail > end) internFreeMemChunk(arena, end, tail);
+            }
+            sect = next;
         }
+        updateStats(arena);
+    }
 
-        // Range Check
-        if(begin < 0 || end >= _size_in_bytes) throw EnvironmentException::MemoryFreeOutOfRange(begin, end, _size_in_bytes);
-
-        if(_free_start == nullptr) {
+    // Central free path within one arena; must hold its lock in concurrent mode. End index is exclusive
+    void internFreeMemChunk(free_arena &arena, size_t begin, size_t end) {
+        if(arena.start == nullptr) {
             // No existing free space, make a hole
-            _free_start = _free_end = new free_section( begin, end, nullptr, nullptr );
-            _free_set.insert(_free_start);
+            arena.start = arena.end = new free_section( begin, end, nullptr, nullptr );
+            insertIntoFreeSet(arena, arena.start);
         } else {
 
             // Cache variables
@@ -168,7 +509,7 @@ public:
             bool lookingForBegin = true;
 
             // Start iteration through in physical location order
-            free_section* it = _free_start;
+            free_section* it = arena.start;
             while(it != nullptr) {
                 if(lookingForBegin) {
 
@@ -179,6 +520,7 @@ public:
                         continue;
                     } else if (begin <= it->end) {
                         begin = it->begin;
+                        if(end < it->end) end = it->end;
                         prev = it->prev;
                     } else {
                         it = it->next;
@@ -194,42 +536,192 @@ public:
                     } else if(end <= it->end) {
                         next = it->next;
                         end = it->end;
-                        removeFromFreeSet(it);
+                        removeFromFreeSet(arena, it);
                         break;
                     }
                 }
 
                 free_section* n = it->next;
                 // Remove section from the free set (note: does not update references)
-                removeFromFreeSet(it);
+                removeFromFreeSet(arena, it);
                 it = n;
             }
 
+            // Nothing begins after the chunk; it goes last
+            if(lookingForBegin) prev = arena.end;
+
             free_section* newSect = new free_section( begin, end, prev, next );
 
             // Update boundary references
-            if(prev == nullptr) _free_start = newSect;
+            if(prev == nullptr) arena.start = newSect;
             else prev->next = newSect;
-            if(next == nullptr) _free_end = newSect;
+            if(next == nullptr) arena.end = newSect;
             else next->prev = newSect;
 
-            _free_set.insert(newSect);
+            insertIntoFreeSet(arena, newSect);
         }
+
+        updateStats(arena);
     }
 
+    // Returns [begin, end) to the arenas it covers, taking their locks one at a time if asked to. End index is exclusive
+    void freeRange(size_t begin, size_t end, bool lock) {
+        while(begin < end) {
+            free_arena &arena = _arenas[arenaIndex(begin)];
+            size_t piece_end = std::min(end, arena.limit);
+            std::unique_lock<std::mutex> guard(arena.lock, std::defer_lock);
+            if(lock) guard.lock();
+            internFreeMemChunk(arena, begin, piece_end);
+            begin = piece_end;
+        }
+    }
 
+    void lockArenas() {
+        for(free_arena &arena : _arenas) arena.lock.lock();
+    }
 
-    ve_memory &operator=(const ve_memory &rhs) {
-        _size_in_bytes = rhs._size_in_bytes;
+    void unlockArenas() {
+        for(size_t i = _arenas.size(); i-- > 0;) _arenas[i].lock.unlock();
+    }
+
+public:
+    vbyte* allocMemChunk(size_t size, size_t *begin, size_t *end) {
+
+        _stats.request_histogram[ve_memory_stats::histogramBucket(size)]++;
+
+        vbyte* result = nullptr;
+        if(_concurrent) {
+            thread_cache &cache = localCache();
+            size_t b, e;
+            if(allocFromCache(cache, size, &b, &e)) {
+                if(begin != nullptr) *begin = b;
+                if(end != nullptr)   *end   = e;
+                result = &_data[b];
+            } else {
+                for(size_t i = 0; i < _arenas.size() && result == nullptr; i++) {
+                    free_arena &arena = _arenas[(cache.arena + i) % _arenas.size()];
+                    if(arena.largest < size) continue;
+                    std::lock_guard<std::mutex> guard(arena.lock);
+                    result = internAllocMemChunk(arena, size, begin, end);
+                }
+                // Chunks parked in the caches, or sections running across arenas, may make up a big enough range;
+                // only grow if not
+                if(result == nullptr) {
+                    flushThreadCaches();
+                    lockArenas();
+                    result = internAllocAcrossArenas(size, begin, end);
+                    if(result == nullptr && grow(size)) result = internAllocAcrossArenas(size, begin, end);
+                    unlockArenas();
+                }
+            }
+        } else {
+            result = internAllocMemChunk(_arenas[0], size, begin, end);
+            if(result == nullptr && grow(size)) result = internAllocMemChunk(_arenas[0], size, begin, end);
+        }
+
+        // Out of memory, even after growing to the quota; callers turn this into SWM_RET_OUT_OF_MEMORY
+        if(result == nullptr) _stats.failed_alloc_count++;
+        else _stats.alloc_count++;
+        return result;
+    }
+
+    vbyte* allocMemChunk(size_t size) { return allocMemChunk(size, nullptr, nullptr); }
+
+    void freeMemChunk(size_t begin, size_t end) {
+
+        // Swap indices if they are out of order
+        if(begin > end) {
+            size_t t = end;
+            end = begin;
+            begin = t;
+        }
+
+        // Range Check
+        if(begin < 0 || end >= _size_in_bytes) throw EnvironmentException::MemoryFreeOutOfRange(begin, end, _size_in_bytes);
+
+        _stats.free_count++;
+
+        if(_concurrent) {
+            thread_cache &cache = localCache();
+            bool full;
+            {
+                std::lock_guard<std::mutex> guard(cache.lock);
+                cache.chunks.push_back({ begin, end });
+                _stats.bytes_cached += end - begin + 1;
+                full = cache.chunks.size() > THREAD_CACHE_LIMIT;
+            }
+            if(full) flushCache(cache);
+        } else {
+            // The given end index is inclusive, as handed out by allocMemChunk; free sections use an exclusive end
+            internFreeMemChunk(_arenas[0], begin, end + 1);
+        }
+    }
+
+    // Must not be toggled while other threads are using this memory
+    void setConcurrent(bool concurrent) {
+        if(concurrent == _concurrent) return;
+        if(concurrent) {
+            setArenas(CONCURRENT_ARENAS);
+        } else {
+            flushThreadCaches();
+            for(std::shared_ptr<thread_cache> &cache : _thread_caches) cache->retired = true;
+            _thread_caches.clear();
+            setArenas(1);
+        }
+        _concurrent = concurrent;
+    }
+
+    bool isConcurrent() const { return _concurrent; }
+
+    // Return every cached chunk to the free sections
+    void flushThreadCaches() {
+        std::vector<std::shared_ptr<thread_cache>> caches;
+        {
+            std::lock_guard<std::mutex> guard(_cache_list_lock);
+            caches = _thread_caches;
+        }
+        for(std::shared_ptr<thread_cache> &cache : caches) flushCache(*cache);
+    }
 
-        // TODO: Fix prev/next pointers
-        _free_set = rhs._free_set;
-        _free_start = rhs._free_start;
-        _free_end = rhs._free_end;
+    const ve_memory_stats &getStats() const { return _stats; }
 
-        if(_data != nullptr) delete [] _data;
-        _data = new vbyte[_size_in_bytes];
+
+
+    // Copies are never concurrent; chunks cached by the source remain marked as in use
+    ve_memory &operator=(const ve_memory &rhs) {
+        if(this == &rhs) return *this;
+        setConcurrent(false);
+
+        free_arena &arena = _arenas[0];
+        for(free_section* sect : arena.free_set) delete sect;
+        arena.free_set.clear();
+        arena.start = arena.end = nullptr;
+        if(_data != nullptr) releaseRegion(_data, _reserved_in_bytes);
+        _data = nullptr;
+        _quota_in_bytes = _reserved_in_bytes = _committed_in_bytes = 0;
+        _size_in_bytes = 0;
+
+        _stats = rhs._stats;
+        _stats.bytes_free = 0;
+        _stats.hole_count = 0;
+        reserve(rhs._size_in_bytes, rhs._quota_in_bytes);
         for(size_t i = 0; i < _size_in_bytes; i++) _data[i] = rhs._data[i];
+
+        // Rebuild the free list in physical order; sections meeting at the source's arena boundaries become one
+        for(const free_arena &source : rhs._arenas)
+            for(free_section* it = source.start; it != nullptr; it = it->next) {
+                size_t begin = it->begin;
+                if(arena.end != nullptr && arena.end->end == begin) {
+                    begin = arena.end->begin;
+                    unlinkSection(arena, arena.end);
+                }
+                free_section* sect = new free_section( begin, it->end, arena.end, nullptr );
+                if(arena.end == nullptr) arena.start = sect;
+                else arena.end->next = sect;
+                arena.end = sect;
+                insertIntoFreeSet(arena, sect);
+            }
+        updateStats(arena);
         return *this;
     }
 
@@ -239,31 +731,48 @@ public:
     }
 
     void printFreeSectionsChronological() {
-        if(_free_start == nullptr) {
+        if(_stats.hole_count == 0) {
             std::cout << "No Free Sections" << std::endl;
         } else {
-            free_section* it = _free_start;
-            while (it != nullptr) {
-                std::cout << "[" << it->begin << ":" << it->end << "|" << (it->end - it->begin) << "]-";
-                it = it->next;
+            for(free_arena &arena : _arenas) {
+                free_section* it = arena.start;
+                while (it != nullptr) {
+                    std::cout << "[" << it->begin << ":" << it->end << "|" << (it->end - it->begin) << "]-";
+                    it = it->next;
+                }
             }
             std::cout << std::endl;
         }
     }
 
     void printFreeSectionsOrdered() {
-        if(_free_start == nullptr) {
+        if(_stats.hole_count == 0) {
             std::cout << "No Free Sections" << std::endl;
         } else {
-            FreeSet::iterator it = _free_set.begin();
-            while(it != _free_set.end()) {
-                free_section* sect = *it;
-                std::cout << "[" << sect->begin << ":" << sect->end << "|" << (sect->end - sect->begin) << "]-";
-                it++;
+            for(free_arena &arena : _arenas) {
+                FreeSet::iterator it = arena.free_set.begin();
+                while(it != arena.free_set.end()) {
+                    free_section* sect = *it;
+                    std::cout << "[" << sect->begin << ":" << sect->end << "|" << (sect->end - sect->begin) << "]-";
+                    it++;
+                }
             }
             std::cout << std::endl;
         }
     }
+
+    void printStats() {
+        std::cout << "InUse=" << _stats.bytes_in_use << ", Free=" << _stats.bytes_free
+                  << ", Largest=" << _stats.largest_free_block << ", Holes=" << _stats.hole_count
+                  << ", Fragmentation=" << _stats.fragmentation() << ", Committed=" << _stats.bytes_committed << std::endl;
+        std::cout << "Allocs=" << _stats.alloc_count << ", Frees=" << _stats.free_count
+                  << ", Failed=" << _stats.failed_alloc_count << ", Cached=" << _stats.bytes_cached << std::endl;
+        std::cout << "Request Sizes:";
+        for(size_t i = 0; i < ve_memory_stats::HISTOGRAM_BUCKETS; i++)
+            if(_stats.request_histogram[i] > 0)
+                std::cout << " [" << ((size_t)1 << i) << "+|" << _stats.request_histogram[i] << "]";
+        std::cout << std::endl;
+    }
 };
 
 struct ve_register {
@@ -319,31 +828,36 @@ struct ve_register {
 struct virtual_environment;
 
 struct ve_program {
-    vbyte* _exec = nullptr;
+    std::vector<vbyte> _exec;
     size_t _size = 0;
     //size_t _counter = 0;
     ve_register _counter;
     ve_register _stack;
     size_t _required_memory_size = 0;
 
+    // Chunks allocated by the running program; absolute begin -> end (inclusive) in the environment's memory
+    std::map<size_t, size_t> _dynamic_chunks;
+
     ve_program() {
-        _exec = nullptr;
         _size = 0;
         _required_memory_size = 0;
     }
 
     ve_program(size_t size, vbyte exec[], size_t required_memory_size)
-            : _size(size), _required_memory_size(required_memory_size) {
-        _exec = new vbyte[_size];
-        for(size_t i = 0; i < _size; i++) _exec[i] = exec[i];
+            : _exec(exec, exec + size), _size(size), _required_memory_size(required_memory_size) {}
+
+    // Takes ownership of the bytecode without copying it
+    ve_program(std::vector<vbyte> &&exec, size_t required_memory_size)
+            : _exec(std::move(exec)), _required_memory_size(required_memory_size) {
+        _size = _exec.size();
     }
 
     ve_program(const ve_program &rhs) {
         *this = rhs;
     }
 
-    ~ve_program() {
-        if(_exec != nullptr) delete [] _exec;
+    ve_program(ve_program &&rhs) {
+        *this = std::move(rhs);
     }
 
     ve_program &operator=(const ve_program &rhs) {
@@ -351,9 +865,17 @@ struct ve_program {
         _counter = rhs._counter;
         _stack = rhs._stack;
         _required_memory_size = rhs._required_memory_size;
-        if(_exec != nullptr) delete [] _exec;
-        _exec = new vbyte[_size];
-        for(size_t i = 0; i < _size; i++) _exec[i] = rhs._exec[i];
+        _exec = rhs._exec;
+        return *this;
+    }
+
+    ve_program &operator=(ve_program &&rhs) {
+        _size = rhs._size;
+        _counter = rhs._counter;
+        _stack = rhs._stack;
+        _required_memory_size = rhs._required_memory_size;
+        _exec = std::move(rhs._exec);
+        rhs._size = 0;
         return *this;
     }
 
@@ -364,12 +886,17 @@ struct ve_program {
 protected:
     friend class virtual_environment;
     retcode run(virtual_environment &ve, vbyte* stack_mem, vbyte* heap_mem, size_t stack_size);
+
+    // Dynamic chunks are addressed past the fixed heap; the guest address is _required_memory_size + absolute offset
+    void resolveDynamicAddress(virtual_environment &ve, vbyte* &mem, size_t &mem_pos, size_t &max_size);
+    void freeDynamicChunks(virtual_environment &ve);
 };
 
 class virtual_environment {
 protected:
 
     ve_memory _memory;
+    ve_memory* _shared_memory = nullptr; // Used instead of _memory when set; not owned
 
     size_t _stack_size_in_bytes;
 
@@ -384,14 +911,29 @@ protected:
 
 public:
 
-    virtual_environment(BitWidth max_byte_width, vbyte registry_count, size_t mem_size, MemoryPrefix mem_prefix, size_t stack_size, MemoryPrefix stack_prefix)
-            : _memory(mem_size, mem_prefix), _register_count(registry_count), _max_byte_width(max_byte_width),
+    // Memory starts at mem_size and, if a larger quota is given, grows on demand up to it
+    virtual_environment(BitWidth max_byte_width, vbyte registry_count, size_t mem_size, MemoryPrefix mem_prefix, size_t stack_size, MemoryPrefix stack_prefix,
+                        size_t mem_quota = 0, MemoryPrefix quota_prefix = MEM_BYTE)
+            : _memory(mem_size, mem_prefix, mem_quota, quota_prefix), _stack_size_in_bytes(stack_size*stack_prefix),
               //_stack_ptr(_max_byte_width), _used_stack(stack_size, stack_prefix) {
-              _stack_size_in_bytes(stack_size*stack_prefix) {
+              _register_count(registry_count), _max_byte_width(max_byte_width) {
         _registries = new ve_register[_register_count];
         for(vbyte i = 0; i < _register_count; i++) _registries[i] = ve_register(_max_byte_width);
         if(pow((size_t)2, (size_t)max_byte_width*8) < (mem_size * mem_prefix))
             throw EnvironmentException::MemorySizeInvalid(max_byte_width, mem_size, mem_prefix);
+        if(pow((size_t)2, (size_t)max_byte_width*8) < (mem_quota * quota_prefix))
+            throw EnvironmentException::MemorySizeInvalid(max_byte_width, mem_quota, quota_prefix);
+    }
+
+    // Draws stack and heap from a memory shared with other environments; enable ve_memory::setConcurrent() if the
+    // environments run on different threads
+    virtual_environment(BitWidth max_byte_width, vbyte registry_count, ve_memory &shared_memory, size_t stack_size, MemoryPrefix stack_prefix)
+            : _shared_memory(&shared_memory), _stack_size_in_bytes(stack_size*stack_prefix),
+              _register_count(registry_count), _max_byte_width(max_byte_width) {
+        _registries = new ve_register[_register_count];
+        for(vbyte i = 0; i < _register_count; i++) _registries[i] = ve_register(_max_byte_width);
+        if(pow((size_t)2, (size_t)max_byte_width*8) < shared_memory.getQuotaInBytes())
+            throw EnvironmentException::MemorySizeInvalid(max_byte_width, shared_memory.getQuotaInBytes(), MEM_BYTE);
     }
 
     virtual_environment(const virtual_environment &rhs) {
@@ -404,6 +946,7 @@ public:
 
     virtual_environment &operator=(const virtual_environment &rhs) {
         _memory = rhs._memory;
+        _shared_memory = rhs._shared_memory;
         if(_registries != nullptr) delete [] _registries;
         _register_count = rhs._register_count;
         _registries = new ve_register[_register_count];
@@ -420,11 +963,16 @@ public:
         return _registries[id % _register_count];
     }
 
-    ve_memory &getMemory() { return _memory; }
+    ve_memory &getMemory() { return _shared_memory != nullptr ? *_shared_memory : _memory; }
 
     size_t getStackSizeInBytes() const { return _stack_size_in_bytes; }
     BitWidth getMaxByteWidth() const { return _max_byte_width; }
 
+    void setProgram(ve_program &&program) {
+        _program = std::move(program);
+        _program._counter = 0;
+    }
+
     void setProgram(const ve_program &program) {
         _program = program;
         _program._counter = 0;
@@ -432,7 +980,8 @@ public:
 
     void clear() {
         for(size_t i = 0; i < _register_count; i++) _registries[i].clear();
-        _memory.clear();
+        // Shared memory holds other environments' data; only clear memory this environment owns
+        if(_shared_memory == nullptr) _memory.clear();
     }
 
     retcode run();